@@ -0,0 +1,116 @@
+//
+//  async_subtractor.h
+//  sagmm
+//
+//  Submit/future front end running a model on its own thread.
+//
+
+#ifndef _async_subtractor_h
+#define _async_subtractor_h
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "background_subtraction.h"
+#include "spsc_queue.h"
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * What the model produced for one submitted frame.
+ */
+struct AsyncResult
+{
+    int    frameNo;     // submission order, from 0
+    Mat    fgmask;
+    Mat    background;  // empty unless requested
+    Mat    foreground;  // empty unless requested
+    string error;       // callbacks only: what the model threw, masks then empty
+
+    AsyncResult() : frameNo(-1) { }
+};
+
+
+/**
+ * Runs a BackgroundSubtractorMOG3 on a thread of its own so the caller
+ * can decode, receive or post-process while frames are modelled.
+ *
+ * submit() queues a frame and returns at once with a future of its
+ * result, or calls back on the model thread when it is done. Frames are
+ * modelled strictly in submission order, so the model sees the same
+ * sequence as with synchronous calls. At most queueDepth frames wait; a
+ * further submit() blocks until the model has taken one (backpressure).
+ *
+ * Only a reference to the frame is queued: do not write into a submitted
+ * frame before its result is ready, hand over a fresh (e.g. pool) buffer
+ * every frame. Results get new buffers from the model's buffer pool, if
+ * any. submit() may be called from several threads, their frames are
+ * ordered by submission. The model must not be used directly while frames
+ * are in flight; wait() first. The destructor models what is queued.
+ */
+class AsyncBackgroundSubtractor
+{
+public:
+    enum Flags
+    {
+        BACKGROUND = 1,     // also the background image
+        FOREGROUND = 2,     // also the composited foreground image
+        CLASSIFY   = 4      // classify only, no model update (a skipped frame)
+    };
+
+    typedef std::function<void(const AsyncResult&)> Callback;
+
+    explicit AsyncBackgroundSubtractor(BackgroundSubtractorMOG3& model, size_t queueDepth = 4);
+    ~AsyncBackgroundSubtractor();
+
+    //! the result's future rethrows what the model threw
+    std::future<AsyncResult> submit(const Mat& frame, int flags = 0, double learningRate = -1);
+    //! done is called on the model thread, in order
+    void submit(const Mat& frame, const Callback& done, int flags = 0, double learningRate = -1);
+
+    //! blocks until every submitted frame has been modelled
+    void wait();
+
+    //! frames submitted and not yet modelled
+    size_t inFlight() const { return (size_t)(submitted.load() - completed.load()); }
+
+private:
+    AsyncBackgroundSubtractor(const AsyncBackgroundSubtractor&);
+    AsyncBackgroundSubtractor& operator=(const AsyncBackgroundSubtractor&);
+
+    struct Job
+    {
+        int    frameNo;
+        Mat    frame;
+        int    flags;
+        double learningRate;
+        std::shared_ptr<std::promise<AsyncResult> > promise;
+        Callback callback;
+    };
+
+    void enqueue(Job& job);
+    void run(AsyncResult& result, const Job& job);
+    void worker();
+
+    BackgroundSubtractorMOG3& model;
+    SpscQueue<Job> queue;
+    std::thread thread;
+
+    std::mutex submitLock;      // makes the submitting threads one producer
+    int nextFrame;
+
+    std::atomic<uint64> submitted, completed;
+    std::mutex idleLock;
+    std::condition_variable idle;
+};
+
+#endif
@@ -3,7 +3,20 @@
 
 #include "opencv2/video/background_segm.hpp"
 #include "opencv2/core/core.hpp"
+#include <atomic>
+#include <ctime>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "mixture_store.h"
+#include "model_arena.h"
+#include "model_counters.h"
+#include "model_snapshot.h"
+#include "perf_events.h"
+#include "worker_pool.h"
+#include "zone_occupancy.h"
 
 
 using namespace cv;
@@ -16,21 +29,149 @@ using namespace cv;
 class CV_EXPORTS BackgroundSubtractorMOG3 : public BackgroundSubtractor
 {
 public:
+    /*!
+     Tunable parameters, per instance. Stored in a cv::FileStorage file
+     (YAML or XML) under the names of the class constants; keys missing
+     from a file keep their current value. The defaults are the constants.
+    */
+    struct Parameters
+    {
+        float alpha;            // learning rate when operator() is given a negative one
+        float cf;               // background = strongest modes up to a weight of 1-cf
+        int   gaussiansNo;      // maximal number of modes per pixel
+        float sigma;            // initial variance of a new mode
+        float sigmaMax;
+        float sigmaMin;
+        float pixelRange;       // squared Mahalanobis distance to be background
+        float pixelGen;         // squared Mahalanobis distance to match a mode
+        float ct;               // complexity reduction prior
+        float tau;              // shadow threshold
+        bool  shadowDetection;
+        int   shadowValue;      // mask value of shadow pixels
+
+        Parameters();
+        void read(const FileNode& node);
+        void write(FileStorage& fs) const;
+        bool valid() const;
+    };
+
     //! the default constructor
     BackgroundSubtractorMOG3();
-    //! the full constructor that takes the length of the history, the number of gaussian mixtures, the background ratio parameter and the noise strength
+    //! the full constructor that takes the length of the history, the number of gaussian mixtures, the background ratio parameter and the noise strength;
+    //! a history of n > 0 frames sets the default learning rate to 1/n
     BackgroundSubtractorMOG3(int history,  float varThreshold, bool bShadowDetection=true);
     //! the destructor
     virtual ~BackgroundSubtractorMOG3();
-    //! the update operator
+    //! the update operator. Grey (1 channel) frames get their own kernel and no shadow test
     virtual void operator()(InputArray image, OutputArray fgmask, double learningRate=-1);
+    //! the same, and fgimage gets the frame where fgmask is set (foreground
+    //! and shadow) and the fill colour elsewhere, like copyTo(fgimage, fgmask)
+    //! on a filled image but written by the workers along with the mask
+    void operator()(InputArray image, OutputArray fgmask, OutputArray fgimage, double learningRate=-1);
+
+    //! segments the image against the model without updating it, counts as a skipped frame;
+    //! the model is only read (as by any frame with learning rate 0), which makes it cheaper
+    //! than an update
+    void classify(InputArray image, OutputArray fgmask);
+    void classify(InputArray image, OutputArray fgmask, OutputArray fgimage);
 
-    //! computes a background image which are the mean of all background gaussians
+    //! background colour of the foreground image, in the frame's channels and depth (black)
+    void setForegroundFill(const Scalar& color) { foregroundFill = color; }
+
+    //! the stream had n more frames than the model saw updates (dropped or
+    //! classified only). The next update at the configured learning rate uses
+    //! 1-(1-alpha)^(n+1), the decay of the n+1 frames since the last update,
+    //! so the time constant in seconds stays the same
+    void skipFrames(int n = 1) { framesSkipped += n; }
+
+    //! computes a background image which are the mean of all background gaussians,
+    //! 8-bit with the channels of the frames (1 or 3). Reads the live model: on
+    //! another thread than operator() use snapshot()->getBackgroundImage()
     virtual void getBackgroundImage(OutputArray backgroundImage) const;
 
+    //! read-only view of the model as of the latest frame boundary, for other
+    //! threads while frames go on (see ModelSnapshot). Callable from any thread;
+    //! during a frame it may wait for the frame's end. NULL before the first frame
+    std::shared_ptr<const ModelSnapshot> snapshot() { return snapshots.acquire(); }
+
     //! re-initiaization method
     virtual void initialize(Size frameSize, int frameType);
 
+    //! allocator for masks and background images passed in empty (e.g. a BufferPool), NULL for the heap
+    void setBufferPool(MatAllocator* pool) { outputAllocator = pool; }
+
+    //! collects per-frame counters and stage times into counters, NULL to stop
+    void setCounters(ModelCounters* _counters) { counters = _counters; }
+
+    //! records every update, worker stripe and background image as an event, NULL to stop
+    void setEventLog(PerfEventLog* events) { eventLog = events; }
+
+    //! counts foreground, shadow and changed pixels of every zone of zones
+    //! while the mask is written, NULL to stop
+    void setZoneOccupancy(ZoneOccupancy* zones) { zoneOccupancy = zones; }
+    ZoneOccupancy* getZoneOccupancy() const { return zoneOccupancy; }
+
+    //! runs the update on the pool's pinned workers instead of parallel_for_, each
+    //! always on the same band of rows; set before the first frame so that the
+    //! workers also initialize, and thereby place on their NUMA node, their bands
+    void setWorkerPool(PinnedWorkerPool* pool) { workerPool = pool; }
+
+    //! huge-page allocator of the per-pixel model buffers, NULL for the heap;
+    //! takes effect with the next initialization. Every initialization (and
+    //! change of gaussiansNo) returns the arena's buffers of the previous
+    //! geometry that the new one did not take back
+    void setModelArena(ModelArena* arena) { modelArena = arena; }
+
+    //! parameters in effect for the current frame
+    Parameters getParameters() const;
+    //! takes effect before the next frame without reinitializing the model;
+    //! a different gaussiansNo migrates the model in place. Callable from any thread.
+    //! false (and nothing changes) if a value is out of range
+    bool setParameters(const Parameters& params);
+    //! setParameters() from a file; with checkEvery > 0 the file is checked for
+    //! changes every checkEvery frames and reloaded
+    bool loadParameters(const std::string& fileName, int checkEvery = 0);
+
+    //! keeps the mixtures in a CompactMixtureStore (one dense mode per pixel,
+    //! the others in per-tile overflow arenas) instead of nmixtures slots per
+    //! pixel. Changing it restarts the model with the next frame
+    void setCompactModel(bool enable);
+    bool isCompactModel() const { return compactModel; }
+
+    //! coarse-to-fine update: an 8x8 block whose pixels all provably fit
+    //! their dominant mode, tested against a per-block summary of those
+    //! modes, is written as background without visiting its mixtures and
+    //! only accumulates the decay of its weights, applied at the block's
+    //! next full update. Dense layout only, ignored with a compact model
+    void setCoarseToFine(bool enable);
+    bool isCoarseToFine() const { return coarseToFine; }
+
+    //! every frame classifies all pixels, but only one pixel in k, in a
+    //! pattern that rotates every update frame, gets its modes updated, at
+    //! the learning rate of k frames. Each pixel is updated every k-th
+    //! update frame and model writes drop about k times; pixels without
+    //! modes are always updated. 1 (the default) updates every pixel.
+    //! The coarse-to-fine path updates whole blocks and ignores it
+    void setUpdateSubsampling(int k);
+    int getUpdateSubsampling() const { return updateSubsampling; }
+
+    //! CV_16U frames are fixed point with this many fractional bits and are
+    //! scaled to grey levels (value / 2^bits) before they meet the model, whose
+    //! thresholds and background images are in 8-bit grey levels. mdgkt's
+    //! 16-bit fixed-point output is Q8.8: set mdgkt::FIXED_POINT_BITS for it.
+    //! 0, the default, takes 16-bit values as they are
+    void setFixedPointInput(int fractionalBits);
+    int getFixedPointInput() const { return inputFractionalBits; }
+
+    //! bytes of per-pixel model state (mixtures, mode counts, counters)
+    size_t modelBytes() const;
+
+    //! counts foreground and shadow pixels per row of every update frame,
+    //! which snapshots sum per tile (ModelSnapshot::activity()), e.g. to
+    //! checkpoint only tiles that changed. Safe from any thread, takes
+    //! effect with the next frame
+    void setTileActivity(bool enable) { trackActivity.store(enable, std::memory_order_relaxed); }
+
     //virtual AlgorithmInfo* info() const;
 
 protected:
@@ -128,9 +269,69 @@ protected:
     Mat GaussianModel;
     Mat CurrentGaussianModel;
     Mat BackgroundNumberCounter;
+    // per pixel the slots of its modes by descending weight, nmixtures bytes
+    Mat ModeOrder;
     Mat Background;
     Mat Foreground;
 
+    bool compactModel;
+    CompactMixtureStore compactStore;
+
+    bool coarseToFine;
+    // per block: spread and least variance of the dominant modes, retained
+    // weight and frames left before a forced update, mean of the dominant means
+    Mat blockState;
+    void resetBlockState();
+
+    int updateSubsampling;
+    // fractional bits of CV_16U frames, see setFixedPointInput()
+    int inputFractionalBits;
+    // frames with a model update, selects the pixels of subsampled updates
+    int updateFrames;
+
+    void process(InputArray image, OutputArray fgmask, Mat* fgimage, double learningRate);
+    Scalar foregroundFill;
+
+    friend class ModelSnapshot;
+    friend class ModelSnapshots;
+    friend class ModelCheckpointReader;
+    ModelSnapshots snapshots;
+    // rows of the model from the layout of ModelSnapshot tiles
+    void importRows(const Range& rows, const Mat& modesUsed, const Mat& records);
+
+    // bumped by every initialize(): the model restarted from scratch
+    uint64 generation;
+    // read once per frame, set from any thread
+    std::atomic<bool> trackActivity;
+    // foreground and shadow pixels per row since the initialization
+    vector<uint64> rowActivity;
+
+    void applyParameters(const Parameters& params);
+    void migrateMixtures(int newMixtures);
+    void checkParameterFile();
+
+    // learning rate used when the caller passes a negative one
+    float alpha;
+    // frames without update since the last one
+    int framesSkipped;
+
+    // parameters waiting for the next frame
+    std::mutex parameterLock;
+    Parameters pendingParameters;
+    std::atomic<bool> parametersPending;
+
+    // watched parameter file
+    std::string parameterFile;
+    int parameterCheckEvery;
+    time_t parameterFileTime;
+
+    PinnedWorkerPool* workerPool;
+    ModelArena* modelArena;
+    MatAllocator* outputAllocator;
+    ModelCounters* counters;
+    PerfEventLog* eventLog;
+    ZoneOccupancy* zoneOccupancy;
+
 };
 
 #endif
@@ -0,0 +1,76 @@
+//
+//  buffer_pool.h
+//  sagmm
+//
+//  Recycling allocator for frame, mask and background buffers.
+//
+
+#ifndef _buffer_pool_h
+#define _buffer_pool_h
+
+#include <opencv2/core/core.hpp>
+#include <map>
+#include <mutex>
+#include <vector>
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * MatAllocator that keeps released buffers on per-size free lists.
+ *
+ * Assign it to Mat::allocator before create() (or hand it to the
+ * subtractor/pre-processor with setBufferPool). The Mat reference count
+ * works as usual; when the last Mat referring to a buffer is released, the
+ * buffer returns to the pool instead of the heap and is handed out again
+ * to the next create() of the same byte size. Once every buffer size in
+ * flight has been seen, no further heap allocations happen.
+ *
+ * Buffers start on a 64-byte boundary. The pool is thread safe and must
+ * outlive every Mat allocated from it.
+ */
+class BufferPool : public MatAllocator
+{
+public:
+    static const int ALIGNMENT = 64;
+
+    struct Statistics
+    {
+        size_t allocations;    // buffers taken from the heap
+        size_t reuses;         // buffers handed out again from a free list
+        size_t outstanding;    // buffers currently referenced by Mats
+        size_t cached;         // buffers waiting on the free lists
+        size_t bytesReserved;  // heap bytes held by the pool
+    };
+
+    BufferPool();
+    ~BufferPool();
+
+    void allocate(int dims, const int* sizes, int type, int*& refcount,
+                  uchar*& datastart, uchar*& data, size_t* step);
+    void deallocate(int* refcount, uchar* datastart, uchar* data);
+
+    //! returns the cached buffers to the heap
+    void trim();
+
+    Statistics statistics() const;
+
+private:
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+
+    // header in front of every buffer, refcount is the Mat reference count
+    struct Block
+    {
+        size_t bytes;
+        uchar* data;
+        int    refcount;
+    };
+
+    mutable std::mutex lock;
+    map<size_t, vector<Block*> > freeBlocks;
+    Statistics stats;
+};
+
+#endif
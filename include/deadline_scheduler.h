@@ -0,0 +1,68 @@
+//
+//  deadline_scheduler.h
+//  sagmm
+//
+//  Per-frame decision between a full model update, classification only
+//  and dropping the frame, so that masks meet a latency deadline.
+//
+
+#ifndef _deadline_scheduler_h
+#define _deadline_scheduler_h
+
+#include <opencv2/core/core.hpp>
+#include <iostream>
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Real-time policy of one stream.
+ *
+ * Every frame has a deadline counted from the start of its decoding. The
+ * model stage asks decide() what the remaining time allows: the full
+ * update, classification against the model without update (cheaper, the
+ * model stands still), or nothing. The costs of update and classification
+ * are running averages of what finished() reports. To keep the model
+ * alive under sustained overload, at least one frame in maxSkip is
+ * updated whatever the deadline.
+ *
+ * Frames classified or dropped are passed on to the model with
+ * BackgroundSubtractorMOG3::classify() and skipFrames(), which scale the
+ * learning rate of the next update so the time constant in seconds does
+ * not change. Called from the model stage only.
+ */
+class DeadlineScheduler
+{
+public:
+    enum Decision { UPDATE, CLASSIFY, DROP };
+
+    struct Statistics
+    {
+        uint64 updated;
+        uint64 classified;
+        uint64 dropped;
+        uint64 late;        // frames finished after their deadline
+    };
+
+    //! deadline in seconds; maxSkip 0 allows any number of frames without update
+    DeadlineScheduler(double deadline, int maxSkip = 25);
+
+    //! decision for a frame whose decoding started at decodeTick (getTickCount())
+    Decision decide(int64 decodeTick);
+    //! time the decided work took, and whether the frame made its deadline
+    void finished(Decision decision, double seconds, int64 decodeTick);
+
+    Statistics statistics() const { return stats; }
+    void report(ostream& out) const;
+
+private:
+    double deadline;
+    int    maxSkip;
+    int    sinceUpdate;     // frames since the last update
+    double updateCost;      // running averages, seconds
+    double classifyCost;
+    Statistics stats;
+};
+
+#endif
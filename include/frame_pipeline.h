@@ -0,0 +1,130 @@
+//
+//  frame_pipeline.h
+//  sagmm
+//
+//  Decode / preprocess / model / output stages on separate threads.
+//
+
+#ifndef _frame_pipeline_h
+#define _frame_pipeline_h
+
+#include <opencv2/core/core.hpp>
+#include <functional>
+#include <iostream>
+#include <memory>
+
+#include "background_subtraction.h"
+#include "buffer_pool.h"
+#include "deadline_scheduler.h"
+#include "frame_source.h"
+#include "mdgkt_filter.h"
+#include "perf_events.h"
+#include "spsc_queue.h"
+#include "stage_stats.h"
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * One frame travelling through the pipeline. Every stage fills in its own
+ * Mats; buffers are never shared with the next frame, so a stage may hold
+ * on to a packet while the previous stage works on the following one.
+ */
+struct FramePacket
+{
+    int   frameNo;
+    int64 decodeTick;   // getTickCount() when decoding of the frame started
+    Mat   frame;        // decoded input
+    Mat   image;        // model input, pre-processed or the frame itself
+    Mat   fgmask;       // empty if the scheduler dropped the frame
+    Mat   background;   // empty unless requested for this frame
+    Mat   foreground;   // image over the fill colour where fgmask is set, empty unless requested
+    std::shared_ptr<const ModelSnapshot> snapshot;  // model after the frame, to get background from
+    vector<ZoneOccupancy::Counts> zones;            // of the mask, empty without zones or mask
+
+    FramePacket() : frameNo(-1), decodeTick(0) { }
+};
+
+
+//! the model's part of a frame as decided by a DeadlineScheduler, with
+//! foreground also the composited foreground image; takes the zone counts
+//! if the model has a ZoneOccupancy
+void runModel(BackgroundSubtractorMOG3& model, DeadlineScheduler::Decision decision, FramePacket& packet,
+              bool foreground = false);
+
+
+/**
+ * Runs decode, preprocess, model and output on one thread each, connected
+ * by bounded SPSC queues. Decode of frame t+1 overlaps modeling of frame t
+ * and output of frame t-1; a full queue stalls the stage feeding it.
+ */
+class FramePipeline
+{
+public:
+    typedef std::function<void(const FramePacket&)> OutputFunc;
+
+    FramePipeline(FrameSource& source, BackgroundSubtractorMOG3& model,
+                  mdgkt* preProc = NULL, size_t queueDepth = 4);
+
+    //! called on the output thread for every frame, in order
+    void setOutput(OutputFunc output) { outputFunc = output; }
+    //! computes a background image every n frames, 0 never
+    void setBackgroundEvery(int n) { backgroundEvery = n; }
+    //! computes them from a model snapshot on the output thread, the model
+    //! thread only takes the snapshot and copies rows it is about to update
+    void setSnapshotBackgrounds(bool enable) { snapshotBackgrounds = enable; }
+    //! has the model composite the foreground image of every frame
+    void setForeground(bool enable) { foreground = enable; }
+    //! paces decoding at the given rate, 0 as fast as possible
+    void setRealtime(double fps) { realtimeFps = fps; }
+    void setMaxFrames(int n) { maxFrames = n; }
+    //! takes decoded frames, pre-processed images, masks and backgrounds from the pool
+    void setBufferPool(BufferPool* pool);
+    //! model and pre-processing counters, see ModelCounters
+    void setCounters(ModelCounters* counters);
+    //! records decode and output (and through the model and mdgkt their stages) as events
+    void setEventLog(PerfEventLog* events);
+    //! lets the scheduler trade model updates for latency, NULL updates every frame
+    void setScheduler(DeadlineScheduler* _scheduler) { scheduler = _scheduler; }
+
+    //! runs all stages to the end of the input, returns the number of frames
+    int run();
+
+    //! per-stage throughput/latency plus end-to-end latency
+    void report(ostream& out) const;
+
+private:
+    void decodeStage();
+    void preprocessStage();
+    void modelStage();
+    void outputStage();
+
+    FrameSource& source;
+    BackgroundSubtractorMOG3& model;
+    mdgkt* preProc;
+    BufferPool* bufferPool;
+    PerfEventLog* eventLog;
+    DeadlineScheduler* scheduler;
+
+    OutputFunc outputFunc;
+    int backgroundEvery;
+    bool snapshotBackgrounds;
+    bool foreground;
+    double realtimeFps;
+    int maxFrames;
+    int framesOut;
+
+    SpscQueue<FramePacket> decoded;
+    SpscQueue<FramePacket> preprocessed;
+    SpscQueue<FramePacket> modelled;
+
+    StageStats decodeStats;
+    StageStats preprocessStats;
+    StageStats modelStats;
+    StageStats backgroundStats;
+    StageStats outputStats;
+    StageStats latencyStats;
+};
+
+#endif
@@ -0,0 +1,47 @@
+//
+//  frame_source.h
+//  sagmm
+//
+//  Sources of input frames for the batch runner.
+//
+
+#ifndef _frame_source_h
+#define _frame_source_h
+
+#include <opencv2/opencv.hpp>
+#include <string>
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Sequential source of frames. read() returns false at the end of input.
+ */
+class FrameSource
+{
+public:
+    virtual ~FrameSource() { };
+    virtual bool read(Mat& frame) = 0;
+    //! nominal frame rate of the input, 0 if unknown
+    virtual double fps() const = 0;
+};
+
+
+/**
+ * Frames decoded by cv::VideoCapture (any container/codec it supports).
+ */
+class VideoFileSource : public FrameSource
+{
+public:
+    VideoFileSource(const string& fileName);
+    bool isOpened() const { return video.isOpened(); }
+    bool read(Mat& frame);
+    double fps() const { return rate; }
+
+private:
+    VideoCapture video;
+    double rate;
+};
+
+#endif
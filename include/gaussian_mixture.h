@@ -0,0 +1,139 @@
+//
+//  gaussian_mixture.h
+//  sagmm
+//
+//  Per-pixel mixture component layout and the shadow test, shared by the
+//  model and the benchmarks.
+//
+
+#ifndef _gaussian_mixture_h
+#define _gaussian_mixture_h
+
+#include <opencv2/core/core.hpp>
+
+
+// The model keeps, per pixel, nmixtures GMM entries followed (after all
+// pixels) by nmixtures*nchannels float means. A mode stays in its slot for
+// its life; a separate per-pixel permutation lists the slots by rank.
+struct GMM
+{
+    float weight;
+    float variance;
+    
+    GMM()
+    :weight(1.0f),variance(11.0f) {}
+    
+    GMM(float _w, float _v)
+    :weight(_w),variance(_v) {}
+    
+    //copy constructor
+    GMM (const GMM &_m) { *this = _m; }
+    
+    GMM & operator = (const GMM & rhs) {
+        if ( *this != rhs ) {
+            weight   = rhs.weight;
+            variance = rhs.variance;
+        }
+        return *this;
+    }
+    
+    bool operator != (const GMM & rhs) const {
+        return (weight != rhs.weight) || (variance != rhs.variance);
+    }
+    
+    bool operator == (const GMM & rhs) const {
+        return (weight == rhs.weight) && (variance == rhs.variance);
+    }   
+
+};
+
+struct MEAN 
+{
+    float meanR;
+    float meanG;
+    float meanB;
+    
+    MEAN (float _r, float _g, float _b) 
+    : meanR(_r), meanG(_g), meanB(_b) { } 
+    
+    //copy constructor
+    MEAN (const MEAN &_m) { *this = _m; }
+    
+    MEAN & operator = (const MEAN & rhs) {
+        if ( *this != rhs ) {
+            meanR = rhs.meanR;
+            meanG = rhs.meanG;
+            meanB = rhs.meanB;
+        }
+        return *this;
+    }
+    
+    bool operator != (const MEAN & rhs) const {
+        return 
+        (meanR != rhs.meanR) ||
+        (meanG != rhs.meanG) ||
+        (meanB != rhs.meanB); 
+    }
+    
+    bool operator == (const MEAN & rhs) const {
+        return 
+        (meanR == rhs.meanR) &&
+        (meanG == rhs.meanG) && 
+        (meanB == rhs.meanB); 
+    }   
+};
+
+// shadow detection performed per pixel
+// should work for rgb data, could be usefull for gray scale and depth data as well
+// See: Prati,Mikic,Trivedi,Cucchiarra,"Detecting Moving Shadows...",IEEE PAMI,2003.
+// order lists the slots by rank, NULL if the modes are sorted in place.
+CV_INLINE bool
+detectShadowGMM(const float* data, int nchannels, int nmodes,
+                const GMM* gmm, const float* means,
+                float Tb, float TB, float tau, const uchar* order = NULL)
+{
+    float tWeight = 0;
+
+    // check all the components  marked as background:
+    for( int rank = 0; rank < nmodes; rank++ )
+    {
+        int mode = order ? order[rank] : rank;
+        GMM g = gmm[mode];
+        const float* mean = means + mode*nchannels;
+
+        float numerator = 0.0f;
+        float denominator = 0.0f;
+        for( int c = 0; c < nchannels; c++ )
+        {
+            numerator   += data[c] * mean[c];
+            denominator += mean[c] * mean[c];
+        }
+
+        // no division by zero allowed
+        if( denominator == 0 )
+            return false;
+
+        // if tau < a < 1 then also check the color distortion
+        if( numerator <= denominator && numerator >= tau*denominator )
+        {
+            float a = numerator / denominator;
+            float dist2a = 0.0f;
+
+            for( int c = 0; c < nchannels; c++ )
+            {
+                float dD= a*mean[c] - data[c];
+                dist2a += dD*dD;
+            }
+
+            if (dist2a < Tb*g.variance*a*a)
+                return true;
+        };
+
+        tWeight += g.weight;
+        if( tWeight > TB )
+            return false;
+    };
+    return false;
+}
+
+#endif
@@ -0,0 +1,78 @@
+//
+//  image_sequence.h
+//  sagmm
+//
+//  Directory of numbered still images decoded ahead on worker threads.
+//
+
+#ifndef _image_sequence_h
+#define _image_sequence_h
+
+#include <opencv2/core/core.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "frame_source.h"
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Frames from a directory of numbered JPEG/PNG/... images, ordered by the
+ * last number in the file name (frame9.png before frame10.png).
+ *
+ * A small pool of worker threads reads and decodes frames ahead of the
+ * consumer, into buffers from an optional BufferPool. At most `window`
+ * frames are decoded ahead of the one read() returns next. Workers may
+ * finish out of order; the reorder window hands frames out strictly in
+ * sequence.
+ */
+class ImageSequenceSource : public FrameSource
+{
+public:
+    ImageSequenceSource(const string& directory, int workers = 2, int window = 8,
+                        double fps = 0, BufferPool* pool = NULL,
+                        int flags = CV_LOAD_IMAGE_COLOR);
+    ~ImageSequenceSource();
+
+    bool isOpened() const { return !files.empty(); }
+    bool read(Mat& frame);
+    double fps() const { return rate; }
+    int frameCount() const { return (int)files.size(); }
+
+private:
+    ImageSequenceSource(const ImageSequenceSource&);
+    ImageSequenceSource& operator=(const ImageSequenceSource&);
+
+    struct Slot
+    {
+        int  frameNo;   // frame held by the slot, -1 if empty
+        Mat  image;     // empty if decoding failed
+    };
+
+    void worker();
+
+    vector<string> files;
+    double rate;
+    BufferPool* pool;
+    int flags;
+
+    // slot frameNo % window holds frame frameNo
+    vector<Slot> slots;
+    int window;
+    int nextToDecode;
+    int nextToRead;
+    bool stopping;
+
+    std::mutex lock;
+    std::condition_variable decoded;   // a slot has been filled
+    std::condition_variable consumed;  // the window moved forward
+    vector<std::thread> workers;
+};
+
+#endif
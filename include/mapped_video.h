@@ -0,0 +1,102 @@
+//
+//  mapped_video.h
+//  sagmm
+//
+//  Memory-mapped uncompressed video (YUV4MPEG2 and raw frame dumps).
+//
+
+#ifndef _mapped_video_h
+#define _mapped_video_h
+
+#include <opencv2/core/core.hpp>
+#include <string>
+
+#include "frame_source.h"
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Uncompressed video file mapped into memory.
+ *
+ * Raw dumps (frames of rows*cols*channels bytes back to back, BGR or grey)
+ * and mono Y4M are served zero-copy: frame() returns a Mat header that
+ * points into the mapping. Colour Y4M is planar YUV, so 4:2:0 and 4:4:4
+ * frames are converted to BGR into the caller's buffer.
+ *
+ * The mapping is private: writing into a returned frame does not change
+ * the file. Headers stay valid as long as the MappedVideoFile lives. The
+ * object is read-only after construction, so any number of readers may
+ * share it.
+ */
+class MappedVideoFile
+{
+public:
+    //! YUV4MPEG2 file, geometry and frame rate from its header
+    MappedVideoFile(const string& fileName);
+    //! raw dump of frames of the given size and type (CV_8UC3 BGR or CV_8UC1)
+    MappedVideoFile(const string& fileName, Size size, int type = CV_8UC3, double fps = 0);
+    ~MappedVideoFile();
+
+    bool isOpened() const { return base != NULL; }
+
+    int    frameCount() const { return count; }
+    Size   frameSize() const { return size; }
+    //! type of the frames frame() hands out, CV_8UC3 (BGR) or CV_8UC1
+    int    frameType() const { return type; }
+    double fps() const { return rate; }
+    //! true if frame() hands out headers into the mapping
+    bool   isZeroCopy() const { return format == RAW || format == Y4M_MONO; }
+
+    //! frame number index, false past the end
+    bool frame(int index, Mat& dst) const;
+
+    //! asks the kernel to read the given frames ahead
+    void prefetch(int first, int n) const;
+
+private:
+    MappedVideoFile(const MappedVideoFile&);
+    MappedVideoFile& operator=(const MappedVideoFile&);
+
+    enum Format { RAW, Y4M_MONO, Y4M_420, Y4M_444 };
+
+    bool map(const string& fileName);
+    bool parseY4MHeader();
+    void unmap();
+
+    uchar* base;
+    size_t length;
+
+    Format format;
+    Size   size;
+    int    type;
+    double rate;
+
+    size_t firstFrame;     // offset of the first frame header/data
+    size_t frameHeader;    // bytes of "FRAME\n" in front of every Y4M frame
+    size_t frameBytes;     // payload bytes per frame
+    int    count;
+};
+
+
+/**
+ * Sequential reader over a MappedVideoFile. Several readers may share one
+ * file, each with its own position.
+ */
+class MappedVideoSource : public FrameSource
+{
+public:
+    MappedVideoSource(const Ptr<MappedVideoFile>& file, int firstFrame = 0);
+
+    bool read(Mat& frame);
+    double fps() const { return file->fps(); }
+    void seek(int frameNo) { position = frameNo; }
+    int tell() const { return position; }
+
+private:
+    Ptr<MappedVideoFile> file;
+    int position;
+};
+
+#endif
@@ -0,0 +1,166 @@
+//
+//  mask_archive.h
+//  sagmm
+//
+//  Chunked, indexed archive of foreground masks and background images,
+//  written asynchronously.
+//
+
+#ifndef _mask_archive_h
+#define _mask_archive_h
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "spsc_queue.h"
+
+
+using namespace std;
+using namespace cv;
+
+/*
+ * Archive layout (all integers little endian):
+ *
+ *   "SGMASK01"
+ *   chunk*        "CHNK" u32 records, u64 payload bytes, then the records
+ *   index         u32 count, count * (i32 frameNo, u8 kind, u64 offset)
+ *   footer        u64 index offset, "SGMAIDX1"
+ *
+ *   record        i32 frameNo, u8 kind, u8 codec, i32 rows, i32 cols,
+ *                 i32 type, u32 bytes, then the compressed payload
+ *
+ * Masks are run-length coded (value byte + varint run, runs cross row
+ * ends), backgrounds are PNG. An archive without footer (writer killed)
+ * is still readable: the reader rebuilds the index by scanning the chunks.
+ */
+enum MaskArchiveKind  { ARCHIVE_MASK = 0, ARCHIVE_BACKGROUND = 1 };
+enum MaskArchiveCodec { ARCHIVE_RLE = 0, ARCHIVE_PNG = 1 };
+
+
+/**
+ * Appends masks and backgrounds to an archive from a background thread.
+ *
+ * writeMask()/writeBackground() only queue a reference to the image and
+ * never block: when the queue is full the item is dropped according to
+ * the policy and counted. The caller must not write into a queued image
+ * afterwards; hand over a fresh (e.g. pool) buffer every frame.
+ * Meant for one producer thread.
+ *
+ * A chunk that cannot be written (disk full, I/O error) is counted as a
+ * failure, its records as dropped, and writing stops: later items are
+ * dropped and no index is appended, so the archive ends with the last
+ * chunk written in full and reads back like one whose writer was killed.
+ */
+class MaskArchiveWriter
+{
+public:
+    enum DropPolicy
+    {
+        DROP_NEWEST,            // drop whatever arrives while the queue is full
+        DROP_BACKGROUNDS_FIRST  // backgrounds only while the queue is less than half full
+    };
+
+    struct Statistics
+    {
+        size_t masksWritten;
+        size_t backgroundsWritten;
+        size_t masksDropped;
+        size_t backgroundsDropped;
+        size_t failures;        // chunks (or the index) lost to I/O errors
+        uint64 bytesIn;         // raw image bytes written
+        uint64 bytesOut;        // archive bytes written
+    };
+
+    MaskArchiveWriter(const string& fileName, size_t queueDepth = 32,
+                      DropPolicy policy = DROP_BACKGROUNDS_FIRST, int chunkRecords = 64);
+    ~MaskArchiveWriter();
+
+    bool isOpened() const { return file != NULL; }
+
+    //! queues a CV_8UC1 mask, false if it was dropped
+    bool writeMask(int frameNo, const Mat& mask);
+    //! queues a background image, false if it was dropped
+    bool writeBackground(int frameNo, const Mat& background);
+
+    //! writes everything queued, the index and the footer
+    void close();
+
+    Statistics statistics() const;
+
+private:
+    MaskArchiveWriter(const MaskArchiveWriter&);
+    MaskArchiveWriter& operator=(const MaskArchiveWriter&);
+
+    struct Item
+    {
+        int frameNo;
+        int kind;
+        Mat image;
+    };
+
+    bool enqueue(int frameNo, int kind, const Mat& image);
+    void writer();
+    void flushChunk();
+
+    FILE* file;
+    DropPolicy policy;
+    int chunkRecords;
+
+    SpscQueue<Item> queue;
+    std::thread thread;
+
+    // writer thread state
+    vector<uchar> chunk;
+    vector<uchar> payload;
+    int chunkCount;
+    size_t chunkMasks;          // records of the chunk not yet written
+    uint64 chunkBytesIn;
+    uint64 offset;
+    vector<pair<pair<int,int>, uint64> > index;
+
+    std::atomic<size_t> masksWritten, backgroundsWritten;
+    std::atomic<size_t> masksDropped, backgroundsDropped;
+    std::atomic<size_t> failures;
+    std::atomic<bool> failed;
+    std::atomic<uint64> bytesIn, bytesOut;
+};
+
+
+/**
+ * Random access to an archive by frame number.
+ */
+class MaskArchiveReader
+{
+public:
+    MaskArchiveReader(const string& fileName);
+    ~MaskArchiveReader();
+
+    bool isOpened() const { return file != NULL; }
+    //! number of records in the archive
+    int count() const { return (int)index.size(); }
+    //! frame numbers of all records of one kind, ascending
+    vector<int> frames(int kind) const;
+
+    bool readMask(int frameNo, Mat& mask);
+    bool readBackground(int frameNo, Mat& background);
+
+private:
+    MaskArchiveReader(const MaskArchiveReader&);
+    MaskArchiveReader& operator=(const MaskArchiveReader&);
+
+    bool read(int frameNo, int kind, Mat& image);
+    bool loadIndex();
+    void scanChunks();
+
+    FILE* file;
+    map<pair<int,int>, uint64> index;
+    vector<uchar> payload;
+};
+
+#endif
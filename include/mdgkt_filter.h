@@ -10,6 +10,9 @@
 #define _mdgkt_filter_h
 #include <opencv2/opencv.hpp>
 
+#include "model_counters.h"
+#include "perf_events.h"
+
 
 using namespace std;
 using namespace cv;
@@ -28,9 +31,32 @@ public:
     void initializeFirstImage(const Mat&);
     void initializeFirstImage(const vector<Mat>&);
 
+    /**
+     * Switches between the float reference and the 16-bit fixed-point
+     * implementation of the 3x3xT kernel. Both take CV_8UC3 frames only; the
+     * fixed-point path keeps its history as Q8.8 CV_16UC3 planes; depth selects the
+     * output: CV_8U (rounded grey levels) or CV_16U (Q8.8, value*256, for a
+     * model set up with setFixedPointInput(FIXED_POINT_BITS)).
+     * Worst-case error against the float reference is below 1.0 grey level
+     * for CV_16U output and below 1.5 for CV_8U (see mdgkt_filter.cpp).
+     */
+    void setFixedPoint(bool enable, int depth = CV_8U);
+    bool isFixedPoint() const { return fixedPoint; }
+
+    //! allocator for output images passed in empty (e.g. a BufferPool), NULL for the heap
+    void setBufferPool(MatAllocator* pool) { outputAllocator = pool; }
+
+    //! records the wall time of every call as the PREPROCESS stage, NULL to stop
+    void setCounters(ModelCounters* _counters) { counters = _counters; }
+    //! records every call as a PERF_PREPROCESS event, NULL to stop
+    void setEventLog(PerfEventLog* events) { eventLog = events; }
+
+    // Fractional bits of the fixed-point taps, history and CV_16U output.
+    static const int FIXED_POINT_BITS;
+
 private:
     
-    mdgkt() { };
+    mdgkt() : outputAllocator(NULL), counters(NULL), eventLog(NULL), framesFiltered(0), fixedPoint(false), fixedPointDepth(CV_8U), has_been_initialized(false) { };
     
     virtual ~mdgkt() { };
     mdgkt(const mdgkt &) { };
@@ -41,7 +67,30 @@ private:
     vector<Mat> kernelImageB;
 
     Mat temporalGaussFilter;
-    
+    Mat spatialGaussFilter;
+
+    // Per-frame scratch kept between calls so steady state does not allocate.
+    Mat floatImage;
+    Mat horizontalF;
+    vector<Mat> floatChannels;
+    vector<Mat> temporalAverage;
+    MatAllocator* outputAllocator;
+    ModelCounters* counters;
+    PerfEventLog* eventLog;
+    int framesFiltered;     // since initializeFirstImage, event frame numbers
+
+    void SpatioTemporalFiltering(const Mat&, Mat&);
+    void FixedPointPreprocessing(const Mat&, Mat&);
+
+    // Fixed-point state: Q8.8 history planes, horizontal pass scratch
+    // and the Q8 taps of the spatial and temporal kernels.
+    vector<Mat> kernelImageQ;
+    Mat horizontalQ;
+    vector<int> spatialTapsQ;
+    vector<int> temporalTapsQ;
+    bool fixedPoint;
+    int fixedPointDepth;
+
 
     static const int SPATIO_WINDOW;
     static const int TIME_WINDOW;
@@ -0,0 +1,99 @@
+//
+//  mixture_store.h
+//  sagmm
+//
+//  Variable-length storage of the per-pixel mixtures.
+//
+
+#ifndef _mixture_store_h
+#define _mixture_store_h
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+#include "gaussian_mixture.h"
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Compact alternative to the dense nmixtures-per-pixel model.
+ *
+ * The strongest mode of every pixel is kept in a dense array of
+ * (weight, variance, counter, mean[nchannels]) records, so a unimodal
+ * pixel costs 3+nchannels floats plus a block index. The other modes of a
+ * pixel, at most nmixtures-1, share one block of an overflow arena. Every
+ * band of tileRows rows has its own arena and free list: a pixel takes a
+ * block when it gains a second mode and gives it back when pruning leaves
+ * it with one. Workers own whole tiles, so arenas are never shared and
+ * need no locks.
+ *
+ * Modes are copied out with load() and back with store(); the model
+ * updates the copy with the same code as the dense layout.
+ */
+class CompactMixtureStore
+{
+public:
+    enum { DEFAULT_TILE_ROWS = 16 };
+
+    //! the part of the store one tile owns, as laid out in the store
+    struct TileCopy
+    {
+        int nchannels, nmixtures;
+        vector<float> primary;
+        vector<int>   overflow;
+        vector<float> blocks;
+    };
+
+    CompactMixtureStore();
+
+    void create(Size size, int nchannels, int nmixtures, int tileRows = DEFAULT_TILE_ROWS);
+    void release();
+    bool empty() const { return primary.empty(); }
+
+    int tiles() const { return (int)arenas.size(); }
+    //! rows covered by a tile
+    Range tileRange(int tile) const;
+
+    //! copies the first nmodes modes of pixel idx (row major), means nchannels per mode
+    void load(int idx, int nmodes, GMM* gmm, float* mean, float* counter) const;
+    //! writes back nmodes modes of pixel idx, taking or returning its overflow
+    //! block; order, if given, lists the slots of the copy by rank. During a
+    //! frame only the worker owning the pixel's tile may call it
+    void store(int idx, int nmodes, const GMM* gmm, const float* mean, const float* counter,
+               const uchar* order = NULL);
+
+    //! copies a tile without decoding it, for readers that must not hold
+    //! up the tile's worker for long
+    void copyTile(int tile, TileCopy& copy) const;
+    //! load() of pixel idx, row major from the first row of the tile, out of a copy
+    static void load(const TileCopy& copy, int idx, int nmodes, GMM* gmm, float* mean, float* counter);
+
+    //! bytes held, arenas at their capacity
+    size_t bytes() const;
+    //! overflow blocks in use, i.e. pixels with more than one mode
+    size_t overflowBlocks() const;
+
+private:
+    struct Arena
+    {
+        vector<float> blocks;
+        vector<int>   freeBlocks;
+    };
+
+    int allocateBlock(Arena& arena);
+
+    Size  size;
+    int   nchannels;
+    int   nmixtures;
+    int   tileRows;
+    int   stride;       // floats per mode record
+    int   blockFloats;  // floats per overflow block
+
+    vector<float> primary;
+    vector<int>   overflow;     // block in the tile's arena, -1 for none
+    vector<Arena> arenas;
+};
+
+#endif
@@ -0,0 +1,90 @@
+//
+//  model_arena.h
+//  sagmm
+//
+//  Huge-page backed allocator for the per-pixel model buffers.
+//
+
+#ifndef _model_arena_h
+#define _model_arena_h
+
+#include <opencv2/core/core.hpp>
+#include <map>
+#include <mutex>
+#include <vector>
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * MatAllocator for the large, long-lived model planes (mixtures, mode
+ * counters, mode counts).
+ *
+ * Every buffer is its own anonymous mapping, rounded up to 2 MB and 2 MB
+ * aligned, so its data (64-byte aligned) is covered by huge pages: explicit
+ * ones (MAP_HUGETLB) when the system has reserved any, otherwise
+ * transparent huge pages requested with madvise(MADV_HUGEPAGE). A 4K model
+ * of a few hundred MB then needs a few hundred TLB entries instead of
+ * tens of thousands. With hugePages false, or where neither is available,
+ * buffers are plain page-aligned mappings.
+ *
+ * Released buffers stay mapped on per-size free lists, like BufferPool,
+ * so a model initialized again with the same geometry (a new sequence,
+ * changed compact mode) gets its old pages back, already faulted in. The
+ * model trims the lists once its new buffers are allocated, so buffers of
+ * an old geometry are not held on to.
+ * Thread safe; must outlive the Mats allocated from it.
+ */
+class ModelArena : public MatAllocator
+{
+public:
+    static const int    ALIGNMENT = 64;
+    static const size_t HUGE_PAGE = 2 << 20;
+
+    struct Statistics
+    {
+        size_t mappings;        // buffers mapped
+        size_t reuses;          // buffers handed out again from a free list
+        size_t outstanding;
+        size_t cached;
+        size_t bytesMapped;
+        size_t explicitHuge;    // mappings backed by MAP_HUGETLB
+        size_t transparentHuge; // mappings advised MADV_HUGEPAGE
+    };
+
+    explicit ModelArena(bool hugePages = true);
+    ~ModelArena();
+
+    void allocate(int dims, const int* sizes, int type, int*& refcount,
+                  uchar*& datastart, uchar*& data, size_t* step);
+    void deallocate(int* refcount, uchar* datastart, uchar* data);
+
+    //! unmaps the cached buffers
+    void trim();
+
+    Statistics statistics() const;
+
+private:
+    ModelArena(const ModelArena&);
+    ModelArena& operator=(const ModelArena&);
+
+    // header at the start of every mapping
+    struct Block
+    {
+        size_t bytes;       // requested, the free list key
+        size_t mapped;
+        uchar* data;
+        int    refcount;
+    };
+
+    Block* mapBlock(size_t bytes);
+    void unmapBlock(Block* block);
+
+    bool hugePages;
+    mutable std::mutex lock;
+    std::map<size_t, vector<Block*> > freeBlocks;
+    Statistics stats;
+};
+
+#endif
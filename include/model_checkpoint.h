@@ -0,0 +1,183 @@
+//
+//  model_checkpoint.h
+//  sagmm
+//
+//  Incremental checkpoints of the model: only tiles that changed are
+//  written, into a log replayed on restart.
+//
+
+#ifndef _model_checkpoint_h
+#define _model_checkpoint_h
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "model_snapshot.h"
+
+
+using namespace std;
+using namespace cv;
+
+class BackgroundSubtractorMOG3;
+
+/*
+ * Checkpoint log layout (all integers little endian, floats as their bits):
+ *
+ *   "SGMCKPT1"
+ *   record*       kind[4], u32 payload bytes, u32 FNV-1a of the payload,
+ *                 then the payload
+ *
+ *   "BASE"        i32 width, i32 height, i32 type, i32 mixtures, i32 tile rows
+ *   "TILE"        i32 tile, i32 frame, then the tile's mode counts (rows x
+ *                 width bytes) and records (ModelSnapshot::readTile())
+ *   "CMIT"        i32 frame, u32 tiles written by the checkpoint
+ *
+ * A log holds one BASE, the full model as of its first CMIT, then the
+ * checkpoints after it, each its tiles followed by a CMIT. A replay takes
+ * the latest TILE of every tile up to the last CMIT; what follows it (a
+ * writer killed mid-checkpoint) is ignored, as is everything from the
+ * first record whose checksum does not match.
+ */
+
+
+/**
+ * Writes checkpoints of a model from a background thread, periodically
+ * and on checkpoint().
+ *
+ * Every checkpoint takes a snapshot of the model (ModelSnapshot) and
+ * appends only the tiles whose activity since they were last written (the
+ * foreground and shadow pixels the model counted, see setTileActivity(),
+ * which the writer enables) reaches the dirty threshold, so a mostly
+ * static scene costs little I/O at any resolution. Every tile is also
+ * rewritten after at most maxAge checkpoints, staggered, to keep the slow
+ * drift of the background. A model reinitialized (new geometry, type or
+ * mixtures, or a restart) and a log grown past compactionRatio times a
+ * full checkpoint are written out in full to a new file that replaces the
+ * log by rename, so the log on disk is always replayable.
+ *
+ * The writer may be opened from any thread, also while the model is
+ * running. Close the writer before the model goes away.
+ */
+class ModelCheckpointWriter
+{
+public:
+    struct Statistics
+    {
+        size_t checkpoints;
+        size_t tilesWritten;
+        size_t tilesSkipped;    // clean tiles left out of a checkpoint
+        size_t compactions;     // full rewrites of the log
+        size_t failures;        // checkpoints lost to I/O errors
+        uint64 bytesWritten;
+        uint64 logBytes;        // size of the log now
+    };
+
+    //! interval in seconds between checkpoints, 0 for checkpoint() only
+    ModelCheckpointWriter(BackgroundSubtractorMOG3& model, const string& fileName, double interval = 60);
+    ~ModelCheckpointWriter();
+
+    //! false if the log's directory cannot be written
+    bool isOpened() const { return opened; }
+
+    //! a tile is dirty once its activity reaches fraction x its pixels
+    void setDirtyThreshold(double fraction);
+    //! checkpoints a clean tile may be left out of, 0 for no limit
+    void setMaxAge(int checkpoints);
+    //! log size, in full checkpoints, that triggers a compaction
+    void setCompactionRatio(double ratio);
+
+    //! asks for a checkpoint as soon as possible, does not wait for it;
+    //! requests while one is pending are merged
+    void checkpoint();
+
+    //! writes a last checkpoint and stops the thread
+    void close();
+
+    Statistics statistics() const;
+
+private:
+    ModelCheckpointWriter(const ModelCheckpointWriter&);
+    ModelCheckpointWriter& operator=(const ModelCheckpointWriter&);
+
+    void writer();
+    void write(const ModelSnapshot& snapshot);
+    bool compact(const ModelSnapshot& snapshot);
+    bool writeTile(FILE* out, const ModelSnapshot& snapshot, int tile);
+    bool writeRecord(FILE* out, const char* kind);
+    uint64 fullBytes(const ModelSnapshot& snapshot) const;
+
+    BackgroundSubtractorMOG3& model;
+    string fileName;
+    double interval;
+    bool opened;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    bool requested, stopping;
+    double threshold;
+    int maxAge;
+    double compactionRatio;
+    std::thread thread;
+
+    // writer thread state
+    FILE* file;                     // the log, open for appending
+    uint64 generation;
+    Size frameSize;
+    int frameType, nmixtures;
+    vector<uint64> writtenActivity; // tile activity as of its last write
+    size_t checkpointNo;
+    vector<uchar> payload;
+    Mat modesUsed, records;
+
+    std::atomic<size_t> checkpoints, tilesWritten, tilesSkipped, compactions, failures;
+    std::atomic<uint64> bytesWritten, logBytes;
+};
+
+
+/**
+ * Reads the last complete checkpoint of a log and restores a model to it.
+ */
+class ModelCheckpointReader
+{
+public:
+    ModelCheckpointReader(const string& fileName);
+    ~ModelCheckpointReader();
+
+    //! true if the log holds a complete checkpoint
+    bool isOpened() const { return file != NULL && complete; }
+    //! frames the model had seen at the checkpoint
+    int frame() const { return frameNo; }
+    Size size() const { return frameSize; }
+    int type() const { return frameType; }
+    int mixtures() const { return nmixtures; }
+
+    //! reinitializes the model to the checkpoint's geometry, type and
+    //! mixtures and loads its modes; the model's other settings (compact
+    //! layout, thresholds) stay. The model's next frame continues from
+    //! the checkpoint if it has the same size and type.
+    bool restore(BackgroundSubtractorMOG3& model);
+
+private:
+    ModelCheckpointReader(const ModelCheckpointReader&);
+    ModelCheckpointReader& operator=(const ModelCheckpointReader&);
+
+    void scan();
+    bool readPayload(uint64 offset, unsigned bytes);
+
+    FILE* file;
+    bool complete;
+    Size frameSize;
+    int frameType, nmixtures, tileRows, frameNo;
+    // payload offset and bytes of the latest committed TILE of every tile
+    vector<pair<uint64, unsigned> > tiles;
+    vector<uchar> payload;
+};
+
+#endif
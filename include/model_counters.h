@@ -0,0 +1,96 @@
+//
+//  model_counters.h
+//  sagmm
+//
+//  Per-frame model health counters and per-stage wall time.
+//
+
+#ifndef _model_counters_h
+#define _model_counters_h
+
+#include <opencv2/core/core.hpp>
+#include <mutex>
+#include <vector>
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Counters filled in by BackgroundSubtractorMOG3 and mdgkt once attached
+ * with setCounters(); detached (NULL, the default) they cost nothing.
+ *
+ * Workers of the model keep their counts on the stack and fold them in
+ * once per stripe of rows with addPartial(); the model brackets every
+ * frame with beginFrame()/endFrame(). snapshot() may be called from any
+ * thread at any time.
+ */
+class ModelCounters
+{
+public:
+    enum Stage { PREPROCESS, UPDATE, SHADOW, BACKGROUND, STAGE_COUNT };
+    enum { MAX_MODES = 256 };
+
+    //! counts of one stripe of rows, accumulated by one worker
+    struct Partial
+    {
+        uint64 pixels;
+        uint64 foreground;
+        uint64 shadow;
+        uint64 newModes;        // modes added or replacing the weakest one
+        uint64 prunedModes;
+        uint64 skipped;         // pixels of blocks classified without update (coarse-to-fine)
+        uint64 modes[MAX_MODES];// pixels by number of modes after the update
+        double updateSeconds;   // worker time
+        double shadowSeconds;
+
+        Partial();
+    };
+
+    struct Counts
+    {
+        uint64 pixels;
+        uint64 foreground;
+        uint64 shadow;
+        uint64 newModes;
+        uint64 prunedModes;
+        uint64 skipped;
+        double stageSeconds[STAGE_COUNT];   // wall time
+
+        Counts();
+        double foregroundRatio() const { return pixels ? (double)foreground/pixels : 0.0; }
+        double shadowRatio() const { return pixels ? (double)shadow/pixels : 0.0; }
+        double skippedRatio() const { return pixels ? (double)skipped/pixels : 0.0; }
+    };
+
+    struct Snapshot
+    {
+        uint64 frames;
+        Counts total;                   // since construction or reset()
+        Counts last;                    // last completed frame (stages: last call)
+        vector<uint64> modesHistogram;  // last frame, index = modes per pixel
+    };
+
+    ModelCounters();
+
+    void beginFrame();
+    void addPartial(const Partial& partial);
+    //! wallSeconds of the update, split between update and shadow by worker time
+    void endFrame(double wallSeconds);
+    //! wall time of one call of a stage outside the update (preprocess, background)
+    void addStageTime(Stage stage, double seconds);
+
+    Snapshot snapshot() const;
+    void reset();
+
+    static const char* stageName(Stage stage);
+
+private:
+    mutable std::mutex lock;
+    uint64 frames;
+    Counts total, last;
+    Partial current;
+    vector<uint64> histogram;
+};
+
+#endif
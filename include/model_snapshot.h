@@ -0,0 +1,182 @@
+//
+//  model_snapshot.h
+//  sagmm
+//
+//  Read-only views of the model as of a frame boundary.
+//
+
+#ifndef _model_snapshot_h
+#define _model_snapshot_h
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "mixture_store.h"
+
+
+using namespace std;
+using namespace cv;
+
+class BackgroundSubtractorMOG3;
+
+/**
+ * The model as it was after one frame, for readers on other threads
+ * (background images, health checks, checkpoints).
+ *
+ * The model is split into bands of TILE_ROWS rows. A tile stays shared with
+ * the live model until the model is about to write it; the worker updating
+ * the tile copies it into the snapshot first (copy-on-write). The copy is
+ * the tile's slice of the model buffers byte for byte, dense or compact;
+ * readers decode it. Once a frame has passed every tile is a copy and the
+ * snapshot no longer refers to the model. A reader of a tile still shared
+ * and the worker copying it take the tile's lock, which the reader only
+ * holds for the raw copy, so the update never waits for more than one tile.
+ *
+ * Tiles read out as the mode count of each pixel and, per pixel, nmixtures
+ * records of (weight, variance, counter, mean[channels]) by descending
+ * weight, the records past the mode count zero.
+ */
+class ModelSnapshot
+{
+public:
+    enum { TILE_ROWS = CompactMixtureStore::DEFAULT_TILE_ROWS };
+
+    //! frames the model had seen since its initialization
+    int frame() const { return frameNo; }
+    Size size() const { return frameSize; }
+    int type() const { return frameType; }
+    int channels() const { return nchannels; }
+    int mixtures() const { return nmixtures; }
+    //! floats per mode record
+    int recordFloats() const { return 3 + nchannels; }
+
+    int tiles() const { return (int)tileData.size(); }
+    //! rows covered by a tile
+    Range tileRange(int tile) const;
+
+    //! initializations of the model so far; snapshots of one generation
+    //! continue each other
+    uint64 generation() const { return modelGeneration; }
+    //! foreground and shadow pixels of a tile over the update frames of the
+    //! generation, 0 unless the model tracks them (setTileActivity())
+    uint64 activity(int tile) const { return tileActivity[tile]; }
+
+    //! modesUsed (rows x cols, CV_8U) and records (one row of nmixtures
+    //! records per pixel, CV_32F) of a tile, decoded into the Mats' buffers
+    void readTile(int tile, Mat& modesUsed, Mat& records) const;
+
+    //! the model's getBackgroundImage() as of the snapshot
+    void getBackgroundImage(OutputArray backgroundImage) const;
+
+    //! for the model's workers: copies the tiles of rows [y0, y1) still
+    //! shared with the model, before the model writes them
+    void preserve(int y0, int y1);
+
+private:
+    friend class ModelSnapshots;
+
+    ModelSnapshot(const BackgroundSubtractorMOG3& model, int frame);
+    ModelSnapshot(const ModelSnapshot&);
+    ModelSnapshot& operator=(const ModelSnapshot&);
+
+    void preserveTile(int tile);
+    void preserveAll();
+    bool complete() const { return copiedTiles.load() == tiles(); }
+
+    struct Tile
+    {
+        std::mutex lock;
+        std::atomic<bool> copied;
+        // the model buffers of the tile's rows as they were
+        Mat modesUsed;
+        Mat gmm, mean, counter, order;      // dense layout
+        CompactMixtureStore::TileCopy store; // compact layout
+
+        Tile() : copied(false) { }
+    };
+
+    void copyTile(int tile, Tile& copy) const;
+    void decodeTile(int tile, const Tile& copy, Mat& modesUsed, Mat& records) const;
+
+    const BackgroundSubtractorMOG3& model;
+    int   frameNo;
+    Size  frameSize;
+    int   frameType;
+    int   nchannels;
+    int   nmixtures;
+    float backgroundRatio;
+    bool  compact;
+    uint64 modelGeneration;
+    vector<uint64> tileActivity;
+
+    mutable vector<Tile> tileData;
+    std::atomic<int> copiedTiles;
+};
+
+
+/**
+ * Hands out snapshots of one model, see BackgroundSubtractorMOG3::snapshot().
+ *
+ * Between frames a snapshot of the current state is made (only a header,
+ * no copy). During a frame a reader shares the snapshot of the boundary
+ * the frame started from, if one was open then; otherwise it waits for the
+ * end of the frame. At most one snapshot shares tiles with the model: a
+ * frame that finds one open has its workers copy every tile before writing
+ * it, and completes the copies it did not get to when it ends, after
+ * letting go of the lock readers take. A frame that only reads the model
+ * (Update::setReadOnly()) copies nothing; the snapshot stays shared and
+ * current. Nothing is copied while no reader holds a snapshot.
+ */
+class ModelSnapshots
+{
+public:
+    explicit ModelSnapshots(const BackgroundSubtractorMOG3& model);
+
+    //! a snapshot of the latest frame boundary, NULL before the first frame
+    std::shared_ptr<const ModelSnapshot> acquire();
+
+    //! the model is inside a frame (or reinitializing) during its lifetime;
+    //! scopes nest, frame is read at the end of the outermost one
+    class Update
+    {
+    public:
+        Update(ModelSnapshots& snapshots, const int& frame);
+        ~Update();
+
+        //! the frame leaves the model as it was (classification only)
+        void setReadOnly(bool readOnly);
+
+    private:
+        ModelSnapshots& snapshots;
+        const int& frame;
+    };
+
+    //! the snapshot the workers of the current frame must preserve, or NULL
+    ModelSnapshot* preserving() const;
+
+    //! the model buffers are about to be reallocated: the open snapshot
+    //! copies what it still shares and a new one is made from then on
+    void detach();
+
+private:
+    void beginUpdate();
+    void endUpdate(int frame);
+    void setReadOnly(bool enable);
+
+    const BackgroundSubtractorMOG3& model;
+
+    mutable std::mutex lock;
+    std::condition_variable boundary;
+    int updates;        // nesting depth of Update scopes
+    int waiting;        // readers waiting for the end of the frame
+    int lastFrame;
+    bool readOnly;      // the frame running does not write the model
+    std::weak_ptr<ModelSnapshot> current;   // snapshot of the latest boundary
+    std::shared_ptr<ModelSnapshot> active;  // preserved by the frame running
+};
+
+#endif
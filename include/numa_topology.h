@@ -0,0 +1,47 @@
+//
+//  numa_topology.h
+//  sagmm
+//
+//  NUMA nodes and their CPUs, and the node a page of memory lives on.
+//
+
+#ifndef _numa_topology_h
+#define _numa_topology_h
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+
+using namespace std;
+using namespace cv;
+
+struct NumaNode
+{
+    int id;
+    vector<int> cpus;
+};
+
+
+/**
+ * Nodes as listed under /sys/devices/system/node (nodeN/cpulist). Machines
+ * without that tree, and non-Linux systems, show up as one node 0 holding
+ * all CPUs.
+ */
+class NumaTopology
+{
+public:
+    NumaTopology();
+
+    int nodes() const { return (int)nodeList.size(); }
+    const NumaNode& node(int i) const { return nodeList[i]; }
+    int cpus() const;
+
+    //! pages of [data, data + bytes) on each node, indexed by node id;
+    //! empty if the placement cannot be queried
+    static vector<size_t> pagesByNode(const void* data, size_t bytes);
+
+private:
+    vector<NumaNode> nodeList;
+};
+
+#endif
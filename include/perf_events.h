@@ -0,0 +1,160 @@
+//
+//  perf_events.h
+//  sagmm
+//
+//  Structured performance events recorded into per-thread lock-free rings
+//  and drained to log4cplus and/or a Chrome trace file.
+//
+
+#ifndef _perf_events_h
+#define _perf_events_h
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spsc_queue.h"
+
+
+using namespace std;
+using namespace cv;
+
+enum PerfStage
+{
+    PERF_DECODE,
+    PERF_PREPROCESS,
+    PERF_MODEL,         // counters: pixels
+    PERF_STRIPE,        // one worker's share of the model; counters: first row, rows
+    PERF_BACKGROUND,
+    PERF_OUTPUT,
+    PERF_STAGE_COUNT
+};
+
+
+/**
+ * One event, fixed size. Times are CPU ticks (TSC where available).
+ */
+struct PerfEvent
+{
+    uint64 start;
+    uint64 end;
+    int    frameNo;
+    short  stage;
+    short  thread;      // index of the recording thread's ring
+    uint64 counters[2]; // stage specific
+
+    PerfEvent() : start(0), end(0), frameNo(-1), stage(0), thread(0) { counters[0] = counters[1] = 0; }
+};
+
+
+/**
+ * Event channel for the hot paths.
+ *
+ * record() never blocks and never allocates after a thread's first event:
+ * every recording thread gets its own SPSC ring, a full ring drops the
+ * event (counted in dropped()). A drainer thread empties the rings every
+ * few milliseconds and writes the events, ordered by start time within a
+ * batch, to the "sagmm.perf" log4cplus logger (INFO) and/or a Chrome trace
+ * file (chrome://tracing, Perfetto). Hot paths take a PerfEventLog* that
+ * is NULL when profiling is off.
+ */
+class PerfEventLog
+{
+public:
+    enum Sink { SINK_LOG = 1, SINK_TRACE = 2 };
+
+    PerfEventLog(size_t ringCapacity = 4096, int drainIntervalMs = 10);
+    ~PerfEventLog();
+
+    //! formats events through log4cplus
+    void enableLog() { sinks |= SINK_LOG; }
+    //! writes a Chrome trace JSON file, false if it cannot be created
+    bool openTrace(const string& fileName);
+
+    //! starts the drainer
+    void start();
+    //! stops the drainer, drains what is left and closes the trace file
+    void stop();
+
+    void record(PerfStage stage, int frameNo, uint64 start, uint64 end,
+                uint64 counter0 = 0, uint64 counter1 = 0);
+
+    uint64 recorded() const { return recordedEvents; }
+    uint64 dropped() const { return droppedEvents; }
+
+    //! current time in the unit of event timestamps
+    static uint64 now() { return (uint64)getCPUTickCount(); }
+    static const char* stageName(PerfStage stage);
+
+private:
+    PerfEventLog(const PerfEventLog&);
+    PerfEventLog& operator=(const PerfEventLog&);
+
+    struct Ring
+    {
+        Ring(size_t capacity, int _thread) : events(capacity), thread(_thread) { }
+        SpscQueue<PerfEvent> events;
+        int thread;
+    };
+
+    Ring* threadRing();
+    void drainer();
+    void drain();
+    void write(const PerfEvent& e);
+    double microseconds(uint64 ticks) const;
+
+    const uint64 id;            // key of the log in the per-thread ring maps
+    size_t ringCapacity;
+    int drainInterval;
+    int sinks;
+
+    std::mutex lock;            // ring registration, drainer wake-up
+    std::condition_variable wake;
+    vector<Ring*> rings;
+    std::thread thread;
+    bool running;
+
+    // drainer state
+    vector<PerfEvent> batch;
+    FILE* trace;
+    bool firstTraceEvent;
+    uint64 tickOrigin;
+    int64 wallOrigin;
+    double ticksPerMicrosecond;
+
+    std::atomic<uint64> recordedEvents, droppedEvents;
+};
+
+
+/**
+ * Records one event for the lifetime of the scope, nothing if log is NULL.
+ */
+class PerfScope
+{
+public:
+    PerfScope(PerfEventLog* _log, PerfStage _stage, int _frameNo)
+    : log(_log), stage(_stage), frameNo(_frameNo), start(_log ? PerfEventLog::now() : 0)
+    {
+        counters[0] = counters[1] = 0;
+    }
+    ~PerfScope()
+    {
+        if (log)
+            log->record(stage, frameNo, start, PerfEventLog::now(), counters[0], counters[1]);
+    }
+
+    uint64 counters[2];
+
+private:
+    PerfEventLog* log;
+    PerfStage stage;
+    int frameNo;
+    uint64 start;
+};
+
+#endif
@@ -0,0 +1,119 @@
+//
+//  spsc_queue.h
+//  sagmm
+//
+//  Bounded single-producer/single-consumer lock-free ring buffer.
+//
+
+#ifndef _spsc_queue_h
+#define _spsc_queue_h
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+
+/**
+ * Lock-free ring buffer for exactly one producer and one consumer thread.
+ * Capacity is rounded up to a power of two. push()/pop() block with
+ * backoff (backpressure) while the ring is full/empty; tryPush()/tryPop()
+ * never block. After close() the consumer drains what is left and then
+ * pop() returns false.
+ */
+template<typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity)
+    : head(0), tail(0), isClosed(false)
+    {
+        size_t n = 1;
+        while (n < capacity)
+            n <<= 1;
+        ring.resize(n);
+        mask = n - 1;
+    }
+
+    bool tryPush(const T& item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == ring.size())
+            return false;
+        ring[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = ring[h & mask];
+        // drop the ring's reference so buffers are released with the item
+        ring[h & mask] = T();
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    //! blocks while the queue is full; false if it has been closed
+    bool push(const T& item)
+    {
+        for (int spin = 0; !tryPush(item); spin++) {
+            if (closed())
+                return false;
+            backoff(spin);
+        }
+        return true;
+    }
+
+    //! blocks while the queue is empty; false once closed and drained
+    bool pop(T& item)
+    {
+        for (int spin = 0; !tryPop(item); spin++) {
+            if (closed())
+                return tryPop(item);
+            backoff(spin);
+        }
+        return true;
+    }
+
+    void close() { isClosed.store(true, std::memory_order_release); }
+    bool closed() const { return isClosed.load(std::memory_order_acquire); }
+
+    size_t size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return ring.size(); }
+
+private:
+    SpscQueue(const SpscQueue&);
+    SpscQueue& operator=(const SpscQueue&);
+
+    static void backoff(int spin)
+    {
+        if (spin < 64)
+            return;
+        else if (spin < 128)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    std::vector<T> ring;
+    size_t mask;
+
+    // consumer and producer indices on their own cache lines; padding
+    // rather than alignas so heap allocated owners need no aligned new
+    char padHead[64];
+    std::atomic<size_t> head;
+    char padTail[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    char padClosed[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<bool>   isClosed;
+};
+
+#endif
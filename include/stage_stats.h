@@ -0,0 +1,60 @@
+//
+//  stage_stats.h
+//  sagmm
+//
+//  Per-stage latency samples with throughput and percentile report.
+//
+
+#ifndef _stage_stats_h
+#define _stage_stats_h
+
+#include <opencv2/core/core.hpp>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Collects the latency of every invocation of one processing stage.
+ * Up to expectedSamples samples are kept in full, so percentiles are exact;
+ * past that a uniform reservoir of that many stands in for all of them and
+ * recording never allocates. Count, total, last and maximum stay exact.
+ */
+class StageStats
+{
+public:
+    StageStats(const string& name, size_t expectedSamples = 1 << 16);
+
+    //! starts timing one invocation
+    void start() { tick = getTickCount(); }
+    //! stops timing and records the elapsed time
+    void stop() { add((getTickCount() - tick) / getTickFrequency()); }
+    //! records one sample in seconds
+    void add(double seconds);
+
+    size_t count() const { return seen; }
+    //! most recent sample, 0 if none
+    double last() const { return lastSample; }
+    double total() const { return sum; }
+    //! latency at quantile q in [0,1], in seconds
+    double percentile(double q) const;
+
+    //! one line: calls, throughput (calls/s of stage time), mean, p50, p90, p99, max in ms
+    void report(ostream& out) const;
+
+    const string& name() const { return stageName; }
+
+private:
+    string stageName;
+    vector<double> samples;
+    size_t capacity;
+    size_t seen;
+    double sum, lastSample, maxSample;
+    uint64 random;      // reservoir choices
+    int64 tick;
+};
+
+#endif
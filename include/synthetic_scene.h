@@ -0,0 +1,95 @@
+//
+//  synthetic_scene.h
+//  sagmm
+//
+//  Procedural test sequence with exact ground-truth masks.
+//
+
+#ifndef _synthetic_scene_h
+#define _synthetic_scene_h
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+#include "frame_source.h"
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Parameters of a synthetic scene. The defaults give a VGA colour scene
+ * with a few moving shapes, their shadows, mild sensor noise and an
+ * illumination step every 200 frames.
+ */
+struct SceneConfig
+{
+    Size   size;
+    int    channels;            // 1 or 3
+    int    frames;              // read() fails after this many, 0 for endless
+    int    shapes;              // moving objects
+    double noiseSigma;          // gaussian sensor noise, grey levels
+    int    illuminationPeriod;  // frames between illumination steps, 0 for none
+    double illuminationStep;    // relative gain change of one step
+    bool   shadows;             // objects cast shadows
+    double shadowGain;          // brightness of shadowed background, in (0,1)
+    uint64 seed;
+
+    SceneConfig()
+    : size(640, 480), channels(3), frames(0), shapes(4), noiseSigma(2.0),
+      illuminationPeriod(200), illuminationStep(0.1), shadows(true), shadowGain(0.6),
+      seed(0x5a6d6d) { }
+};
+
+
+/**
+ * Deterministic sequence of frames: a textured background under a global
+ * illumination gain, rectangles and ellipses moving with constant velocity
+ * (bouncing off the borders), each casting a darker copy of its outline on
+ * the background, and per-frame gaussian noise.
+ *
+ * groundTruth() is the label image of the frame read() returned last, in
+ * the model's mask convention: 0 background, SHADOW shadow, FOREGROUND
+ * object. Illumination steps do not change the labels.
+ */
+class SyntheticScene : public FrameSource
+{
+public:
+    enum { BACKGROUND = 0, SHADOW = 127, FOREGROUND = 255 };
+
+    SyntheticScene(const SceneConfig& config = SceneConfig());
+
+    bool read(Mat& frame);
+    double fps() const { return 25; }
+
+    const Mat& groundTruth() const { return truth; }
+    //! frames rendered so far
+    int frameCount() const { return frameNo; }
+    const SceneConfig& config() const { return cfg; }
+
+private:
+    struct Shape
+    {
+        bool    ellipse;
+        Point2f position;       // top left corner
+        Point2f velocity;       // pixels per frame
+        Size    size;
+        Scalar  colour;
+        Point   shadowOffset;
+    };
+
+    void draw(const Shape& shape, Point offset, Mat& image, const Scalar& colour) const;
+
+    SceneConfig cfg;
+    RNG rng;
+    int frameNo;
+    double gain;
+
+    Mat texture;                // CV_32FC(channels)
+    vector<Shape> objects;
+
+    // per-frame scratch
+    Mat lit, shaded, noise, shapeMask, shadowMask, truth;
+};
+
+#endif
@@ -0,0 +1,73 @@
+//
+//  worker_pool.h
+//  sagmm
+//
+//  Worker threads pinned to CPUs with a stable split of the rows.
+//
+
+#ifndef _worker_pool_h
+#define _worker_pool_h
+
+#include <opencv2/core/core.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "numa_topology.h"
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Replacement for parallel_for_ that keeps data on its NUMA node.
+ *
+ * Workers are pinned one per CPU and spread evenly over the nodes in node
+ * order. run(body, range) cuts the range into one contiguous band per
+ * worker and always gives worker i the i-th band, so with the same range
+ * every call a row is processed by the same worker on the same node.
+ * Memory a worker writes first is placed on its node (Linux first-touch
+ * policy); the model lets the workers initialize their own bands and then
+ * reads them locally on every frame. Bands of workers on one node are
+ * adjacent, so a node's share of the model is one contiguous region.
+ *
+ * run() blocks the caller until all bands are done. One caller at a time.
+ */
+class PinnedWorkerPool
+{
+public:
+    //! workers 0 starts one per CPU
+    explicit PinnedWorkerPool(int workers = 0, const NumaTopology& topology = NumaTopology());
+    ~PinnedWorkerPool();
+
+    int workers() const { return (int)cpus.size(); }
+    int workerCpu(int i) const { return cpus[i]; }
+    int workerNode(int i) const { return nodes[i]; }
+
+    //! part of range processed by worker i
+    Range band(int i, const Range& range) const;
+
+    void run(const ParallelLoopBody& body, const Range& range);
+
+private:
+    PinnedWorkerPool(const PinnedWorkerPool&);
+    PinnedWorkerPool& operator=(const PinnedWorkerPool&);
+
+    void worker(int i);
+
+    vector<int> cpus;
+    vector<int> nodes;
+    vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const ParallelLoopBody* job;
+    Range jobRange;
+    uint64 generation;      // incremented for every run()
+    int pending;            // workers still busy with the current run()
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,86 @@
+//
+//  zone_occupancy.h
+//  sagmm
+//
+//  Per-zone foreground counts taken while the model writes the mask.
+//
+
+#ifndef _zone_occupancy_h
+#define _zone_occupancy_h
+
+#include <opencv2/core/core.hpp>
+#include <mutex>
+#include <vector>
+
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Occupancy of zones of the frame (grid cells, lanes), counted by the
+ * workers of BackgroundSubtractorMOG3 on every row of the mask as they
+ * finish it, so no second pass over the mask is needed. Attach with
+ * setZoneOccupancy(); the model brackets every frame with
+ * beginFrame()/endFrame() and workers fold in their stripe's counts with
+ * addPartial(), as for ModelCounters.
+ *
+ * Zones are given as a label map: the zone number of every pixel, 1 to
+ * zones(), 0 outside every zone, so a pixel is in at most one zone. A map
+ * of another size than the frames is scaled to it (nearest neighbour), e.g.
+ * a cols x rows map of one pixel per cell for a grid, or lanes drawn on a
+ * full-size still for a model of half-size frames. latest() may be called
+ * from any thread at any time.
+ */
+class ZoneOccupancy
+{
+public:
+    //! one zone in one frame
+    struct Counts
+    {
+        int foreground;     // mask 255
+        int shadow;         // mask set, but not 255
+        int changed;        // mask value different from the previous frame
+
+        Counts() : foreground(0), shadow(0), changed(0) { }
+    };
+
+    ZoneOccupancy();
+
+    //! labels of any integer type, one channel; restarts the changed counts
+    void setZones(const Mat& labels);
+    int zones() const { return nzones; }
+
+    //! label map of a grid of cols x rows cells, zone 1 + row*cols + col
+    static Mat grid(Size frame, int cols, int rows);
+    //! label map of filled polygons, zone i+1 for polygons[i]; where they
+    //! overlap the later polygon wins
+    static Mat polygons(Size frame, const vector<vector<Point> >& polygons);
+
+    //! scales the label map to the frame size, before the frame
+    void prepare(Size frame);
+    void beginFrame(int frame);
+    //! counts of one stripe of rows, zones() entries
+    void addPartial(const vector<Counts>& partial);
+    void endFrame();
+
+    //! zone labels and the previous mask of row y, for the model's workers;
+    //! a row is only ever written by the worker updating it
+    const ushort* labelRow(int y) const { return frameLabels.ptr<ushort>(y); }
+    uchar* previousRow(int y) { return previous.ptr(y); }
+
+    //! counts of the last completed frame, zones() entries, returns its
+    //! number (frames of the model since its initialization, from 0), -1 if none
+    int latest(vector<Counts>& counts) const;
+
+private:
+    Mat labels;         // CV_16U, as given
+    Mat frameLabels;    // scaled to the frame size
+    Mat previous;       // last frame's mask
+    int nzones;
+
+    mutable std::mutex lock;
+    vector<Counts> current, last;
+    int currentFrame, lastFrame;
+};
+
+#endif
@@ -0,0 +1,125 @@
+//
+//  async_subtractor.cpp
+//  sagmm
+//
+
+#include <exception>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+#include "async_subtractor.h"
+
+
+AsyncBackgroundSubtractor::AsyncBackgroundSubtractor(BackgroundSubtractorMOG3& _model, size_t queueDepth)
+: model(_model), queue(queueDepth), nextFrame(0), submitted(0), completed(0)
+{
+    thread = std::thread(&AsyncBackgroundSubtractor::worker, this);
+}
+
+
+AsyncBackgroundSubtractor::~AsyncBackgroundSubtractor()
+{
+    // the worker drains the queue before pop() fails
+    queue.close();
+    thread.join();
+}
+
+
+std::future<AsyncResult> AsyncBackgroundSubtractor::submit(const Mat& frame, int flags, double learningRate)
+{
+    Job job;
+    job.frame        = frame;
+    job.flags        = flags;
+    job.learningRate = learningRate;
+    job.promise      = std::make_shared<std::promise<AsyncResult> >();
+
+    std::future<AsyncResult> result = job.promise->get_future();
+    enqueue(job);
+    return result;
+}
+
+
+void AsyncBackgroundSubtractor::submit(const Mat& frame, const Callback& done, int flags, double learningRate)
+{
+    Job job;
+    job.frame        = frame;
+    job.flags        = flags;
+    job.learningRate = learningRate;
+    job.callback     = done;
+    enqueue(job);
+}
+
+
+void AsyncBackgroundSubtractor::enqueue(Job& job)
+{
+    std::lock_guard<std::mutex> guard(submitLock);
+    job.frameNo = nextFrame++;
+    submitted++;
+    queue.push(job);
+}
+
+
+void AsyncBackgroundSubtractor::wait()
+{
+    std::unique_lock<std::mutex> guard(idleLock);
+    while (completed.load() != submitted.load())
+        idle.wait(guard);
+}
+
+
+void AsyncBackgroundSubtractor::run(AsyncResult& result, const Job& job)
+{
+    bool foreground = (job.flags & FOREGROUND) != 0;
+    if (job.flags & CLASSIFY) {
+        if (foreground)
+            model.classify(job.frame, result.fgmask, result.foreground);
+        else
+            model.classify(job.frame, result.fgmask);
+    }
+    else {
+        if (foreground)
+            model(job.frame, result.fgmask, result.foreground, job.learningRate);
+        else
+            model(job.frame, result.fgmask, job.learningRate);
+    }
+
+    if (job.flags & BACKGROUND)
+        model.getBackgroundImage(result.background);
+}
+
+
+void AsyncBackgroundSubtractor::worker()
+{
+    Job job;
+    while (queue.pop(job))
+    {
+        AsyncResult result;
+        result.frameNo = job.frameNo;
+        try {
+            run(result, job);
+            if (job.promise)
+                job.promise->set_value(result);
+        }
+        catch (const std::exception& e) {
+            if (job.promise)
+                job.promise->set_exception(std::current_exception());
+            result = AsyncResult();
+            result.frameNo = job.frameNo;
+            result.error   = e.what();
+            LOG4CPLUS_WARN(log4cplus::Logger::getInstance(LOG4CPLUS_TEXT("sagmm.async")),
+                           "frame " << job.frameNo << ": " << e.what());
+        }
+
+        if (job.callback)
+            job.callback(result);
+
+        // the frame and result buffers go back with the job
+        job = Job();
+        {
+            std::lock_guard<std::mutex> guard(idleLock);
+            completed++;
+        }
+        idle.notify_all();
+    }
+}
@@ -20,8 +20,16 @@
 //*/
 
 #include "background_subtraction.h"
+#include "gaussian_mixture.h"
 
 #include <opencv2/opencv.hpp>
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <vector>
 
 
 #include "precomp.h"
@@ -43,6 +51,11 @@ static const float defaultVarMin2          = 4.0f;
 static const float defaultfCT2             = 0.05f; // complexity reduction prior constant 0 - no reduction of number of components
 static const float defaultfTau             = 0.5f; // Tau - shadow threshold, see the paper for explanation
 static const unsigned char defaultnShadowDetection2 = (unsigned char)127; // value to use in the segmentation mask for shadows, set 0 not to do shadow detection
+static const int   blockSize               = 8; // coarse-to-fine blocks are blockSize x blockSize pixels
+static const int   blockMaxSkip            = 16; // frames a block may be skipped before a full update
+
+// fields of a block in blockState
+enum { BLOCK_SPREAD, BLOCK_VARMIN, BLOCK_RETAIN, BLOCK_COUNTDOWN, BLOCK_REF };
 
 
 //const float BackgroundSubtractorMOG3::Alpha        = 0.001f; //speed of update, the time interval =1/Alfa.
@@ -126,123 +139,88 @@ struct GaussBGStatModel2Params
     //See: Prati,Mikic,Trivedi,Cucchiarra,"Detecting Moving Shadows...",IEEE PAMI,2003.
 };
 
-struct GMM
+// Hands an output that has no buffer yet to the given allocator.
+// Outputs that already own a buffer keep their allocator.
+static void useAllocator(OutputArray out, MatAllocator* allocator)
 {
-    float weight;
-    float variance;
-    
-    GMM()
-    :weight(1.0f),variance(11.0f) {}
-    
-    GMM(float _w, float _v)
-    :weight(_w),variance(_v) {}
-    
-    //copy constructor
-    GMM (const GMM &_m) { *this = _m; }
-    
-    GMM & operator = (const GMM & rhs) {
-        if ( *this != rhs ) {
-            weight   = rhs.weight;
-            variance = rhs.variance;
-        }
-        return *this;
-    }
-    
-    bool operator != (const GMM & rhs) const {
-        return (weight != rhs.weight) || (variance != rhs.variance);
+    if (allocator && out.kind() == _InputArray::MAT && out.empty())
+        out.getMatRef().allocator = allocator;
+}
+
+// Moves a per-pixel model buffer to the given allocator (NULL for the heap);
+// a buffer of another allocator is dropped and re-created by create().
+static void useModelAllocator(Mat& m, MatAllocator* allocator)
+{
+    if (m.allocator != allocator) {
+        m.release();
+        m.allocator = allocator;
     }
-    
-    bool operator == (const GMM & rhs) const {
-        return (weight == rhs.weight) && (variance == rhs.variance);
-    }   
+}
 
-};
 
-struct MEAN 
+// parallel_for_, or the bands of a worker pool
+static void runRows(PinnedWorkerPool* pool, const Range& range, const ParallelLoopBody& body)
 {
-    float meanR;
-    float meanG;
-    float meanB;
-    
-    MEAN (float _r, float _g, float _b) 
-    : meanR(_r), meanG(_g), meanB(_b) { } 
-    
-    //copy constructor
-    MEAN (const MEAN &_m) { *this = _m; }
-    
-    MEAN & operator = (const MEAN & rhs) {
-        if ( *this != rhs ) {
-            meanR = rhs.meanR;
-            meanG = rhs.meanG;
-            meanB = rhs.meanB;
-        }
-        return *this;
-    }
-    
-    bool operator != (const MEAN & rhs) const {
-        return 
-        (meanR != rhs.meanR) ||
-        (meanG != rhs.meanG) ||
-        (meanB != rhs.meanB); 
-    }
-    
-    bool operator == (const MEAN & rhs) const {
-        return 
-        (meanR == rhs.meanR) &&
-        (meanG == rhs.meanG) && 
-        (meanB == rhs.meanB); 
-    }   
-};
+    if (pool)
+        pool->run(body, range);
+    else
+        parallel_for_(range, body);
+}
 
-// shadow detection performed per pixel
-// should work for rgb data, could be usefull for gray scale and depth data as well
-// See: Prati,Mikic,Trivedi,Cucchiarra,"Detecting Moving Shadows...",IEEE PAMI,2003.
-static CV_INLINE bool
-detectShadowGMM(const float* data, int nchannels, int nmodes,
-                const GMM* gmm, const float* mean,
-                float Tb, float TB, float tau)
+
+// Initial state of rows of the model: one mode of weight 1 per pixel in
+// the dense layout, modes in slot order, every counter 1, no modes used.
+class ModelInitInvoker : public ParallelLoopBody
 {
-    float tWeight = 0;
+public:
+    ModelInitInvoker(Size _size, int _nchannels, int _nmixtures, GMM* _gmm, float* _mean, float* _cnt,
+                     uchar* _order, uchar* _modesUsed, float* _bg, float* _fg)
+    : size(_size), nchannels(_nchannels), nmixtures(_nmixtures), gmm(_gmm), mean(_mean), cnt(_cnt),
+      order(_order), modesUsed(_modesUsed), bg(_bg), fg(_fg) { }
 
-    // check all the components  marked as background:
-    for( int mode = 0; mode < nmodes; mode++, mean += nchannels )
+    void operator()(const Range& range) const
     {
-        GMM g = gmm[mode];
+        size_t p0 = (size_t)range.start*size.width;
+        size_t p1 = (size_t)range.end*size.width;
+
+        if (gmm) {
+            for (size_t i=p0; i<p1; i++) {
+                gmm[i*nmixtures] = GMM(1.0f, 11.0f);
+                for (int m=1; m<nmixtures; m++)
+                    gmm[i*nmixtures + m] = GMM(0.0f, 0.0f);
+            }
 
-        float numerator = 0.0f;
-        float denominator = 0.0f;
-        for( int c = 0; c < nchannels; c++ )
-        {
-            numerator   += data[c] * mean[c];
-            denominator += mean[c] * mean[c];
-        }
+            //initialize first gaussian mean
+            std::fill(mean + p0*nmixtures*nchannels, mean + p1*nmixtures*nchannels, 0.0f);
+            for (size_t i=p0; i<p1; i++)
+                for (int c=0; c<nchannels; c++)
+                    mean[i*nmixtures*nchannels + c] = 1.0f;
 
-        // no division by zero allowed
-        if( denominator == 0 )
-            return false;
+            // Cm of every mode starts at one (Beta = 2*alpha)
+            std::fill(cnt + p0*nmixtures, cnt + p1*nmixtures, 1.0f);
 
-        // if tau < a < 1 then also check the color distortion
-        if( numerator <= denominator && numerator >= tau*denominator )
-        {
-            float a = numerator / denominator;
-            float dist2a = 0.0f;
+            for (size_t i=p0; i<p1; i++)
+                for (int m=0; m<nmixtures; m++)
+                    order[i*nmixtures + m] = (uchar)m;
+        }
 
-            for( int c = 0; c < nchannels; c++ )
-            {
-                float dD= a*mean[c] - data[c];
-                dist2a += dD*dD;
-            }
+        std::fill(modesUsed + p0, modesUsed + p1, 0);
+        std::fill(bg + p0*nchannels, bg + p1*nchannels, 0.0f);
+        std::fill(fg + p0, fg + p1, 0.0f);
+    }
 
-            if (dist2a < Tb*g.variance*a*a)
-                return true;
-        };
+private:
+    Size size;
+    int nchannels, nmixtures;
+    GMM* gmm;
+    float* mean;
+    float* cnt;
+    uchar* order;
+    uchar* modesUsed;
+    float* bg;
+    float* fg;
+};
 
-        tWeight += g.weight;
-        if( tWeight > TB )
-            return false;
-    };
-    return false;
-}
 
 class BackgroundSubtractionInvoker : public ParallelLoopBody
 {
@@ -252,6 +230,7 @@ public:
                                 Mat& _dst,
                                 GMM* _gmm, 
                                 float* _mean,
+                                uchar* _order,
                                 uchar* _modesUsed,
                                 int _nmixtures, 
                                 float _alphaT,
@@ -266,12 +245,16 @@ public:
                                 uchar _shadowVal,
                                 float _globalChange,
                                 float* _Cm,
-                                float* _Bg,float* _Fg) 
+                                float* _Bg,float* _Fg,
+                                ModelCounters* _counters,
+                                PerfEventLog* _eventLog,
+                                int _frameNo) 
 {
     src = &_src;
     dst = &_dst;
     gmm0 = _gmm;
     mean0 = _mean;
+    order0 = _order;
     modesUsed0 = _modesUsed;
     nmixtures = _nmixtures;
     alphaT = _alphaT;
@@ -289,9 +272,73 @@ public:
     globalChange = _globalChange;
     Cm0 = _Cm;
     Bg0 = _Bg;
-    Bg0 = _Fg;
-
+    Fg0 = _Fg;
+    counters = _counters;
+    eventLog = _eventLog;
+    frameNo  = _frameNo;
+
+    // frames are taken as they are, see setInputScale()
+    cvtScale[0] = 1.;
+    cvtScale[1] = 0.;
     cvtfunc = src->depth() != CV_32F ? getConvertFunc(src->depth(), CV_32F) : 0;
+
+    updateStride = 1;
+    updatePhase  = 0;
+    classifyOnly = false;
+    fgimage      = NULL;
+    fillPixel    = NULL;
+    snapshot     = NULL;
+    zones        = NULL;
+    activity0    = NULL;
+}
+
+// fixed-point frames: values are multiplied by scale while converting, to grey levels
+void setInputScale(double scale)
+{
+    cvtScale[0] = scale;
+    cvtfunc = getConvertScaleFunc(src->depth(), CV_32F);
+}
+
+// updates only pixel (x,y) with (x + y + phase) % stride == 0 and pixels
+// without modes, the others are classified against the model as it is
+void setSubsampling(int stride, int phase)
+{
+    updateStride = stride;
+    updatePhase  = phase % stride;
+}
+
+// classifies every pixel against the model as it is and writes nothing of
+// the model, for frames with learning rate 0
+void setClassifyOnly()
+{
+    classifyOnly = true;
+}
+
+// also writes the frame where the mask is set and fill (one pixel of the
+// frame's type) elsewhere into image, row by row while the row is cached
+void setComposite(Mat* image, const uchar* fill)
+{
+    fgimage   = image;
+    fillPixel = fill;
+}
+
+// rows are copied into snapshot, if any, before they are written
+void setSnapshot(ModelSnapshot* _snapshot)
+{
+    snapshot = _snapshot;
+}
+
+// counts every finished mask row into the zones of _zones, if any
+void setZones(ZoneOccupancy* _zones)
+{
+    zones = _zones;
+}
+
+// adds the foreground and shadow pixels of every finished mask row to
+// activity[row], if given
+void setActivity(uint64* activity)
+{
+    activity0 = activity;
 }
 
 /*
@@ -322,26 +369,35 @@ void operator()(const Range& range) const
     int ncols     = src->cols;
     int nchannels = src->channels();
     
-    AutoBuffer<float> buf(src->cols*nchannels);
-    
-    float alpha1 = 1.f - alphaT;
-    float dData[CV_CN_MAX];
+    // conversion buffer, one per worker thread, grown only when the frame gets wider
+    static thread_local vector<float> rowBuffer;
+    if (rowBuffer.size() < (size_t)(ncols*nchannels))
+        rowBuffer.resize(ncols*nchannels);
+    float* buf = &rowBuffer[0];
+
+    // counts of this stripe, folded into the shared counters at the end
+    ModelCounters::Partial partial;
+    int64 tick = counters ? getTickCount() : 0;
+    PerfScope event(eventLog, PERF_STRIPE, frameNo);
+    event.counters[0] = y0;
+    event.counters[1] = y1 - y0;
+
+    if( snapshot )
+        snapshot->preserve(y0, y1);
+    vector<ZoneOccupancy::Counts>* zonePartial = beginZones();
 
     for( int y = y0; y < y1; y++ )
     {
-        const float* data = buf;//data is pointer, which points to const float
-        if( cvtfunc )
-            cvtfunc( src->ptr(y), src->step, 0, 0, (uchar*)data, 0, Size(ncols*nchannels, 1), 0);
-        else
-            data = src->ptr<float>(y);
+        const float* data = convertRow(y, buf);
+        const float* rowData = data;
 
         float* mean      = mean0 + ncols*nmixtures*nchannels*y;
         GMM*   gmm       = gmm0  + ncols*nmixtures*y;
         uchar* modesUsed = modesUsed0 + ncols*y;
         uchar* mask      = dst->ptr(y);
         float* cm        = Cm0 + ncols*nmixtures*y;
-        float* bg        = Bg0 + ncols*nchannels*y;
-        float* fg        = Fg0 + ncols*y;
+        uchar* order     = order0 + ncols*nmixtures*y;
+        int    first     = (updateStride - (y + updatePhase) % updateStride) % updateStride;
 
         //After each iteration per mixture:
         // increment x
@@ -353,199 +409,411 @@ void operator()(const Range& range) const
         // |R |G |B |  |  |  |  |  |  |  |  |  |  |  |  |  |
         // |--|--|--|--|--|--|--|--|--|--|--|--|--|--|--|--|
         //
-        for( int x = 0; x < ncols; x++, data += nchannels, gmm += nmixtures, mean += nmixtures*nchannels )
+        if( nchannels == 1 )
+            updateRow<1>(data, nchannels, gmm, mean, cm, order, modesUsed, mask, ncols, first, partial);
+        else if( nchannels == 3 )
+            updateRow<3>(data, nchannels, gmm, mean, cm, order, modesUsed, mask, ncols, first, partial);
+        else
+            updateRow<0>(data, nchannels, gmm, mean, cm, order, modesUsed, mask, ncols, first, partial);
+
+        if( counters )
         {
-            //calculate distances to the modes (+ sort)
-            //here we need to go in descending order!!!
-            bool background   = false;//return value -> true - the pixel classified as background
-
-            //internal:
-            bool fitsPDF      = false;//if it remains zero a new GMM mode will be added
-            int nmodes        = modesUsed[x];
-            int nNewModes     = nmodes;//current number of modes in GMM
-            float totalWeight = 0.f;
+            int64 now = getTickCount();
+            partial.updateSeconds += (now - tick) / getTickFrequency();
+            tick = now;
+        }
 
-            float* mean_m     = mean;
-            float* bg_m       = bg;
-            float* fg_m       = fg;
-            float* bg_cnt     = cm;
+        // shadow test of the foreground pixels against the updated row
+        if( detectShadows )
+        {
+            const GMM*   rowGmm   = gmm0  + ncols*nmixtures*y;
+            const float* rowMean  = mean0 + ncols*nmixtures*nchannels*y;
+            const uchar* rowOrder = order0 + ncols*nmixtures*y;
+            for( int x = 0; x < ncols; x++ )
+                if( mask[x] && detectShadowGMM(rowData + x*nchannels, nchannels, modesUsed[x],
+                                               rowGmm + x*nmixtures, rowMean + x*nmixtures*nchannels,
+                                               Tb, TB, tau, rowOrder + x*nmixtures) )
+                    mask[x] = shadowVal;
+        }
 
-            //////
-            //go through all modes
-            for( int mode = 0; mode < nmodes; mode++, mean_m += nchannels, bg_m +=nchannels )
-            {
-                // prune = -learningRate*fCT = 1./500*0.05 = -0.0001
-                // Ownership Om set zero to obtain weight if fit is not found.
-                // Eq (14) ownership in zero
-                float weight = alpha1*gmm[mode].weight + prune;//need only weight if fit is found
-                
-                //// 
-                //fit not found yet, at init fitsPDF <-- false
-                if( !fitsPDF )
-                {
-                    //check if it belongs to some of the remaining modes
-                    float var = gmm[mode].variance;
-
-                    //calculate difference and distance
-                    float dist2;
-
-                    // dData[CV_CN_MAX] == dData[512]
-                    // d_dirac_m = x[t] - mu_m
-                    if( nchannels == 3 )
-                    {
-                        dData[0] = mean_m[0] - data[0]*globalChange;
-                        dData[1] = mean_m[1] - data[1]*globalChange;
-                        dData[2] = mean_m[2] - data[2]*globalChange;
-                        dist2 = dData[0]*dData[0] + dData[1]*dData[1] + dData[2]*dData[2];
-                    }
-                    else
-                    {
-                        dist2 = 0.f;
-                        for( int c = 0; c < nchannels; c++ )
-                        {
-                            dData[c] = mean_m[c] - data[c]*globalChange;
-                            dist2 += dData[c]*dData[c];
-                        }
-                    }
-
-                    //background? - Tb - usually larger than Tg
-                    if( totalWeight < TB && dist2 < Tb*var ) {
-                        background = true;
-                        /*
-                        for( int c = 0; c < nchannels; c++ )
-                            bg_m[c] = dData[c];
-                         */
-                    }
-
-                    //check fit
-                    if( dist2 < Tg*var )
-                    {
-                        /////
-                        //belongs to the mode
-                        fitsPDF = true;
-
-                        //update distribution
-                        modesUsed[mode] = mode + 1;
-                                               
-                        //New Beta dynamic learning rate, se eq. 4.7
-                        //Beta=alfa(h+Cm)/Cm
-                        //If the background changes quickly, Cm will become smaller, new beta learning rate will increase
-                        float Beta = alphaT/bg_cnt[mode]+alphaT;
-                        
-                        //
-                        float k = Beta/gmm[mode].weight;
-                        
-                        // Update Weight
-                        // Eq (14) of Zivkovic paper
-                        // prune = -learningRate*fCT
-                        //weight = alpha1*gmm[mode].weight+alphaT + prune;
-                        weight += alphaT;
-                        
-                        // Update mean
-                        // Eq (5) 
-                        // TODO: Check for more than three channels
-                        for( int c = 0; c < nchannels; c++ )
-                            mean_m[c] -= k*dData[c];
-                        
-                        // Eq(6)
-                        // update variance
-                        float varnew = var + k*(dist2-var);
-                        //limit the variance
-                        varnew = MAX(varnew, varMin);
-                        varnew = MIN(varnew, varMax);
-                        gmm[mode].variance = varnew;
-
-                         
-                        //sort
-                        //all other weights are at the same place and
-                        //only the matched (iModes) is higher -> just find the new place for it
-                        for( int i = mode; i > 0; i-- )
-                        {
-                            //check one up
-                            if( weight < gmm[i-1].weight )
-                                break;
-
-                            //swap one up
-                            std::swap(gmm[i], gmm[i-1]);
-                            for( int c = 0; c < nchannels; c++ )
-                                std::swap(mean[i*nchannels + c], mean[(i-1)*nchannels + c]);
-                        }
-                        //belongs to the mode - bFitsPDF becomes 1
-                        /////
-                    }
-                }//!bFitsPDF)
-
-                //check prune
-                if( weight < -prune )
-                {
-                    weight = 1.0E-6;
-                    nmodes--;
-                }
+        if( fgimage )
+            compositeRow(y);
+        if( zonePartial )
+            zoneRow(y, *zonePartial);
+        if( activity0 )
+            activityRow(y);
 
-                gmm[mode].weight = weight;//update weight by the calculated value
-                totalWeight += weight;
-            }
-            //go through all modes
-            //////
+        if( counters )
+        {
+            countRow(mask, modesUsed, ncols, partial);
 
-            //renormalize weights
-            totalWeight = 1.f/totalWeight;
-            for( int mode = 0; mode < nmodes; mode++ )
-                gmm[mode].weight *= totalWeight;
+            int64 now = getTickCount();
+            partial.shadowSeconds += (now - tick) / getTickFrequency();
+            tick = now;
+        }
+    }
 
-            nmodes = nNewModes;
+    if( zonePartial )
+        zones->addPartial(*zonePartial);
+    if( counters )
+        counters->addPartial(partial);
+}
 
-            //make new mode if needed and exit
-            if( !fitsPDF )
-            {
-                // replace the weakest or add a new one
-                int mode = nmodes == nmixtures ? nmixtures-1 : nmodes++;
+// one row of the dense layout, cn is the number of channels if known at compile time;
+// columns first, first + updateStride, ... are updated, the others only classified
+template<int cn>
+void updateRow(const float* data, int nchannels, GMM* gmm, float* mean, float* cm, uchar* order,
+               uchar* modesUsed, uchar* mask, int ncols, int first, ModelCounters::Partial& partial) const
+{
+    if( cn > 0 )
+        nchannels = cn;
+    int next = first;
+    for( int x = 0; x < ncols; x++, data += nchannels, gmm += nmixtures, mean += nmixtures*nchannels,
+         cm += nmixtures, order += nmixtures )
+    {
+        int nmodes = modesUsed[x];
+        bool background;
+        if( !classifyOnly && (x == next || nmodes == 0) )
+        {
+            background = updatePixel<cn>(data, nchannels, gmm, mean, cm, order, nmodes, partial);
+            //set the number of modes
+            modesUsed[x] = uchar(nmodes);
+        }
+        else
+            background = classifyPixel<cn>(data, nchannels, gmm, mean, order, nmodes);
+        if( x == next )
+            next += updateStride;
 
-                if (nmodes==1)
-                    gmm[mode].weight = 1.f;
-                else
-                {
-                    gmm[mode].weight = alphaT;
+        mask[x] = background ? 0 : 255;
+    }
+}
 
-                    // renormalize all other weights
-                    for( int i = 0; i < nmodes-1; i++ )
-                        gmm[i].weight *= alpha1;
-                }
+// converts row y of the frame to float grey levels into buf, float frames are used in place
+const float* convertRow(int y, float* buf) const
+{
+    if( !cvtfunc )
+        return src->ptr<float>(y);
+    cvtfunc( src->ptr(y), src->step, 0, 0, (uchar*)buf, 0, Size(src->cols*src->channels(), 1), (void*)cvtScale);
+    return buf;
+}
+
+// foreground image row y from the frame and the finished mask row
+void compositeRow(int y) const
+{
+    const uchar* mask = dst->ptr(y);
+    const uchar* s    = src->ptr(y);
+    uchar*       d    = fgimage->ptr(y);
+    int ncols  = src->cols;
+    size_t esz = src->elemSize();
 
-                // init
+    if( esz == 1 )
+    {
+        for( int x = 0; x < ncols; x++ )
+            d[x] = mask[x] ? s[x] : fillPixel[0];
+    }
+    else if( esz == 3 )
+    {
+        for( int x = 0; x < ncols; x++, s += 3, d += 3 )
+        {
+            const uchar* p = mask[x] ? s : fillPixel;
+            d[0] = p[0]; d[1] = p[1]; d[2] = p[2];
+        }
+    }
+    else
+    {
+        for( int x = 0; x < ncols; x++, s += esz, d += esz )
+            memcpy(d, mask[x] ? s : fillPixel, esz);
+    }
+}
+
+// zone counts of this worker's stripe, NULL without zones; one buffer per
+// thread, a worker runs one stripe at a time
+vector<ZoneOccupancy::Counts>* beginZones() const
+{
+    static thread_local vector<ZoneOccupancy::Counts> zoneBuffer;
+    if( !zones )
+        return NULL;
+    zoneBuffer.assign(zones->zones(), ZoneOccupancy::Counts());
+    return &zoneBuffer;
+}
+
+// adds the finished mask row y to the counts of its pixels' zones and
+// keeps it for the changed counts of the next frame
+void zoneRow(int y, vector<ZoneOccupancy::Counts>& partial) const
+{
+    const uchar*  mask     = dst->ptr(y);
+    const ushort* label    = zones->labelRow(y);
+    uchar*        previous = zones->previousRow(y);
+    for( int x = 0; x < dst->cols; x++ )
+    {
+        uchar m = mask[x];
+        if( label[x] )
+        {
+            ZoneOccupancy::Counts& counts = partial[label[x] - 1];
+            counts.foreground += m == 255;
+            counts.shadow     += m != 0 && m != 255;
+            counts.changed    += m != previous[x];
+        }
+        previous[x] = m;
+    }
+}
+
+void activityRow(int y) const
+{
+    const uchar* mask = dst->ptr(y);
+    int changed = 0;
+    for( int x = 0; x < dst->cols; x++ )
+        changed += mask[x] != 0;
+    activity0[y] += changed;
+}
+
+void countRow(const uchar* mask, const uchar* modesUsed, int ncols, ModelCounters::Partial& partial) const
+{
+    for( int x = 0; x < ncols; x++ )
+    {
+        partial.foreground += mask[x] == 255;
+        partial.shadow     += detectShadows && mask[x] == shadowVal;
+        partial.modes[modesUsed[x]]++;
+    }
+    partial.pixels += ncols;
+}
+
+// Updates the nmodes modes of one pixel with the sample data and returns
+// true if the sample is background. order lists the pixel's mode slots by
+// descending weight; the mode data stays in its slot and only order is
+// changed to keep them sorted. order always holds all nmixtures slots, the
+// ones past nmodes are free. Prunes, adds or replaces modes and leaves
+// their new number in nmodes. With cn > 0 the channel loops are unrolled
+// for cn channels.
+template<int cn>
+bool updatePixel(const float* data, int nchannels, GMM* gmm, float* mean, float* bg_cnt, uchar* order,
+                 int& nmodes, ModelCounters::Partial& partial) const
+{
+    if( cn > 0 )
+        nchannels = cn;
+    float alpha1 = 1.f - alphaT;
+    float dData[CV_CN_MAX];
+
+    //calculate distances to the modes (+ sort)
+    //here we need to go in descending order!!!
+    bool background   = false;//return value -> true - the pixel classified as background
+
+    //internal:
+    bool fitsPDF      = false;//if it remains zero a new GMM mode will be added
+    int nNewModes     = nmodes;//current number of modes in GMM
+    float totalWeight = 0.f;
+
+    //////
+    //go through all modes
+    for( int rank = 0; rank < nmodes; rank++ )
+    {
+        int mode      = order[rank];
+        float* mean_m = mean + mode*nchannels;
+
+        // prune = -learningRate*fCT = 1./500*0.05 = -0.0001
+        // Ownership Om set zero to obtain weight if fit is not found.
+        // Eq (14) ownership in zero
+        float weight = alpha1*gmm[mode].weight + prune;//need only weight if fit is found
+        
+        //// 
+        //fit not found yet, at init fitsPDF <-- false
+        if( !fitsPDF )
+        {
+            //check if it belongs to some of the remaining modes
+            float var = gmm[mode].variance;
+
+            //calculate difference and distance
+            float dist2;
+
+            // dData[CV_CN_MAX] == dData[512]
+            // d_dirac_m = x[t] - mu_m
+            if( nchannels == 3 )
+            {
+                dData[0] = mean_m[0] - data[0]*globalChange;
+                dData[1] = mean_m[1] - data[1]*globalChange;
+                dData[2] = mean_m[2] - data[2]*globalChange;
+                dist2 = dData[0]*dData[0] + dData[1]*dData[1] + dData[2]*dData[2];
+            }
+            else if( nchannels == 1 )
+            {
+                dData[0] = mean_m[0] - data[0]*globalChange;
+                dist2 = dData[0]*dData[0];
+            }
+            else
+            {
+                dist2 = 0.f;
                 for( int c = 0; c < nchannels; c++ )
-                    mean[mode*nchannels + c] = data[c];
+                {
+                    dData[c] = mean_m[c] - data[c]*globalChange;
+                    dist2 += dData[c]*dData[c];
+                }
+            }
 
-                gmm[mode].variance = varInit;
+            //background? - Tb - usually larger than Tg
+            if( totalWeight < TB && dist2 < Tb*var ) {
+                background = true;
+                /*
+                for( int c = 0; c < nchannels; c++ )
+                    bg_m[c] = dData[c];
+                 */
+            }
 
+            //check fit
+            if( dist2 < Tg*var )
+            {
+                /////
+                //belongs to the mode
+                fitsPDF = true;
+
+                //update distribution
+                //New Beta dynamic learning rate, se eq. 4.7
+                //Beta=alfa(h+Cm)/Cm
+                //If the background changes quickly, Cm will become smaller, new beta learning rate will increase
+                float Beta = alphaT/bg_cnt[mode]+alphaT;
+                
+                //
+                float k = Beta/gmm[mode].weight;
+                
+                // Update Weight
+                // Eq (14) of Zivkovic paper
+                // prune = -learningRate*fCT
+                //weight = alpha1*gmm[mode].weight+alphaT + prune;
+                weight += alphaT;
+                
+                // Update mean
+                // Eq (5) 
+                // TODO: Check for more than three channels
+                for( int c = 0; c < nchannels; c++ )
+                    mean_m[c] -= k*dData[c];
+                
+                // Eq(6)
+                // update variance
+                float varnew = var + k*(dist2-var);
+                //limit the variance
+                varnew = MAX(varnew, varMin);
+                varnew = MIN(varnew, varMax);
+                gmm[mode].variance = varnew;
+
+                 
                 //sort
-                //find the new place for it
-                for( int i = nmodes - 1; i > 0; i-- )
+                //all other weights are at the same place and
+                //only the matched one is higher -> just find its new rank
+                for( int i = rank; i > 0; i-- )
                 {
-                    // check one up
-                    if( alphaT < gmm[i-1].weight )
+                    //check one up
+                    if( weight < gmm[order[i-1]].weight )
                         break;
 
-                    // swap one up
-                    std::swap(gmm[i], gmm[i-1]);
-                    for( int c = 0; c < nchannels; c++ )
-                        std::swap(mean[i*nchannels + c], mean[(i-1)*nchannels + c]);
+                    //swap one up
+                    std::swap(order[i], order[i-1]);
                 }
+                //belongs to the mode - bFitsPDF becomes 1
+                /////
             }
+        }//!bFitsPDF)
 
-            //set the number of modes
-            modesUsed[x] = uchar(nmodes);
-            mask[x] = background ? 0 :
-                detectShadows && detectShadowGMM(data, nchannels, nmodes, gmm, mean, Tb, TB, tau) ?
-                shadowVal : 255;
+        //check prune
+        // the weakest modes are last, a pruned one is dropped from the tail
+        if( weight < -prune )
+        {
+            weight = 0.f;
+            nNewModes--;
+            partial.prunedModes++;
+        }
+
+        gmm[mode].weight = weight;//update weight by the calculated value
+        totalWeight += weight;
+    }
+    //go through all modes
+    //////
+
+    nmodes = nNewModes;
+
+    //renormalize weights
+    if( totalWeight > 0.f )
+    {
+        totalWeight = 1.f/totalWeight;
+        for( int rank = 0; rank < nmodes; rank++ )
+            gmm[order[rank]].weight *= totalWeight;
+    }
+
+    //make new mode if needed and exit; classification only (alphaT 0) leaves the modes alone
+    if( !fitsPDF && alphaT > 0.f )
+    {
+        // replace the weakest or add a new one, in the free slot of that rank
+        int rank = nmodes == nmixtures ? nmixtures-1 : nmodes++;
+        int mode = order[rank];
+        partial.newModes++;
+
+        if (nmodes==1)
+            gmm[mode].weight = 1.f;
+        else
+        {
+            gmm[mode].weight = alphaT;
+
+            // renormalize all other weights
+            for( int i = 0; i < nmodes-1; i++ )
+                gmm[order[i]].weight *= alpha1;
+        }
+
+        // init
+        for( int c = 0; c < nchannels; c++ )
+            mean[mode*nchannels + c] = data[c];
+
+        gmm[mode].variance = varInit;
+
+        //sort
+        //find the new place for it
+        for( int i = nmodes - 1; i > 0; i-- )
+        {
+            // check one up
+            if( alphaT < gmm[order[i-1]].weight )
+                break;
+
+            // swap one up
+            std::swap(order[i], order[i-1]);
+        }
+    }
+
+    return background;
+}
+
+// The classification of updatePixel without touching the model: the first
+// mode within Tg of the sample ends the search, the sample is background if
+// a mode within Tb was reached before the weights summed up to TB.
+template<int cn>
+bool classifyPixel(const float* data, int nchannels, const GMM* gmm, const float* mean,
+                   const uchar* order, int nmodes) const
+{
+    if( cn > 0 )
+        nchannels = cn;
+    float totalWeight = 0.f;
+    for( int rank = 0; rank < nmodes; rank++ )
+    {
+        int mode = order[rank];
+        const float* mean_m = mean + mode*nchannels;
+        float dist2 = 0.f;
+        for( int c = 0; c < nchannels; c++ )
+        {
+            float d = mean_m[c] - data[c]*globalChange;
+            dist2 += d*d;
         }
+
+        float var = gmm[mode].variance;
+        if( totalWeight < TB && dist2 < Tb*var )
+            return true;
+        if( dist2 < Tg*var )
+            return false;
+        totalWeight += gmm[mode].weight;
     }
+    return false;
 }
 
     const Mat* src;
     Mat* dst;
     GMM* gmm0;
     float* mean0;
+    uchar* order0;
     uchar* modesUsed0;
 
     int nmixtures;
@@ -559,8 +827,380 @@ void operator()(const Range& range) const
     float* Cm0;
     float* Bg0;
     float* Fg0;
+
+    ModelCounters* counters;
+    PerfEventLog* eventLog;
+    int frameNo;
     
     BinaryFunc cvtfunc;
+    double cvtScale[2];
+
+    int updateStride;
+    int updatePhase;
+    bool classifyOnly;
+
+    Mat* fgimage;
+    const uchar* fillPixel;
+
+    ModelSnapshot* snapshot;
+    ZoneOccupancy* zones;
+    uint64* activity0;
+};
+
+// Same update over the compact layout. The range is of tiles of the store,
+// each pixel's modes are copied out, updated and shadow tested, and written
+// back, which also takes or frees the pixel's overflow block.
+class CompactSubtractionInvoker : public BackgroundSubtractionInvoker
+{
+public:
+    CompactSubtractionInvoker(const BackgroundSubtractionInvoker& base, CompactMixtureStore* _store)
+    : BackgroundSubtractionInvoker(base), store(_store) { }
+
+void operator()(const Range& range) const
+{
+    int ncols     = src->cols;
+    int nchannels = src->channels();
+
+    static thread_local vector<float> rowBuffer;
+    if (rowBuffer.size() < (size_t)(ncols*nchannels))
+        rowBuffer.resize(ncols*nchannels);
+    float* buf = &rowBuffer[0];
+
+    // one pixel's modes while it is updated
+    static thread_local vector<GMM>   gmmBuffer;
+    static thread_local vector<float> meanBuffer, cntBuffer;
+    static thread_local vector<uchar> orderBuffer;
+    gmmBuffer.resize(nmixtures);
+    meanBuffer.resize(nmixtures*nchannels);
+    cntBuffer.resize(nmixtures);
+    orderBuffer.resize(nmixtures);
+    GMM*   gmm   = &gmmBuffer[0];
+    float* mean  = &meanBuffer[0];
+    float* cm    = &cntBuffer[0];
+    uchar* order = &orderBuffer[0];
+
+    Range rows(store->tileRange(range.start).start, store->tileRange(range.end - 1).end);
+    ModelCounters::Partial partial;
+    int64 tick = counters ? getTickCount() : 0;
+    PerfScope event(eventLog, PERF_STRIPE, frameNo);
+    event.counters[0] = rows.start;
+    event.counters[1] = rows.size();
+
+    if( snapshot )
+        snapshot->preserve(rows.start, rows.end);
+    vector<ZoneOccupancy::Counts>* zonePartial = beginZones();
+
+    for( int y = rows.start; y < rows.end; y++ )
+    {
+        const float* data = convertRow(y, buf);
+        uchar* modesUsed  = modesUsed0 + ncols*y;
+        uchar* mask       = dst->ptr(y);
+
+        for( int x = 0, idx = ncols*y; x < ncols; x++, idx++, data += nchannels )
+        {
+            int nmodes = modesUsed[x];
+            bool update = !classifyOnly && (nmodes == 0 || (x + y + updatePhase) % updateStride == 0);
+            // the store keeps modes sorted, the copy starts in slot order
+            store->load(idx, nmodes, gmm, mean, cm);
+            for( int m = 0; m < nmixtures; m++ )
+                order[m] = (uchar)m;
+            bool background;
+            if( update )
+                background = nchannels == 1 ? updatePixel<1>(data, nchannels, gmm, mean, cm, order, nmodes, partial) :
+                             nchannels == 3 ? updatePixel<3>(data, nchannels, gmm, mean, cm, order, nmodes, partial) :
+                                              updatePixel<0>(data, nchannels, gmm, mean, cm, order, nmodes, partial);
+            else
+                background = nchannels == 1 ? classifyPixel<1>(data, nchannels, gmm, mean, order, nmodes) :
+                             nchannels == 3 ? classifyPixel<3>(data, nchannels, gmm, mean, order, nmodes) :
+                                              classifyPixel<0>(data, nchannels, gmm, mean, order, nmodes);
+
+            mask[x] = background ? 0 : 255;
+            if( !background && detectShadows &&
+                detectShadowGMM(data, nchannels, nmodes, gmm, mean, Tb, TB, tau, order) )
+                mask[x] = shadowVal;
+
+            if( update )
+            {
+                store->store(idx, nmodes, gmm, mean, cm, order);
+                modesUsed[x] = uchar(nmodes);
+            }
+        }
+
+        if( fgimage )
+            compositeRow(y);
+        if( zonePartial )
+            zoneRow(y, *zonePartial);
+        if( activity0 )
+            activityRow(y);
+
+        if( counters )
+            countRow(mask, modesUsed, ncols, partial);
+    }
+
+    if( zonePartial )
+        zones->addPartial(*zonePartial);
+    if( counters )
+    {
+        // shadow test is interleaved with the update here
+        partial.updateSeconds = (getTickCount() - tick) / getTickFrequency();
+        counters->addPartial(partial);
+    }
+}
+
+    CompactMixtureStore* store;
+};
+
+// Coarse-to-fine update of the dense layout over rows of blocks. For a
+// block whose dominant modes have means within spread of their mean ref and
+// variances of at least varMin, a frame with |x - ref| < sqrt(T*varMin) - spread
+// at every pixel, T the smaller of Tg and Tb, has every pixel within the
+// matching and background distances of its dominant mode (triangle
+// inequality). The full update would match that mode first and classify
+// the pixel as background, so the block is written as background and only
+// its retained weight (1-alpha per frame) is tracked. The next full update
+// of the block first applies that decay: the dominant weight gains what
+// the others lose, the prune term is left out. Means and variances do not
+// move while a block is skipped, so every block gets a full update at
+// least every blockMaxSkip frames.
+class BlockSubtractionInvoker : public BackgroundSubtractionInvoker
+{
+public:
+    BlockSubtractionInvoker(const BackgroundSubtractionInvoker& base, Mat* _blocks)
+    : BackgroundSubtractionInvoker(base), blocks(_blocks) { }
+
+void operator()(const Range& range) const
+{
+    int ncols     = src->cols;
+    int nchannels = src->channels();
+    size_t rowFloats = (size_t)ncols*nchannels;
+
+    // the converted rows of one row of blocks
+    static thread_local vector<float> rowBuffer;
+    if (rowBuffer.size() < rowFloats*blockSize)
+        rowBuffer.resize(rowFloats*blockSize);
+
+    Range rows(range.start*blockSize, std::min(range.end*blockSize, src->rows));
+    ModelCounters::Partial partial;
+    int64 tick = counters ? getTickCount() : 0;
+    PerfScope event(eventLog, PERF_STRIPE, frameNo);
+    event.counters[0] = rows.start;
+    event.counters[1] = rows.size();
+
+    if( snapshot )
+        snapshot->preserve(rows.start, rows.end);
+    vector<ZoneOccupancy::Counts>* zonePartial = beginZones();
+
+    const float* data[blockSize];
+    for( int by = range.start; by < range.end; by++ )
+    {
+        int y0 = by*blockSize;
+        int y1 = std::min(y0 + blockSize, src->rows);
+        for( int y = y0; y < y1; y++ )
+            data[y - y0] = convertRow(y, &rowBuffer[(y - y0)*rowFloats]);
+
+        float* state = blocks->ptr<float>(by);
+        for( int x0 = 0; x0 < ncols; x0 += blockSize, state += blocks->channels() )
+        {
+            int x1 = std::min(x0 + blockSize, ncols);
+            if( classifyOnly )
+                classifyBlock(data, y0, y1, x0, x1, nchannels, state, partial);
+            else if( confidentBackground(data, y1 - y0, x0, x1, nchannels, state) )
+            {
+                state[BLOCK_RETAIN] *= 1.f - alphaT;
+                state[BLOCK_COUNTDOWN]--;
+                for( int y = y0; y < y1; y++ )
+                    std::fill(dst->ptr(y) + x0, dst->ptr(y) + x1, 0);
+                partial.skipped += (y1 - y0)*(x1 - x0);
+            }
+            else
+                updateBlock(data, y0, y1, x0, x1, nchannels, state, partial);
+        }
+
+        if( fgimage )
+            for( int y = y0; y < y1; y++ )
+                compositeRow(y);
+        if( zonePartial )
+            for( int y = y0; y < y1; y++ )
+                zoneRow(y, *zonePartial);
+        if( activity0 )
+            for( int y = y0; y < y1; y++ )
+                activityRow(y);
+
+        if( counters )
+            for( int y = y0; y < y1; y++ )
+                countRow(dst->ptr(y), modesUsed0 + ncols*y, ncols, partial);
+    }
+
+    if( zonePartial )
+        zones->addPartial(*zonePartial);
+    if( counters )
+    {
+        // shadow test is interleaved with the update here
+        partial.updateSeconds = (getTickCount() - tick) / getTickFrequency();
+        counters->addPartial(partial);
+    }
+}
+
+// true if every pixel of the block is bound to fit its dominant mode
+bool confidentBackground(const float* const* data, int nrows, int x0, int x1, int nchannels,
+                         const float* state) const
+{
+    if( state[BLOCK_SPREAD] < 0.f || state[BLOCK_COUNTDOWN] <= 0.f )
+        return false;
+    float radius = std::sqrt(MIN(Tg, Tb)*state[BLOCK_VARMIN]) - state[BLOCK_SPREAD];
+    if( radius <= 0.f )
+        return false;
+
+    float radius2 = radius*radius;
+    const float* ref = state + BLOCK_REF;
+    for( int r = 0; r < nrows; r++ )
+    {
+        const float* x = data[r] + x0*nchannels;
+        for( int i = x0; i < x1; i++, x += nchannels )
+        {
+            float dist2 = 0.f;
+            for( int c = 0; c < nchannels; c++ )
+            {
+                float d = x[c]*globalChange - ref[c];
+                dist2 += d*d;
+            }
+            if( dist2 >= radius2 )
+                return false;
+        }
+    }
+    return true;
+}
+
+// classification of a block without touching the model or the block state;
+// a confident block is all background, the others are classified pixel by
+// pixel against the model as it is (a decay pending from skipped frames is
+// not applied)
+void classifyBlock(const float* const* data, int y0, int y1, int x0, int x1, int nchannels,
+                   const float* state, ModelCounters::Partial& partial) const
+{
+    if( confidentBackground(data, y1 - y0, x0, x1, nchannels, state) )
+    {
+        for( int y = y0; y < y1; y++ )
+            std::fill(dst->ptr(y) + x0, dst->ptr(y) + x1, 0);
+        partial.skipped += (y1 - y0)*(x1 - x0);
+        return;
+    }
+
+    int ncols = src->cols;
+    for( int y = y0; y < y1; y++ )
+    {
+        const float* x         = data[y - y0] + x0*nchannels;
+        size_t idx             = (size_t)ncols*y + x0;
+        const GMM*   gmm       = gmm0 + idx*nmixtures;
+        const float* mean      = mean0 + idx*nmixtures*nchannels;
+        const uchar* order     = order0 + idx*nmixtures;
+        const uchar* modesUsed = modesUsed0 + idx;
+        uchar*       mask      = dst->ptr(y) + x0;
+
+        for( int i = 0; i < x1 - x0; i++, x += nchannels, gmm += nmixtures,
+             mean += nmixtures*nchannels, order += nmixtures )
+        {
+            int nmodes = modesUsed[i];
+            bool background = nchannels == 1 ? classifyPixel<1>(x, nchannels, gmm, mean, order, nmodes) :
+                              nchannels == 3 ? classifyPixel<3>(x, nchannels, gmm, mean, order, nmodes) :
+                                               classifyPixel<0>(x, nchannels, gmm, mean, order, nmodes);
+            mask[i] = background ? 0 : 255;
+            if( !background && detectShadows &&
+                detectShadowGMM(x, nchannels, nmodes, gmm, mean, Tb, TB, tau, order) )
+                mask[i] = shadowVal;
+        }
+    }
+}
+
+// full update of a block, then a new summary of its dominant modes
+void updateBlock(const float* const* data, int y0, int y1, int x0, int x1, int nchannels,
+                 float* state, ModelCounters::Partial& partial) const
+{
+    int ncols    = src->cols;
+    float retain = state[BLOCK_RETAIN];
+    float* ref   = state + BLOCK_REF;
+    float varMin = FLT_MAX;
+    bool  valid  = true;
+
+    for( int c = 0; c < nchannels; c++ )
+        ref[c] = 0.f;
+
+    for( int y = y0; y < y1; y++ )
+    {
+        const float* x   = data[y - y0] + x0*nchannels;
+        size_t idx       = (size_t)ncols*y + x0;
+        GMM*   gmm       = gmm0 + idx*nmixtures;
+        float* mean      = mean0 + idx*nmixtures*nchannels;
+        float* cm        = Cm0 + idx*nmixtures;
+        uchar* order     = order0 + idx*nmixtures;
+        uchar* modesUsed = modesUsed0 + idx;
+        uchar* mask      = dst->ptr(y) + x0;
+
+        for( int i = 0; i < x1 - x0; i++, x += nchannels, gmm += nmixtures,
+             mean += nmixtures*nchannels, cm += nmixtures, order += nmixtures )
+        {
+            int nmodes = modesUsed[i];
+
+            // frames skipped since the last update all matched the dominant mode
+            if( retain < 1.f && nmodes > 0 )
+            {
+                gmm[order[0]].weight = gmm[order[0]].weight*retain + (1.f - retain);
+                for( int r = 1; r < nmodes; r++ )
+                    gmm[order[r]].weight *= retain;
+            }
+
+            bool background = nchannels == 1 ? updatePixel<1>(x, nchannels, gmm, mean, cm, order, nmodes, partial) :
+                              nchannels == 3 ? updatePixel<3>(x, nchannels, gmm, mean, cm, order, nmodes, partial) :
+                                               updatePixel<0>(x, nchannels, gmm, mean, cm, order, nmodes, partial);
+
+            mask[i] = background ? 0 : 255;
+            if( !background && detectShadows &&
+                detectShadowGMM(x, nchannels, nmodes, gmm, mean, Tb, TB, tau, order) )
+                mask[i] = shadowVal;
+            modesUsed[i] = uchar(nmodes);
+
+            if( nmodes == 0 )
+            {
+                valid = false;
+                continue;
+            }
+            varMin = MIN(varMin, gmm[order[0]].variance);
+            for( int c = 0; c < nchannels; c++ )
+                ref[c] += mean[order[0]*nchannels + c];
+        }
+    }
+
+    state[BLOCK_RETAIN]    = 1.f;
+    state[BLOCK_COUNTDOWN] = (float)blockMaxSkip;
+    state[BLOCK_SPREAD]    = -1.f;
+    if( !valid )
+        return;
+
+    int pixels = (y1 - y0)*(x1 - x0);
+    for( int c = 0; c < nchannels; c++ )
+        ref[c] /= pixels;
+
+    // largest distance of a dominant mean from the block mean
+    float spread2 = 0.f;
+    for( int y = y0; y < y1; y++ )
+    {
+        size_t idx         = (size_t)ncols*y + x0;
+        const float* mean  = mean0 + idx*nmixtures*nchannels;
+        const uchar* order = order0 + idx*nmixtures;
+        for( int i = x0; i < x1; i++, mean += nmixtures*nchannels, order += nmixtures )
+        {
+            const float* dominant = mean + order[0]*nchannels;
+            float dist2 = 0.f;
+            for( int c = 0; c < nchannels; c++ )
+                dist2 += (dominant[c] - ref[c])*(dominant[c] - ref[c]);
+            spread2 = MAX(spread2, dist2);
+        }
+    }
+    state[BLOCK_SPREAD] = std::sqrt(spread2);
+    state[BLOCK_VARMIN] = varMin;
+}
+
+    Mat* blocks;
 };
 
 /*
@@ -589,6 +1229,7 @@ BackgroundSubtractorMOG3::BackgroundSubtractorMOG3()
 
 
 BackgroundSubtractorMOG3::BackgroundSubtractorMOG3()
+: snapshots(*this)
 {
     frameSize        = Size(0,0);
     frameType        = 0;
@@ -608,10 +1249,30 @@ BackgroundSubtractorMOG3::BackgroundSubtractorMOG3()
     fCT              = CT;
     nShadowDetection =  defaultnShadowDetection2;
     fTau             = Tau;
+    alpha            = Alpha;
+    framesSkipped    = 0;
+    parametersPending   = false;
+    parameterCheckEvery = 0;
+    parameterFileTime   = 0;
+    compactModel     = false;
+    coarseToFine     = false;
+    foregroundFill   = Scalar::all(0);
+    updateSubsampling = 1;
+    inputFractionalBits = 0;
+    updateFrames     = 0;
+    workerPool       = NULL;
+    modelArena       = NULL;
+    outputAllocator  = NULL;
+    counters         = NULL;
+    eventLog         = NULL;
+    zoneOccupancy    = NULL;
+    generation       = 0;
+    trackActivity    = false;
 }
 
 
 BackgroundSubtractorMOG3::BackgroundSubtractorMOG3(int _history,  float _varThreshold, bool _bShadowDetection)
+: snapshots(*this)
 {
     frameSize        = Size(0,0);
     frameType        = 0;
@@ -631,15 +1292,41 @@ BackgroundSubtractorMOG3::BackgroundSubtractorMOG3(int _history,  float _varThre
     fCT              = CT;
     nShadowDetection =  defaultnShadowDetection2;
     fTau             = Tau;
+    // a history of n frames learns at 1/n
+    alpha            = _history > 0 ? 1.f/_history : Alpha;
+    framesSkipped    = 0;
+    parametersPending   = false;
+    parameterCheckEvery = 0;
+    parameterFileTime   = 0;
+    compactModel     = false;
+    coarseToFine     = false;
+    foregroundFill   = Scalar::all(0);
+    updateSubsampling = 1;
+    inputFractionalBits = 0;
+    updateFrames     = 0;
+    workerPool       = NULL;
+    modelArena       = NULL;
+    outputAllocator  = NULL;
+    counters         = NULL;
+    eventLog         = NULL;
+    zoneOccupancy    = NULL;
+    generation       = 0;
+    trackActivity    = false;
 }
 
 BackgroundSubtractorMOG3::~BackgroundSubtractorMOG3()
 {
+    // snapshots still held keep their own copy
+    snapshots.detach();
 }
 
 
 void BackgroundSubtractorMOG3::initialize(Size _frameSize, int _frameType)
 {
+    ModelSnapshots::Update update(snapshots, nframes);
+    snapshots.detach();
+
+    generation++;
     frameSize = _frameSize;
     frameType = _frameType;
     nframes = 0;
@@ -659,48 +1346,145 @@ void BackgroundSubtractorMOG3::initialize(Size _frameSize, int _frameType)
     
     
     int matSize   = frameSize.height*frameSize.width;
-    int columnsNo = matSize*nmixtures*(2 + nchannels);
-    
-    GaussianModel.create(1, columnsNo, CV_32F );
-    GMM* ptrGMM = (GMM*)GaussianModel.data;
-    GMM*   data  = ptrGMM;
-    
-    MEAN* ptrMean = (MEAN*)(GaussianModel.data + 2*nmixtures*matSize);
-    MEAN*  ptrm  = ptrMean;
-    
-    for (int i=0; i<matSize; i++) {
-        data = ptrGMM + i*nmixtures;
-        data->weight     = 1.0f;
-        data->variance = 11.0f;
-        
-        //initialize first gaussian mean (RGB)
-        ptrm = ptrMean + i*nmixtures;
-        ptrm->meanR = 1.0f;
-        ptrm->meanG = 1.0f;
-        ptrm->meanB = 1.0f;
-    }
-    
+
+    // with the same geometry create() keeps the buffers (and their pages)
+    useModelAllocator(GaussianModel, modelArena);
+    useModelAllocator(BackgroundNumberCounter, modelArena);
+    useModelAllocator(ModeOrder, modelArena);
+    useModelAllocator(CurrentGaussianModel, modelArena);
+    useModelAllocator(Background, modelArena);
+    useModelAllocator(Foreground, modelArena);
+
     CurrentGaussianModel.create(frameSize, CV_8U);
-    //CurrentGaussianModel = Scalar(1,0,0,0);
-    CurrentGaussianModel = Scalar::all(0);
-    
-    
-    BackgroundNumberCounter.create(1, frameSize.height*frameSize.width*nmixtures, CV_32F);
-    float* ptrCnt = (float*)BackgroundNumberCounter.data;
-    int nc= BackgroundNumberCounter.cols * BackgroundNumberCounter.channels();
-    for (int i=0; i<nc; i+=nmixtures)
-        ptrCnt[i]= 1.0f;
-    
+
     //Keep a result of background and foreground every call processing
     Background.create(1, matSize*nchannels, CV_32F);
     Foreground.create(1, matSize,           CV_32F);
-    
-    
+
+    GMM*   ptrGMM  = NULL;
+    float* ptrMean = NULL;
+    float* ptrCnt  = NULL;
+    uchar* ptrOrder = NULL;
+    if (compactModel) {
+        GaussianModel.release();
+        BackgroundNumberCounter.release();
+        ModeOrder.release();
+        compactStore.create(frameSize, nchannels, nmixtures);
+    }
+    else {
+        compactStore.release();
+        GaussianModel.create(1, matSize*nmixtures*(2 + nchannels), CV_32F );
+        ptrGMM = (GMM*)GaussianModel.data;
+        // means follow the GMM entries of all pixels, nchannels floats per mode
+        ptrMean = (float*)(ptrGMM + nmixtures*matSize);
+        BackgroundNumberCounter.create(1, matSize*nmixtures, CV_32F);
+        ptrCnt = (float*)BackgroundNumberCounter.data;
+        ModeOrder.create(1, matSize*nmixtures, CV_8U);
+        ptrOrder = ModeOrder.data;
+    }
+
+    // with a worker pool every band is first written, and so placed, by
+    // the worker that updates it
+    runRows(workerPool, Range(0, frameSize.height),
+            ModelInitInvoker(frameSize, nchannels, nmixtures, ptrGMM, ptrMean, ptrCnt, ptrOrder,
+                             CurrentGaussianModel.data, (float*)Background.data, (float*)Foreground.data));
+    rowActivity.assign(frameSize.height, 0);
+    resetBlockState();
+
+    // what the new buffers did not reuse belongs to another geometry or layout
+    if (modelArena)
+        modelArena->trim();
+}
+
+
+// No block can be skipped before its first full update. The countdowns are
+// staggered so that the forced updates of a static scene spread over frames.
+void BackgroundSubtractorMOG3::resetBlockState()
+{
+    if (!coarseToFine || compactModel || frameSize.area() == 0) {
+        blockState.release();
+        return;
+    }
+
+    int nchannels = CV_MAT_CN(frameType);
+    blockState.create((frameSize.height + blockSize - 1) / blockSize,
+                      (frameSize.width + blockSize - 1) / blockSize, CV_32FC(BLOCK_REF + nchannels));
+    blockState = Scalar::all(0);
+    for (int by=0; by<blockState.rows; by++) {
+        float* state = blockState.ptr<float>(by);
+        for (int bx=0; bx<blockState.cols; bx++, state += blockState.channels()) {
+            state[BLOCK_SPREAD]    = -1.f;
+            state[BLOCK_RETAIN]    = 1.f;
+            state[BLOCK_COUNTDOWN] = (float)(1 + (by*blockState.cols + bx) % blockMaxSkip);
+        }
+    }
+}
+
+
+void BackgroundSubtractorMOG3::setUpdateSubsampling(int k)
+{
+    CV_Assert( k >= 1 && k <= 255 );
+    updateSubsampling = k;
+}
+
+
+void BackgroundSubtractorMOG3::setFixedPointInput(int fractionalBits)
+{
+    CV_Assert( fractionalBits >= 0 && fractionalBits < 16 );
+    inputFractionalBits = fractionalBits;
+}
+
+
+void BackgroundSubtractorMOG3::setCoarseToFine(bool enable)
+{
+    if (enable == coarseToFine)
+        return;
+    coarseToFine = enable;
+    resetBlockState();
+}
+
+
+void BackgroundSubtractorMOG3::setCompactModel(bool enable)
+{
+    if (enable != compactModel)
+        nframes = 0;
+    compactModel = enable;
+}
+
+void BackgroundSubtractorMOG3::operator()(InputArray image, OutputArray fgmask, double learningRate)
+{
+    process(image, fgmask, NULL, learningRate);
+}
+
+
+void BackgroundSubtractorMOG3::operator()(InputArray image, OutputArray fgmask, OutputArray _fgimage,
+                                          double learningRate)
+{
+    useAllocator(_fgimage, outputAllocator);
+    _fgimage.create(image.size(), image.type());
+    Mat fgimage = _fgimage.getMat();
+    process(image, fgmask, &fgimage, learningRate);
 }
 
-void BackgroundSubtractorMOG3::operator()(InputArray _image, OutputArray _fgmask, double learningRate)
+
+void BackgroundSubtractorMOG3::process(InputArray _image, OutputArray _fgmask, Mat* fgimage, double learningRate)
 {
     Mat image = _image.getMat();
+
+    // readers asking for a snapshot until the end of the frame get the one
+    // open now, or wait for the next frame boundary
+    ModelSnapshots::Update update(snapshots, nframes);
+
+    // parameter changes take effect between frames
+    if (parameterCheckEvery > 0 && nframes % parameterCheckEvery == 0)
+        checkParameterFile();
+    bool parametersChanged = parametersPending.load(std::memory_order_acquire);
+    if (parametersChanged) {
+        std::lock_guard<std::mutex> guard(parameterLock);
+        applyParameters(pendingParameters);
+        parametersPending.store(false, std::memory_order_relaxed);
+    }
+
     bool needToInitialize = nframes == 0 || 
                             learningRate >= 1 || 
                             image.size() != frameSize || 
@@ -709,17 +1493,31 @@ void BackgroundSubtractorMOG3::operator()(InputArray _image, OutputArray _fgmask
     if( needToInitialize )
         initialize(image.size(), image.type());
 
+    useAllocator(_fgmask, outputAllocator);
     _fgmask.create( image.size(), CV_8U );
     Mat fgmask = _fgmask.getMat();
 
     ++nframes;
 
     //learningRate = learningRate >= 0 && nframes > 1 ? learningRate : 1./min( 2*nframes, history );
-    learningRate = Alpha;
+    if (learningRate < 0)
+        learningRate = framesSkipped > 0 ? 1. - pow(1. - alpha, framesSkipped + 1) : alpha;
     CV_Assert(learningRate >= 0);
+    if (learningRate > 0)
+        framesSkipped = 0;
+
+    // a pixel updated every updateSubsampling-th update frame takes the decay
+    // of all of them at once; blocks of the coarse-to-fine path update every pixel
+    int updateStride = blockState.empty() ? updateSubsampling : 1;
+    if (updateStride > 1 && learningRate > 0)
+        learningRate = 1. - pow(1. - learningRate, updateStride);
 
     //Global illumination changing factor 'g' between reference image ir and current image ic.
     float globalIlluminationFactor = 1.0;
+
+    // a grey value has no chromaticity to tell a shadow from a darker object,
+    // and IR/thermal frames have no cast shadows: mono models do not test
+    bool detectShadows = bShadowDetection && image.channels() > 1;
     
   
     BackgroundSubtractionInvoker invoker(
@@ -727,6 +1525,7 @@ void BackgroundSubtractorMOG3::operator()(InputArray _image, OutputArray _fgmask
             fgmask, 
             (GMM*)GaussianModel.data, 
             (float*)(GaussianModel.data + sizeof(GMM)*nmixtures*image.rows*image.cols),
+            ModeOrder.data,
             CurrentGaussianModel.data, 
             nmixtures, 
             (float)learningRate,
@@ -738,36 +1537,431 @@ void BackgroundSubtractorMOG3::operator()(InputArray _image, OutputArray _fgmask
             fVarMax, 
             float(-learningRate*fCT), 
             fTau,
-            bShadowDetection, 
+            detectShadows, 
             nShadowDetection,
             globalIlluminationFactor,
             (float *)BackgroundNumberCounter.data,
-            (float *)Background.data, (float *)Foreground.data);
-    
-    parallel_for_(Range(0, image.rows), invoker);
+            (float *)Background.data, (float *)Foreground.data,
+            counters, eventLog, nframes - 1);
+    if (image.depth() == CV_16U && inputFractionalBits > 0)
+        invoker.setInputScale(1./(1 << inputFractionalBits));
+    // a frame that only classifies reads the model and has nothing to preserve;
+    // the snapshot of the frame boundary before it stays current
+    update.setReadOnly(learningRate == 0 && !needToInitialize && !parametersChanged);
+    if (learningRate > 0) {
+        invoker.setSubsampling(updateStride, updateFrames++);
+        invoker.setSnapshot(snapshots.preserving());
+    }
+    else
+        invoker.setClassifyOnly();
+
+    if (zoneOccupancy) {
+        zoneOccupancy->prepare(image.size());
+        invoker.setZones(zoneOccupancy);
+    }
+    // classification only leaves the model as it is
+    if (trackActivity.load(std::memory_order_relaxed) && learningRate > 0)
+        invoker.setActivity(&rowActivity[0]);
+
+    // one pixel of the frame's type, on the stack
+    double fillData[CV_CN_MAX];
+    Mat fillPixel;
+    if (fgimage) {
+        fillPixel = Mat(1, 1, image.type(), fillData);
+        fillPixel = foregroundFill;
+        invoker.setComposite(fgimage, fillPixel.data);
+    }
+
+    PerfScope event(eventLog, PERF_MODEL, nframes - 1);
+    event.counters[0] = image.total();
+
+    int64 start = counters ? getTickCount() : 0;
+    if (counters)
+        counters->beginFrame();
+    if (zoneOccupancy)
+        zoneOccupancy->beginFrame(nframes - 1);
+
+    if (!compactStore.empty())
+        runRows(workerPool, Range(0, compactStore.tiles()), CompactSubtractionInvoker(invoker, &compactStore));
+    else if (!blockState.empty())
+        runRows(workerPool, Range(0, blockState.rows), BlockSubtractionInvoker(invoker, &blockState));
+    else
+        runRows(workerPool, Range(0, image.rows), invoker);
+
+    if (zoneOccupancy)
+        zoneOccupancy->endFrame();
+    if (counters)
+        counters->endFrame((getTickCount() - start) / getTickFrequency());
 
 }
 
-void BackgroundSubtractorMOG3::getBackgroundImage(OutputArray backgroundImage) const
+void BackgroundSubtractorMOG3::classify(InputArray image, OutputArray fgmask)
+{
+    (*this)(image, fgmask, 0);
+    framesSkipped++;
+}
+
+
+void BackgroundSubtractorMOG3::classify(InputArray image, OutputArray fgmask, OutputArray fgimage)
+{
+    (*this)(image, fgmask, fgimage, 0);
+    framesSkipped++;
+}
+
+
+BackgroundSubtractorMOG3::Parameters::Parameters()
+: alpha(Alpha), cf(Cf), gaussiansNo(GaussiansNo), sigma(Sigma), sigmaMax(SigmaMax),
+  sigmaMin(SigmaMin), pixelRange(PixelRange), pixelGen(PixelGen), ct(CT), tau(Tau),
+  shadowDetection(true), shadowValue(defaultnShadowDetection2)
+{
+}
+
+
+template<typename T> static void readValue(const FileNode& node, const string& name, T& value)
+{
+    FileNode n = node[name];
+    if (!n.empty())
+        n >> value;
+}
+
+
+void BackgroundSubtractorMOG3::Parameters::read(const FileNode& node)
+{
+    int shadows = shadowDetection;
+    readValue(node, "Alpha",           alpha);
+    readValue(node, "Cf",              cf);
+    readValue(node, "GaussiansNo",     gaussiansNo);
+    readValue(node, "Sigma",           sigma);
+    readValue(node, "SigmaMax",        sigmaMax);
+    readValue(node, "SigmaMin",        sigmaMin);
+    readValue(node, "PixelRange",      pixelRange);
+    readValue(node, "PixelGen",        pixelGen);
+    readValue(node, "CT",              ct);
+    readValue(node, "Tau",             tau);
+    readValue(node, "ShadowDetection", shadows);
+    readValue(node, "ShadowValue",     shadowValue);
+    shadowDetection = shadows != 0;
+}
+
+
+void BackgroundSubtractorMOG3::Parameters::write(FileStorage& fs) const
+{
+    fs << "Alpha"           << alpha;
+    fs << "Cf"              << cf;
+    fs << "GaussiansNo"     << gaussiansNo;
+    fs << "Sigma"           << sigma;
+    fs << "SigmaMax"        << sigmaMax;
+    fs << "SigmaMin"        << sigmaMin;
+    fs << "PixelRange"      << pixelRange;
+    fs << "PixelGen"        << pixelGen;
+    fs << "CT"              << ct;
+    fs << "Tau"             << tau;
+    fs << "ShadowDetection" << (int)shadowDetection;
+    fs << "ShadowValue"     << shadowValue;
+}
+
+
+bool BackgroundSubtractorMOG3::Parameters::valid() const
+{
+    return alpha >= 0 && alpha < 1 &&
+           cf > 0 && cf < 1 &&
+           gaussiansNo >= 1 && gaussiansNo <= 255 &&
+           sigmaMin > 0 && sigmaMin <= sigmaMax && sigma > 0 &&
+           pixelRange > 0 && pixelGen > 0 &&
+           ct >= 0 &&
+           tau > 0 && tau <= 1 &&
+           shadowValue > 0 && shadowValue < 255;
+}
+
+
+BackgroundSubtractorMOG3::Parameters BackgroundSubtractorMOG3::getParameters() const
+{
+    Parameters p;
+    p.alpha           = alpha;
+    p.cf              = 1.f - backgroundRatio;
+    p.gaussiansNo     = nmixtures;
+    p.sigma           = fVarInit;
+    p.sigmaMax        = fVarMax;
+    p.sigmaMin        = fVarMin;
+    p.pixelRange      = (float)varThreshold;
+    p.pixelGen        = varThresholdGen;
+    p.ct              = fCT;
+    p.tau             = fTau;
+    p.shadowDetection = bShadowDetection;
+    p.shadowValue     = nShadowDetection;
+    return p;
+}
+
+
+bool BackgroundSubtractorMOG3::setParameters(const Parameters& params)
+{
+    if (!params.valid())
+        return false;
+
+    std::lock_guard<std::mutex> guard(parameterLock);
+    pendingParameters = params;
+    parametersPending.store(true, std::memory_order_release);
+    return true;
+}
+
+
+bool BackgroundSubtractorMOG3::loadParameters(const std::string& fileName, int checkEvery)
+{
+    FileStorage fs(fileName, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+
+    Parameters params = getParameters();
+    params.read(fs.root());
+    if (!setParameters(params))
+        return false;
+
+    struct stat st;
+    parameterFile       = fileName;
+    parameterCheckEvery = checkEvery;
+    parameterFileTime   = stat(fileName.c_str(), &st) == 0 ? st.st_mtime : 0;
+    return true;
+}
+
+
+// called on the model's thread between frames
+void BackgroundSubtractorMOG3::checkParameterFile()
+{
+    struct stat st;
+    if (stat(parameterFile.c_str(), &st) != 0 || st.st_mtime == parameterFileTime)
+        return;
+    parameterFileTime = st.st_mtime;
+
+    log4cplus::Logger logger = log4cplus::Logger::getInstance(LOG4CPLUS_TEXT("sagmm.model"));
+    FileStorage fs(parameterFile, FileStorage::READ);
+    if (!fs.isOpened()) {
+        LOG4CPLUS_WARN(logger, "cannot read parameters from " << parameterFile);
+        return;
+    }
+
+    Parameters params = getParameters();
+    params.read(fs.root());
+    if (!params.valid()) {
+        LOG4CPLUS_WARN(logger, "parameters in " << parameterFile << " out of range, ignored");
+        return;
+    }
+    applyParameters(params);
+    LOG4CPLUS_INFO(logger, "parameters reloaded from " << parameterFile << " at frame " << nframes);
+}
+
+
+void BackgroundSubtractorMOG3::applyParameters(const Parameters& p)
+{
+    if (p.gaussiansNo != nmixtures)
+        migrateMixtures(p.gaussiansNo);
+
+    alpha            = p.alpha;
+    backgroundRatio  = 1.f - p.cf;
+    fVarInit         = p.sigma;
+    fVarMax          = p.sigmaMax;
+    fVarMin          = p.sigmaMin;
+    varThreshold     = p.pixelRange;
+    varThresholdGen  = p.pixelGen;
+    fCT              = p.ct;
+    fTau             = p.tau;
+    bShadowDetection = p.shadowDetection;
+    nShadowDetection = (unsigned char)p.shadowValue;
+}
+
+
+// Re-lays out the model for a different maximal number of modes. Modes are
+// taken by rank, so shrinking drops the weakest ones of a pixel and
+// renormalizes the remaining weights; growing adds empty slots. The new
+// dense layout holds the modes in rank order.
+void BackgroundSubtractorMOG3::migrateMixtures(int newMixtures)
+{
+    snapshots.detach();
+    int oldMixtures = nmixtures;
+    nmixtures = newMixtures;
+    // the next frame initializes the model anyway (also after a change of
+    // setCompactModel(), which leaves the buffers in the old layout)
+    if (CurrentGaussianModel.empty() || nframes == 0)
+        return;
+
+    int nchannels = CV_MAT_CN(frameType);
+    int matSize   = frameSize.height*frameSize.width;
+    uchar* modesUsed = CurrentGaussianModel.data;
+
+    // the layout the buffers are in, compactModel may already name the next one
+    if (!compactStore.empty()) {
+        CompactMixtureStore migrated;
+        migrated.create(frameSize, nchannels, newMixtures);
+
+        vector<GMM>   gmm(oldMixtures);
+        vector<float> mean(oldMixtures*nchannels), cnt(oldMixtures);
+        for (int i=0; i<matSize; i++) {
+            int kept = std::min((int)modesUsed[i], newMixtures);
+            compactStore.load(i, modesUsed[i], &gmm[0], &mean[0], &cnt[0]);
+            float totalWeight = 0.f;
+            for (int m=0; m<kept; m++)
+                totalWeight += gmm[m].weight;
+            if (kept < modesUsed[i] && totalWeight > 0)
+                for (int m=0; m<kept; m++)
+                    gmm[m].weight /= totalWeight;
+            migrated.store(i, kept, &gmm[0], &mean[0], &cnt[0]);
+            modesUsed[i] = (uchar)kept;
+        }
+        compactStore = migrated;
+        return;
+    }
+
+    Mat model, counter, order;
+    model.allocator = counter.allocator = order.allocator = modelArena;
+    model.create(1, matSize*newMixtures*(2 + nchannels), CV_32F);
+    counter.create(1, matSize*newMixtures, CV_32F);
+    order.create(1, matSize*newMixtures, CV_8U);
+    model   = Scalar::all(0);
+    counter = Scalar::all(1.0f);
+
+    const GMM*   oldGmm  = (const GMM*)GaussianModel.data;
+    const float* oldMean = (const float*)(oldGmm + oldMixtures*matSize);
+    const float* oldCnt  = (const float*)BackgroundNumberCounter.data;
+    const uchar* oldOrder = ModeOrder.data;
+    GMM*   newGmm  = (GMM*)model.data;
+    float* newMean = (float*)(newGmm + newMixtures*matSize);
+    float* newCnt  = (float*)counter.data;
+    uchar* newOrder = order.data;
+
+    for (int i=0; i<matSize; i++) {
+        int kept = std::min((int)modesUsed[i], newMixtures);
+        float totalWeight = 0.f;
+        for (int m=0; m<newMixtures; m++)
+            newOrder[i*newMixtures + m] = (uchar)m;
+        for (int m=0; m<kept; m++) {
+            int from = i*oldMixtures + oldOrder[i*oldMixtures + m];
+            newGmm[i*newMixtures + m] = oldGmm[from];
+            newCnt[i*newMixtures + m] = oldCnt[from];
+            for (int c=0; c<nchannels; c++)
+                newMean[(i*newMixtures + m)*nchannels + c] = oldMean[from*nchannels + c];
+            totalWeight += newGmm[i*newMixtures + m].weight;
+        }
+        if (kept < modesUsed[i] && totalWeight > 0)
+            for (int m=0; m<kept; m++)
+                newGmm[i*newMixtures + m].weight /= totalWeight;
+        modesUsed[i] = (uchar)kept;
+    }
+
+    GaussianModel = model;
+    BackgroundNumberCounter = counter;
+    ModeOrder = order;
+    // the buffers of the old mixture count
+    if (modelArena)
+        modelArena->trim();
+}
+
+
+size_t BackgroundSubtractorMOG3::modelBytes() const
+{
+    return GaussianModel.total()*GaussianModel.elemSize() +
+           CurrentGaussianModel.total()*CurrentGaussianModel.elemSize() +
+           BackgroundNumberCounter.total()*BackgroundNumberCounter.elemSize() +
+           ModeOrder.total()*ModeOrder.elemSize() +
+           Background.total()*Background.elemSize() +
+           Foreground.total()*Foreground.elemSize() +
+           compactStore.bytes();
+}
+
+
+// Inverse of ModelSnapshot::readTile() into the layout initialize() made:
+// the modes of a pixel go to slots 0..nmodes-1, which the initial order
+// ranks as such. The layout is taken from the buffers, not from
+// compactModel, which may already be switched for the next initialization.
+void BackgroundSubtractorMOG3::importRows(const Range& rows, const Mat& modesUsed, const Mat& records)
 {
     int nchannels = CV_MAT_CN(frameType);
-    CV_Assert( nchannels == 3 );
-    Mat meanBackground(frameSize, CV_8UC3, Scalar::all(0));
+    int stride    = 3 + nchannels;
+    int ncols     = frameSize.width;
+    bool compact  = !compactStore.empty();
+
+    GMM*   gmm0  = (GMM*)GaussianModel.data;
+    float* mean0 = compact ? NULL : (float*)(gmm0 + nmixtures*frameSize.area());
+    float* cnt0  = (float*)BackgroundNumberCounter.data;
+
+    vector<GMM>   gmm(nmixtures);
+    vector<float> mean(nmixtures*nchannels), cnt(nmixtures);
+
+    for (int y = rows.start; y < rows.end; y++) {
+        const uchar* used = modesUsed.ptr(y - rows.start);
+        std::copy(used, used + ncols, CurrentGaussianModel.ptr(y));
+
+        for (int x = 0; x < ncols; x++) {
+            size_t idx = (size_t)y*ncols + x;
+            const float* record = records.ptr<float>((y - rows.start)*ncols + x);
+            int nmodes = used[x];
+            for (int m = 0; m < nmodes; m++, record += stride) {
+                GMM&   g    = compact ? gmm[m] : gmm0[idx*nmixtures + m];
+                float* mode = compact ? &mean[m*nchannels] : mean0 + (idx*nmixtures + m)*nchannels;
+                g.weight   = record[0];
+                g.variance = record[1];
+                (compact ? cnt[m] : cnt0[idx*nmixtures + m]) = record[2];
+                for (int c = 0; c < nchannels; c++)
+                    mode[c] = record[3 + c];
+            }
+            if (compact)
+                compactStore.store((int)idx, nmodes, &gmm[0], &mean[0], &cnt[0]);
+        }
+    }
+}
+
+
+// Mean of the background modes of every pixel, weighted, for cn channels.
+// store is the compact model or NULL for the dense layout in gmm/mean, whose
+// slots order lists by rank.
+template<int cn>
+static void backgroundMeans(const Mat& modesUsed, const GMM* gmm, const float* meanData, const uchar* order,
+                            const CompactMixtureStore* store, int nmixtures, float backgroundRatio,
+                            Mat& meanBackground)
+{
+    typedef Vec<float, cn> VecF;
+    typedef Vec<uchar, cn> VecB;
 
     int firstGaussianIdx = 0;
-    const GMM* gmm = (GMM*)GaussianModel.data;
-    const Vec3f* mean = reinterpret_cast<const Vec3f*>(gmm + frameSize.width*frameSize.height*nmixtures);
+    const VecF* mean = reinterpret_cast<const VecF*>(meanData);
+
+    // compact model: the modes of one pixel, copied out of the store; one
+    // buffer per thread, grown only when nmixtures does
+    static thread_local vector<GMM>   compactGmm;
+    static thread_local vector<VecF>  compactMean;
+    static thread_local vector<float> compactCnt;
+    if (store && compactGmm.size() < (size_t)nmixtures) {
+        compactGmm.resize(nmixtures);
+        compactMean.resize(nmixtures);
+        compactCnt.resize(nmixtures);
+    }
+
     for(int row=0; row<meanBackground.rows; row++)
     {
+        const uchar* nmodesRow = modesUsed.ptr(row);
+        VecB* dst = meanBackground.ptr<VecB>(row);
         for(int col=0; col<meanBackground.cols; col++)
         {
-            int nmodes = CurrentGaussianModel.at<uchar>(row, col);
-            Vec3f meanVal;
+            int nmodes = nmodesRow[col];
+            const GMM*  pixelGmm;
+            const VecF* pixelMean;
+            const uchar* pixelOrder = NULL;
+            if (store) {
+                store->load(row*meanBackground.cols + col, nmodes, &compactGmm[0],
+                            (float*)&compactMean[0], &compactCnt[0]);
+                pixelGmm  = &compactGmm[0];
+                pixelMean = &compactMean[0];
+            }
+            else {
+                pixelGmm   = gmm + firstGaussianIdx;
+                pixelMean  = mean + firstGaussianIdx;
+                pixelOrder = order + firstGaussianIdx;
+            }
+            VecF meanVal;
             float totalWeight = 0.f;
-            for(int gaussianIdx = firstGaussianIdx; gaussianIdx < firstGaussianIdx + nmodes; gaussianIdx++)
+            for(int rank = 0; rank < nmodes; rank++)
             {
-                GMM gaussian = gmm[gaussianIdx];
-                meanVal += gaussian.weight * mean[gaussianIdx];
+                int gaussianIdx = pixelOrder ? pixelOrder[rank] : rank;
+                GMM gaussian = pixelGmm[gaussianIdx];
+                meanVal += gaussian.weight * pixelMean[gaussianIdx];
                 totalWeight += gaussian.weight;
 
                 if(totalWeight > backgroundRatio)
@@ -775,30 +1969,38 @@ void BackgroundSubtractorMOG3::getBackgroundImage(OutputArray backgroundImage) c
             }
 
             meanVal *= (1.f / totalWeight);
-            meanBackground.at<Vec3b>(row, col) = Vec3b(meanVal);
+            dst[col] = VecB(meanVal);
             firstGaussianIdx += nmixtures;
         }
     }
+}
 
-    switch(CV_MAT_CN(frameType))
-    {
-    case 1:
-    {
-        vector<Mat> channels;
-        split(meanBackground, channels);
-        channels[0].copyTo(backgroundImage);
-        break;
-    }
-
-    case 3:
-    {
-        meanBackground.copyTo(backgroundImage);
-        break;
-    }
 
-    default:
-        CV_Error(CV_StsUnsupportedFormat, "");
-    }
+void BackgroundSubtractorMOG3::getBackgroundImage(OutputArray backgroundImage) const
+{
+    int nchannels = CV_MAT_CN(frameType);
+    CV_Assert( nchannels == 1 || nchannels == 3 );
+    int64 start = counters ? getTickCount() : 0;
+    PerfScope event(eventLog, PERF_BACKGROUND, nframes - 1);
+
+    // write straight into the caller's buffer
+    useAllocator(backgroundImage, outputAllocator);
+    backgroundImage.create(frameSize, CV_8UC(nchannels));
+    Mat meanBackground = backgroundImage.getMat();
+
+    // the layout the buffers are in, compactModel may already name the next one
+    bool compact = !compactStore.empty();
+    const GMM* gmm = (const GMM*)GaussianModel.data;
+    const float* mean = compact ? NULL : (const float*)(gmm + frameSize.width*frameSize.height*nmixtures);
+    const CompactMixtureStore* store = compact ? &compactStore : NULL;
+
+    if (nchannels == 1)
+        backgroundMeans<1>(CurrentGaussianModel, gmm, mean, ModeOrder.data, store, nmixtures, backgroundRatio, meanBackground);
+    else
+        backgroundMeans<3>(CurrentGaussianModel, gmm, mean, ModeOrder.data, store, nmixtures, backgroundRatio, meanBackground);
+
+    if (counters)
+        counters->addStageTime(ModelCounters::BACKGROUND, (getTickCount() - start) / getTickFrequency());
 }
 
 
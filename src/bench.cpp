@@ -0,0 +1,660 @@
+/*******************************************************************************
+ * <Self-Adaptive Gaussian Mixture Model.>
+ * Copyright (C) <2013>  <name of author>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+//
+// Micro-benchmarks of the hot paths:
+//
+//   model       BackgroundSubtractorMOG3::operator() (the per-pixel invoker)
+//   model_pinned the same on a PinnedWorkerPool (NUMA-local bands)
+//   model_hugepages the same with the model buffers in a huge-page ModelArena
+//   model_coarse the same with coarse-to-fine 8x8 block classification
+//   classify    operator() with learning rate 0: classification only, the
+//               model read but not written (the CLASSIFY of the scheduler)
+//   shadow      detectShadowGMM on a darkened copy of the frame
+//   background  BackgroundSubtractorMOG3::getBackgroundImage
+//   mdgkt       mdgkt::SpatioTemporalPreprocessing, float path
+//   mdgkt_fixed the same in fixed point (CV_8U output)
+//
+// swept over frame sizes, channels, nmixtures and thread counts. Frames come
+// from SyntheticScene with its fixed default seed (textured background,
+// moving objects with shadows, sensor noise), so every run sees the same
+// input and the model exercises its match, update and new-mode paths.
+// Results go out as JSON with ns/pixel (mean and best frame) and GB/s.
+// Bytes counted per frame are the frame data read and written plus, for the
+// model kernels, the model state (read and written by the update, read by
+// the background image); an estimate from buffer sizes, not a hardware
+// counter.
+//
+// Model kernels also report remote_page_fraction, the share of the model's
+// pages a worker finds on another NUMA node: measured band by band with
+// move_pages() for the pinned pool, estimated for parallel_for_ (any row on
+// any thread) from the page placement and the CPUs per node. Where perf
+// events are available they also report dtlb_misses_per_pixel, counted on
+// the calling thread only, so exact for --threads 1.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "background_subtraction.h"
+#include "gaussian_mixture.h"
+#include "mdgkt_filter.h"
+#include "model_arena.h"
+#include "numa_topology.h"
+#include "synthetic_scene.h"
+#include "worker_pool.h"
+
+
+using namespace cv;
+using namespace std;
+
+
+struct BenchOptions
+{
+    vector<string> sizes;
+    vector<int>    channels;
+    vector<int>    mixtures;
+    vector<int>    threads;
+    vector<string> kernels;
+    int            warmup;
+    int            frames;
+    string         output;
+
+    BenchOptions() : warmup(10), frames(20) { }
+};
+
+
+struct BenchResult
+{
+    string kernel;
+    Size   size;
+    int    channels;
+    int    mixtures;       // 0 for kernels without a model
+    int    threads;
+    int    frames;
+    double seconds;        // all measured frames
+    double bestSeconds;    // fastest frame
+    double bytes;          // per frame
+    double remotePages;    // model pages on another node than their worker, -1 unknown
+    double tlbMisses;      // dTLB load misses of all measured frames, -1 unknown
+};
+
+
+static const struct { const char* name; int width, height; } frameSizes[] = {
+    { "cif",   352,  288 },
+    { "vga",   640,  480 },
+    { "720p",  1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "4k",    3840, 2160 },
+};
+
+
+static void usage(const char* prog)
+{
+    cerr << "usage: " << prog << " [options]" << endl
+         << "      --sizes <list>      frame sizes: cif,vga,720p,1080p,4k (all)" << endl
+         << "      --channels <list>   1 and/or 3 (1,3)" << endl
+         << "      --mixtures <list>   maximal gaussians per pixel (3,4,5)" << endl
+         << "      --threads <list>    worker threads (1 and all cpus)" << endl
+         << "      --kernels <list>    model,model_pinned,model_hugepages,model_coarse," << endl
+         << "                          classify,shadow,background,mdgkt,mdgkt_fixed (all)" << endl
+         << "      --warmup <n>        frames before measuring (10)" << endl
+         << "  -n, --frames <n>        measured frames per configuration (20)" << endl
+         << "  -o, --output <file>     write JSON here instead of stdout" << endl;
+}
+
+
+static vector<string> splitList(const string& list)
+{
+    vector<string> items;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+
+static vector<int> splitIntList(const string& list)
+{
+    vector<string> items = splitList(list);
+    vector<int> values;
+    for (size_t i=0; i<items.size(); i++)
+        values.push_back(atoi(items[i].c_str()));
+    return values;
+}
+
+
+static bool parseOptions(int argc, char** argv, BenchOptions& opt)
+{
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i+1 < argc;
+
+        if (arg == "--sizes" && hasValue)
+            opt.sizes = splitList(argv[++i]);
+        else if (arg == "--channels" && hasValue)
+            opt.channels = splitIntList(argv[++i]);
+        else if (arg == "--mixtures" && hasValue)
+            opt.mixtures = splitIntList(argv[++i]);
+        else if (arg == "--threads" && hasValue)
+            opt.threads = splitIntList(argv[++i]);
+        else if (arg == "--kernels" && hasValue)
+            opt.kernels = splitList(argv[++i]);
+        else if (arg == "--warmup" && hasValue)
+            opt.warmup = atoi(argv[++i]);
+        else if ((arg == "-n" || arg == "--frames") && hasValue)
+            opt.frames = atoi(argv[++i]);
+        else if ((arg == "-o" || arg == "--output") && hasValue)
+            opt.output = argv[++i];
+        else {
+            cerr << "unknown or incomplete option: " << arg << endl;
+            return false;
+        }
+    }
+
+    if (opt.sizes.empty())
+        for (size_t i=0; i<sizeof(frameSizes)/sizeof(frameSizes[0]); i++)
+            opt.sizes.push_back(frameSizes[i].name);
+    if (opt.channels.empty()) {
+        opt.channels.push_back(1);
+        opt.channels.push_back(3);
+    }
+    if (opt.mixtures.empty())
+        for (int m=3; m<=5; m++)
+            opt.mixtures.push_back(m);
+    if (opt.threads.empty()) {
+        opt.threads.push_back(1);
+        if (getNumberOfCPUs() > 1)
+            opt.threads.push_back(getNumberOfCPUs());
+    }
+    if (opt.kernels.empty())
+        opt.kernels = splitList("model,model_pinned,model_hugepages,model_coarse,classify,shadow,background,mdgkt,mdgkt_fixed");
+
+    for (size_t i=0; i<opt.channels.size(); i++)
+        if (opt.channels[i] != 1 && opt.channels[i] != 3) {
+            cerr << "--channels takes 1 and/or 3" << endl;
+            return false;
+        }
+    for (size_t i=0; i<opt.mixtures.size(); i++)
+        if (opt.mixtures[i] < 1 || opt.mixtures[i] > 255) {
+            cerr << "--mixtures takes values from 1 to 255" << endl;
+            return false;
+        }
+    return opt.frames > 0 && opt.warmup >= 0;
+}
+
+
+static bool wants(const BenchOptions& opt, const string& kernel)
+{
+    return std::find(opt.kernels.begin(), opt.kernels.end(), kernel) != opt.kernels.end();
+}
+
+
+static bool lookupSize(const string& name, Size& size)
+{
+    for (size_t i=0; i<sizeof(frameSizes)/sizeof(frameSizes[0]); i++)
+        if (name == frameSizes[i].name) {
+            size = Size(frameSizes[i].width, frameSizes[i].height);
+            return true;
+        }
+    return sscanf(name.c_str(), "%dx%d", &size.width, &size.height) == 2 && size.area() > 0;
+}
+
+
+/**
+ * Model with a configurable number of mixtures and access to its state.
+ */
+class BenchSubtractor : public BackgroundSubtractorMOG3
+{
+public:
+    BenchSubtractor(int mixtures) { nmixtures = mixtures; }
+
+    int mixtures() const { return nmixtures; }
+    float backgroundThreshold() const { return backgroundRatio; }
+    float shadowThreshold() const { return fTau; }
+    float matchThreshold() const { return (float)varThreshold; }
+
+    const GMM* gaussians() const { return (const GMM*)GaussianModel.data; }
+    const float* means() const { return (const float*)(gaussians() + nmixtures*frameSize.area()); }
+    const Mat& modesUsed() const { return CurrentGaussianModel; }
+    const float* modeCounters() const { return (const float*)BackgroundNumberCounter.data; }
+    const uchar* modeOrder() const { return ModeOrder.data; }
+};
+
+
+/**
+ * dTLB load misses of the calling thread, through perf_event_open.
+ */
+class TlbMissCounter
+{
+public:
+    TlbMissCounter() : fd(-1)
+    {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size     = sizeof(attr);
+        attr.type     = PERF_TYPE_HW_CACHE;
+        attr.config   = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    ~TlbMissCounter()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool available() const { return fd >= 0; }
+
+    void start()
+    {
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    //! misses since start()
+    double stop()
+    {
+        uint64 count = 0;
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count))
+                count = 0;
+        }
+#endif
+        return (double)count;
+    }
+
+private:
+    int fd;
+};
+
+
+/**
+ * detectShadowGMM for every pixel of a frame against the model.
+ */
+class ShadowInvoker : public ParallelLoopBody
+{
+public:
+    ShadowInvoker(const Mat& _data, const BenchSubtractor& _model, vector<int>& _hits)
+    : data(&_data), model(&_model), hits(&_hits) { }
+
+    void operator()(const Range& range) const
+    {
+        int nchannels = data->channels();
+        int nmixtures = model->mixtures();
+        float Tb  = model->matchThreshold();
+        float TB  = model->backgroundThreshold();
+        float tau = model->shadowThreshold();
+
+        for (int y = range.start; y < range.end; y++) {
+            const float* d   = data->ptr<float>(y);
+            const uchar* nm  = model->modesUsed().ptr<uchar>(y);
+            const GMM* gmm   = model->gaussians() + (size_t)y*data->cols*nmixtures;
+            const float* mean = model->means() + (size_t)y*data->cols*nmixtures*nchannels;
+            const uchar* order = model->modeOrder() + (size_t)y*data->cols*nmixtures;
+            int count = 0;
+
+            for (int x = 0; x < data->cols; x++, d += nchannels, gmm += nmixtures, mean += nmixtures*nchannels,
+                 order += nmixtures)
+                count += detectShadowGMM(d, nchannels, nm[x], gmm, mean, Tb, TB, tau, order);
+            (*hits)[y] = count;
+        }
+    }
+
+private:
+    const Mat* data;
+    const BenchSubtractor* model;
+    vector<int>* hits;
+};
+
+
+static double seconds(int64 start)
+{
+    return (getTickCount() - start) / getTickFrequency();
+}
+
+
+static void record(BenchResult& r, double elapsed)
+{
+    r.seconds    += elapsed;
+    r.bestSeconds = r.frames == 0 ? elapsed : std::min(r.bestSeconds, elapsed);
+    r.frames++;
+}
+
+
+static BenchResult makeResult(const string& kernel, Size size, int channels, int mixtures, int threads)
+{
+    BenchResult r;
+    r.kernel      = kernel;
+    r.size        = size;
+    r.channels    = channels;
+    r.mixtures    = mixtures;
+    r.threads     = threads;
+    r.frames      = 0;
+    r.seconds     = 0;
+    r.bestSeconds = 0;
+    r.bytes       = 0;
+    r.remotePages = -1;
+    r.tlbMisses   = -1;
+    return r;
+}
+
+
+static SceneConfig sceneConfig(Size size, int channels)
+{
+    SceneConfig config;
+    config.size     = size;
+    config.channels = channels;
+    return config;
+}
+
+
+// pages of the model rows [y0, y1) by node
+static vector<size_t> modelPages(const BenchSubtractor& model, Size size, int channels, int y0, int y1)
+{
+    size_t pixels0 = (size_t)y0*size.width;
+    size_t pixels  = (size_t)(y1 - y0)*size.width;
+    size_t modes0  = pixels0*model.mixtures();
+    size_t modes   = pixels*model.mixtures();
+
+    vector<size_t> pages;
+    const void* regions[] = { model.gaussians() + modes0, model.means() + modes0*channels,
+                              model.modeCounters() + modes0, model.modeOrder() + modes0 };
+    size_t bytes[] = { modes*sizeof(GMM), modes*channels*sizeof(float), modes*sizeof(float), modes };
+    for (int i=0; i<4; i++) {
+        vector<size_t> p = NumaTopology::pagesByNode(regions[i], bytes[i]);
+        if (p.empty())
+            return p;
+        pages.resize(std::max(pages.size(), p.size()));
+        for (size_t n=0; n<p.size(); n++)
+            pages[n] += p[n];
+    }
+    return pages;
+}
+
+
+static double remotePageFraction(const BenchSubtractor& model, Size size, int channels,
+                                 const PinnedWorkerPool* pool)
+{
+    size_t total = 0, remote = 0;
+
+    if (pool) {
+        for (int w=0; w<pool->workers(); w++) {
+            Range band = pool->band(w, Range(0, size.height));
+            vector<size_t> pages = modelPages(model, size, channels, band.start, band.end);
+            if (pages.empty())
+                return -1;
+            for (size_t n=0; n<pages.size(); n++) {
+                total += pages[n];
+                if ((int)n != pool->workerNode(w))
+                    remote += pages[n];
+            }
+        }
+        return total ? (double)remote/total : -1;
+    }
+
+    // any row on any CPU: a page on node n is local to the cpus(n)/cpus() share of accesses
+    NumaTopology topology;
+    vector<size_t> pages = modelPages(model, size, channels, 0, size.height);
+    if (pages.empty())
+        return -1;
+    double local = 0;
+    for (size_t n=0; n<pages.size(); n++)
+        total += pages[n];
+    for (int i=0; i<topology.nodes(); i++) {
+        int id = topology.node(i).id;
+        if (id < (int)pages.size())
+            local += (double)pages[id]/total * topology.node(i).cpus.size()/topology.cpus();
+    }
+    return total ? 1 - local : -1;
+}
+
+
+// The "model" kernel runs together with the classify, shadow and background
+// kernels on the same model; model_pinned, model_hugepages and model_coarse
+// run alone, on the pool, with the model buffers from the arena or with
+// block classification.
+static void benchModel(const BenchOptions& opt, Size size, int channels, int mixtures,
+                       int threads, const string& kernel, PinnedWorkerPool* pool,
+                       ModelArena* arena, vector<BenchResult>& results)
+{
+    SyntheticScene scene(sceneConfig(size, channels));
+    BenchSubtractor model(mixtures);
+    model.setWorkerPool(pool);
+    model.setModelArena(arena);
+    model.setCoarseToFine(kernel == "model_coarse");
+    BenchResult update     = makeResult(kernel, size, channels, mixtures, threads);
+    BenchResult classify   = makeResult("classify", size, channels, mixtures, threads);
+    BenchResult shadow     = makeResult("shadow", size, channels, mixtures, threads);
+    BenchResult background = makeResult("background", size, channels, mixtures, threads);
+    TlbMissCounter tlb;
+    double tlbMisses = 0;
+
+    bool doClassify   = kernel == "model" && wants(opt, "classify");
+    bool doShadow     = kernel == "model" && wants(opt, "shadow");
+    bool doBackground = kernel == "model" && wants(opt, "background");
+
+    Mat frame, fgmask, classified, bgimage, shadowed;
+    vector<int> hits(size.height);
+
+    for (int i=0; i<opt.warmup + opt.frames; i++) {
+        bool measure = i >= opt.warmup;
+        scene.read(frame);
+
+        tlb.start();
+        int64 start = getTickCount();
+        model(frame, fgmask);
+        if (measure) {
+            record(update, seconds(start));
+            tlbMisses += tlb.stop();
+        }
+
+        // the same frame again, without framesSkipped bookkeeping of classify()
+        if (measure && doClassify) {
+            start = getTickCount();
+            model(frame, classified, 0);
+            record(classify, seconds(start));
+        }
+
+        if (measure && doShadow) {
+            frame.convertTo(shadowed, CV_32F, 0.7);
+            start = getTickCount();
+            parallel_for_(Range(0, size.height), ShadowInvoker(shadowed, model, hits));
+            record(shadow, seconds(start));
+        }
+
+        if (measure && doBackground) {
+            start = getTickCount();
+            model.getBackgroundImage(bgimage);
+            record(background, seconds(start));
+        }
+    }
+
+    double frameBytes = (double)size.area()*channels;
+    double maskBytes  = (double)size.area();
+    double stateBytes = (double)model.modelBytes();
+
+    update.bytes     = frameBytes + maskBytes + 2*stateBytes;
+    classify.bytes   = frameBytes + maskBytes + stateBytes;
+    shadow.bytes     = 4*frameBytes + stateBytes;
+    background.bytes = stateBytes + frameBytes;
+    update.remotePages = remotePageFraction(model, size, channels, pool);
+    if (tlb.available())
+        update.tlbMisses = tlbMisses;
+
+    if (kernel != "model" || wants(opt, "model"))
+        results.push_back(update);
+    if (doClassify)
+        results.push_back(classify);
+    if (doShadow)
+        results.push_back(shadow);
+    if (doBackground)
+        results.push_back(background);
+}
+
+
+static void benchPreprocessing(const BenchOptions& opt, Size size, int threads,
+                               bool fixedPoint, vector<BenchResult>& results)
+{
+    SyntheticScene scene(sceneConfig(size, 3));
+    BenchResult r = makeResult(fixedPoint ? "mdgkt_fixed" : "mdgkt", size, 3, 0, threads);
+    mdgkt* preProc = mdgkt::Instance();
+    preProc->setFixedPoint(fixedPoint);
+
+    Mat frame, filtered;
+    for (int i=0; i<opt.warmup + opt.frames; i++) {
+        scene.read(frame);
+        if (i == 0)
+            preProc->initializeFirstImage(frame);
+
+        int64 start = getTickCount();
+        preProc->SpatioTemporalPreprocessing(frame, filtered);
+        if (i >= opt.warmup)
+            record(r, seconds(start));
+    }
+    preProc->setFixedPoint(false);
+
+    r.bytes = (double)frame.total()*frame.elemSize() + (double)filtered.total()*filtered.elemSize();
+    results.push_back(r);
+}
+
+
+static void writeJson(ostream& out, const vector<BenchResult>& results)
+{
+    out << "[" << endl;
+    for (size_t i=0; i<results.size(); i++) {
+        const BenchResult& r = results[i];
+        double pixels = (double)r.size.area();
+
+        out << "  { \"kernel\": \"" << r.kernel << "\""
+            << ", \"width\": " << r.size.width
+            << ", \"height\": " << r.size.height
+            << ", \"channels\": " << r.channels
+            << ", \"nmixtures\": " << r.mixtures
+            << ", \"threads\": " << r.threads
+            << ", \"frames\": " << r.frames
+            << ", \"ns_per_pixel\": " << r.seconds*1e9/(r.frames*pixels)
+            << ", \"ns_per_pixel_best\": " << r.bestSeconds*1e9/pixels
+            << ", \"gb_per_s\": " << r.bytes*r.frames/r.seconds*1e-9;
+        if (r.remotePages >= 0)
+            out << ", \"remote_page_fraction\": " << r.remotePages;
+        if (r.tlbMisses >= 0)
+            out << ", \"dtlb_misses_per_pixel\": " << r.tlbMisses/(r.frames*pixels);
+        out << " }" << (i+1 < results.size() ? "," : "") << endl;
+    }
+    out << "]" << endl;
+}
+
+
+int main( int argc, char** argv )
+{
+    BenchOptions opt;
+    if (!parseOptions(argc, argv, opt)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    vector<BenchResult> results;
+
+    for (size_t s=0; s<opt.sizes.size(); s++) {
+        Size size;
+        if (!lookupSize(opt.sizes[s], size)) {
+            cerr << "unknown frame size " << opt.sizes[s] << endl;
+            return 2;
+        }
+
+        for (size_t c=0; c<opt.channels.size(); c++) {
+            int channels = opt.channels[c];
+
+            for (size_t t=0; t<opt.threads.size(); t++) {
+                setNumThreads(opt.threads[t]);
+                cerr << opt.sizes[s] << " " << channels << "ch " << opt.threads[t] << " threads" << endl;
+
+                if (channels == 3 && wants(opt, "mdgkt"))
+                    benchPreprocessing(opt, size, opt.threads[t], false, results);
+                if (channels == 3 && wants(opt, "mdgkt_fixed"))
+                    benchPreprocessing(opt, size, opt.threads[t], true, results);
+
+                if (wants(opt, "model") || wants(opt, "classify") || wants(opt, "shadow") ||
+                    wants(opt, "background"))
+                    for (size_t m=0; m<opt.mixtures.size(); m++)
+                        benchModel(opt, size, channels, opt.mixtures[m], opt.threads[t],
+                                   "model", NULL, NULL, results);
+
+                if (wants(opt, "model_pinned")) {
+                    PinnedWorkerPool pool(opt.threads[t]);
+                    for (size_t m=0; m<opt.mixtures.size(); m++)
+                        benchModel(opt, size, channels, opt.mixtures[m], opt.threads[t],
+                                   "model_pinned", &pool, NULL, results);
+                }
+
+                if (wants(opt, "model_hugepages")) {
+                    ModelArena arena;
+                    for (size_t m=0; m<opt.mixtures.size(); m++)
+                        benchModel(opt, size, channels, opt.mixtures[m], opt.threads[t],
+                                   "model_hugepages", NULL, &arena, results);
+                }
+
+                if (wants(opt, "model_coarse"))
+                    for (size_t m=0; m<opt.mixtures.size(); m++)
+                        benchModel(opt, size, channels, opt.mixtures[m], opt.threads[t],
+                                   "model_coarse", NULL, NULL, results);
+            }
+        }
+    }
+
+    if (opt.output.empty())
+        writeJson(cout, results);
+    else {
+        ofstream out(opt.output.c_str());
+        if (!out) {
+            cerr << "cannot write " << opt.output << endl;
+            return 1;
+        }
+        writeJson(out, results);
+    }
+
+    mdgkt::deleteInstance();
+    return 0;
+}
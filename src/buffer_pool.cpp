@@ -0,0 +1,93 @@
+//
+//  buffer_pool.cpp
+//  sagmm
+//
+
+#include <cstddef>
+#include "buffer_pool.h"
+
+
+BufferPool::BufferPool()
+{
+    stats.allocations   = 0;
+    stats.reuses        = 0;
+    stats.outstanding   = 0;
+    stats.cached        = 0;
+    stats.bytesReserved = 0;
+}
+
+
+BufferPool::~BufferPool()
+{
+    trim();
+}
+
+
+void BufferPool::allocate(int dims, const int* sizes, int type, int*& refcount,
+                          uchar*& datastart, uchar*& data, size_t* step)
+{
+    // dense steps, same as the default allocator
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims-1; i >= 0; i--) {
+        step[i] = total;
+        total *= sizes[i];
+    }
+
+    Block* block = NULL;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        map<size_t, vector<Block*> >::iterator it = freeBlocks.find(total);
+        if (it != freeBlocks.end() && !it->second.empty()) {
+            block = it->second.back();
+            it->second.pop_back();
+            stats.reuses++;
+            stats.cached--;
+        }
+        else {
+            uchar* raw = (uchar*)fastMalloc(sizeof(Block) + total + ALIGNMENT);
+            block = (Block*)raw;
+            block->bytes = total;
+            block->data  = alignPtr(raw + sizeof(Block), ALIGNMENT);
+            stats.allocations++;
+            stats.bytesReserved += total;
+        }
+        stats.outstanding++;
+    }
+
+    block->refcount = 1;
+    refcount  = &block->refcount;
+    datastart = data = block->data;
+}
+
+
+void BufferPool::deallocate(int* refcount, uchar* /*datastart*/, uchar* /*data*/)
+{
+    Block* block = (Block*)((uchar*)refcount - offsetof(Block, refcount));
+
+    std::lock_guard<std::mutex> guard(lock);
+    vector<Block*>& blocks = freeBlocks[block->bytes];
+    blocks.push_back(block);
+    stats.outstanding--;
+    stats.cached++;
+}
+
+
+void BufferPool::trim()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (map<size_t, vector<Block*> >::iterator it = freeBlocks.begin(); it != freeBlocks.end(); ++it) {
+        for (size_t i=0; i<it->second.size(); i++) {
+            stats.bytesReserved -= it->second[i]->bytes;
+            fastFree(it->second[i]);
+        }
+        stats.cached -= it->second.size();
+        it->second.clear();
+    }
+}
+
+
+BufferPool::Statistics BufferPool::statistics() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
@@ -0,0 +1,64 @@
+//
+//  deadline_scheduler.cpp
+//  sagmm
+//
+
+#include "deadline_scheduler.h"
+
+
+// weight of the newest sample in the running cost averages
+static const double costSmoothing = 0.1;
+
+
+DeadlineScheduler::DeadlineScheduler(double _deadline, int _maxSkip)
+: deadline(_deadline), maxSkip(_maxSkip), sinceUpdate(0), updateCost(0), classifyCost(0)
+{
+    stats.updated = stats.classified = stats.dropped = stats.late = 0;
+}
+
+
+DeadlineScheduler::Decision DeadlineScheduler::decide(int64 decodeTick)
+{
+    double slack = deadline - (getTickCount() - decodeTick) / getTickFrequency();
+
+    Decision decision;
+    if (slack >= updateCost || (maxSkip > 0 && sinceUpdate + 1 >= maxSkip))
+        decision = UPDATE;
+    else if (slack >= classifyCost)
+        decision = CLASSIFY;
+    else
+        decision = DROP;
+
+    sinceUpdate = decision == UPDATE ? 0 : sinceUpdate + 1;
+    return decision;
+}
+
+
+void DeadlineScheduler::finished(Decision decision, double seconds, int64 decodeTick)
+{
+    switch (decision) {
+    case UPDATE:
+        updateCost = stats.updated ? updateCost + costSmoothing*(seconds - updateCost) : seconds;
+        stats.updated++;
+        break;
+    case CLASSIFY:
+        classifyCost = stats.classified ? classifyCost + costSmoothing*(seconds - classifyCost) : seconds;
+        stats.classified++;
+        break;
+    case DROP:
+        stats.dropped++;
+        break;
+    }
+
+    if ((getTickCount() - decodeTick) / getTickFrequency() > deadline)
+        stats.late++;
+}
+
+
+void DeadlineScheduler::report(ostream& out) const
+{
+    uint64 frames = stats.updated + stats.classified + stats.dropped;
+    out << "scheduler: deadline " << deadline*1000 << " ms, " << frames << " frames: "
+        << stats.updated << " updated, " << stats.classified << " classified only, "
+        << stats.dropped << " dropped, " << stats.late << " late" << endl;
+}
@@ -0,0 +1,355 @@
+/*******************************************************************************
+ * <Self-Adaptive Gaussian Mixture Model.>
+ * Copyright (C) <2013>  <name of author>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+//
+// Accuracy versus throughput on a synthetic scene with exact ground truth.
+//
+// Runs the (optionally pre-processed) model over a SyntheticScene and scores
+// every mask after the warm-up against the scene's labels:
+//
+//   precision, recall, F-measure   foreground (255) against object pixels;
+//                                  pixels marked shadow count as background
+//   shadow recall                  shadow pixels marked shadow (127)
+//   shadow precision               pixels marked shadow that are shadow
+//
+// next to frames per second of preprocess + model and memory (model state
+// and peak resident set). With -o one JSON object per run is appended to a
+// file, so a series of runs with different settings can be plotted as
+// accuracy against speed.
+//
+// mdgkt's temporal kernel is centred on the previous frame, so with -p the
+// mask of frame t is scored against the labels of frame t-1.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <opencv2/opencv.hpp>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "background_subtraction.h"
+#include "mdgkt_filter.h"
+#include "stage_stats.h"
+#include "synthetic_scene.h"
+
+
+using namespace cv;
+using namespace std;
+
+
+struct EvaluateOptions
+{
+    SceneConfig scene;
+    int    warmup;         // frames not scored while the model learns
+    bool   preprocess;
+    int    fixedPoint;     // 0 float, 8 or 16 bit fixed-point output
+    int    threads;
+    int    history;
+    float  varThreshold;
+    bool   shadows;
+    bool   compact;        // compact mixture storage
+    bool   coarseToFine;   // 8x8 block classification
+    int    updateEvery;    // model update subsampling
+    string label;
+    string output;
+
+    EvaluateOptions()
+    : warmup(100), preprocess(false), fixedPoint(0), threads(-1), history(0),
+      varThreshold(0), shadows(true), compact(false), coarseToFine(false),
+      updateEvery(1)
+    {
+        scene.frames = 500;
+    }
+};
+
+
+struct Confusion
+{
+    uint64 truePositive, falsePositive, falseNegative;
+    uint64 shadowPixels, shadowDetected;     // labelled shadow / of those marked shadow
+    uint64 shadowMarked, shadowCorrect;      // marked shadow / of those labelled shadow
+
+    Confusion()
+    : truePositive(0), falsePositive(0), falseNegative(0),
+      shadowPixels(0), shadowDetected(0), shadowMarked(0), shadowCorrect(0) { }
+
+    void add(const Mat& mask, const Mat& truth)
+    {
+        for (int y=0; y<mask.rows; y++) {
+            const uchar* m = mask.ptr<uchar>(y);
+            const uchar* t = truth.ptr<uchar>(y);
+            for (int x=0; x<mask.cols; x++) {
+                bool foreground = m[x] == SyntheticScene::FOREGROUND;
+                bool object     = t[x] == SyntheticScene::FOREGROUND;
+                truePositive  += foreground && object;
+                falsePositive += foreground && !object;
+                falseNegative += !foreground && object;
+
+                if (t[x] == SyntheticScene::SHADOW) {
+                    shadowPixels++;
+                    shadowDetected += m[x] == SyntheticScene::SHADOW;
+                }
+                if (m[x] == SyntheticScene::SHADOW) {
+                    shadowMarked++;
+                    shadowCorrect += t[x] == SyntheticScene::SHADOW;
+                }
+            }
+        }
+    }
+
+    static double ratio(uint64 a, uint64 b) { return b ? (double)a/b : 0.0; }
+
+    double precision() const { return ratio(truePositive, truePositive + falsePositive); }
+    double recall() const { return ratio(truePositive, truePositive + falseNegative); }
+    double fMeasure() const
+    {
+        double p = precision(), r = recall();
+        return p + r > 0 ? 2*p*r/(p + r) : 0.0;
+    }
+    double shadowRecall() const { return ratio(shadowDetected, shadowPixels); }
+    double shadowPrecision() const { return ratio(shadowCorrect, shadowMarked); }
+};
+
+
+static void usage(const char* prog)
+{
+    cerr << "usage: " << prog << " [options]" << endl
+         << "  scene" << endl
+         << "      --size <w>x<h>              frame size (640x480)" << endl
+         << "      --channels <1|3>            grey or colour frames (3)" << endl
+         << "  -n, --frames <n>                frames to run (500)" << endl
+         << "      --warmup <n>                frames not scored (100)" << endl
+         << "      --shapes <n>                moving objects (4)" << endl
+         << "      --noise <sigma>             sensor noise in grey levels (2)" << endl
+         << "      --illumination-period <n>   frames between illumination steps, 0 none (200)" << endl
+         << "      --illumination-step <g>     relative gain change per step (0.1)" << endl
+         << "      --no-scene-shadows          objects cast no shadows" << endl
+         << "      --seed <n>                  scene random seed" << endl
+         << "  model" << endl
+         << "  -p, --preprocess                spatio-temporal pre-processing (mdgkt)" << endl
+         << "      --fixed-point <8|16>        fixed-point pre-processing with 8 or 16 bit output" << endl
+         << "  -t, --threads <n>               worker threads for the model" << endl
+         << "      --history <n>               model history, learning rate 1/n" << endl
+         << "      --var-threshold <t>         squared Mahalanobis threshold" << endl
+         << "      --no-shadows                disable shadow detection" << endl
+         << "      --compact                   compact mixture storage" << endl
+         << "      --coarse-to-fine            skip the update of 8x8 blocks bound to be background" << endl
+         << "      --update-every <k>          update one pixel in k per frame, classify all (1)" << endl
+         << "  output" << endl
+         << "      --label <text>              name of this run in the JSON record" << endl
+         << "  -o, --output <file>             append a JSON record of the run" << endl;
+}
+
+
+static bool parseOptions(int argc, char** argv, EvaluateOptions& opt)
+{
+    SceneConfig& scene = opt.scene;
+
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i+1 < argc;
+
+        if (arg == "--size" && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &scene.size.width, &scene.size.height) != 2)
+                return false;
+        }
+        else if (arg == "--channels" && hasValue)
+            scene.channels = atoi(argv[++i]);
+        else if ((arg == "-n" || arg == "--frames") && hasValue)
+            scene.frames = atoi(argv[++i]);
+        else if (arg == "--warmup" && hasValue)
+            opt.warmup = atoi(argv[++i]);
+        else if (arg == "--shapes" && hasValue)
+            scene.shapes = atoi(argv[++i]);
+        else if (arg == "--noise" && hasValue)
+            scene.noiseSigma = atof(argv[++i]);
+        else if (arg == "--illumination-period" && hasValue)
+            scene.illuminationPeriod = atoi(argv[++i]);
+        else if (arg == "--illumination-step" && hasValue)
+            scene.illuminationStep = atof(argv[++i]);
+        else if (arg == "--no-scene-shadows")
+            scene.shadows = false;
+        else if (arg == "--seed" && hasValue)
+            scene.seed = (uint64)strtoull(argv[++i], NULL, 0);
+        else if (arg == "-p" || arg == "--preprocess")
+            opt.preprocess = true;
+        else if (arg == "--fixed-point" && hasValue)
+            opt.fixedPoint = atoi(argv[++i]);
+        else if ((arg == "-t" || arg == "--threads") && hasValue)
+            opt.threads = atoi(argv[++i]);
+        else if (arg == "--history" && hasValue)
+            opt.history = atoi(argv[++i]);
+        else if (arg == "--var-threshold" && hasValue)
+            opt.varThreshold = (float)atof(argv[++i]);
+        else if (arg == "--no-shadows")
+            opt.shadows = false;
+        else if (arg == "--compact")
+            opt.compact = true;
+        else if (arg == "--coarse-to-fine")
+            opt.coarseToFine = true;
+        else if (arg == "--update-every" && hasValue)
+            opt.updateEvery = atoi(argv[++i]);
+        else if (arg == "--label" && hasValue)
+            opt.label = argv[++i];
+        else if ((arg == "-o" || arg == "--output") && hasValue)
+            opt.output = argv[++i];
+        else {
+            cerr << "unknown or incomplete option: " << arg << endl;
+            return false;
+        }
+    }
+
+    if (opt.fixedPoint != 0 && opt.fixedPoint != 8 && opt.fixedPoint != 16) {
+        cerr << "--fixed-point takes 8 or 16" << endl;
+        return false;
+    }
+    if (opt.fixedPoint)
+        opt.preprocess = true;
+    if (opt.updateEvery < 1 || opt.updateEvery > 255) {
+        cerr << "--update-every takes 1 to 255" << endl;
+        return false;
+    }
+    if (scene.channels != 1 && scene.channels != 3) {
+        cerr << "--channels takes 1 or 3" << endl;
+        return false;
+    }
+    if (opt.preprocess && scene.channels != 3) {
+        cerr << "pre-processing needs colour frames" << endl;
+        return false;
+    }
+    if (scene.frames <= opt.warmup) {
+        cerr << "--frames must exceed --warmup" << endl;
+        return false;
+    }
+    return scene.size.area() > 0;
+}
+
+
+// peak resident set size in bytes, 0 where /proc is not available
+static size_t peakResidentBytes()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return (size_t)atol(line.c_str() + 6) * 1024;
+    return 0;
+}
+
+
+int main( int argc, char** argv )
+{
+    EvaluateOptions opt;
+    if (!parseOptions(argc, argv, opt)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (opt.threads > 0)
+        setNumThreads(opt.threads);
+
+    SyntheticScene scene(opt.scene);
+    BackgroundSubtractorMOG3 bg_model(opt.history, opt.varThreshold, opt.shadows);
+    bg_model.setCompactModel(opt.compact);
+    bg_model.setCoarseToFine(opt.coarseToFine);
+    bg_model.setUpdateSubsampling(opt.updateEvery);
+
+    mdgkt* preProc = NULL;
+    if (opt.preprocess) {
+        preProc = mdgkt::Instance();
+        if (opt.fixedPoint)
+            preProc->setFixedPoint(true, opt.fixedPoint == 16 ? CV_16U : CV_8U);
+        // 16-bit pre-processed frames are Q8.8
+        if (opt.fixedPoint == 16)
+            bg_model.setFixedPointInput(mdgkt::FIXED_POINT_BITS);
+    }
+
+    StageStats preprocessStats("preprocess");
+    StageStats modelStats("model");
+    Confusion score;
+
+    Mat frame, image, fgmask, previousTruth;
+    for (int frameNo = 0; scene.read(frame); frameNo++)
+    {
+        if (preProc) {
+            preprocessStats.start();
+            if (frameNo == 0)
+                preProc->initializeFirstImage(frame);
+            preProc->SpatioTemporalPreprocessing(frame, image);
+            preprocessStats.stop();
+        }
+        else
+            image = frame;
+
+        modelStats.start();
+        bg_model(image, fgmask);
+        modelStats.stop();
+
+        const Mat& truth = preProc ? previousTruth : scene.groundTruth();
+        if (frameNo >= opt.warmup && !truth.empty())
+            score.add(fgmask, truth);
+        if (preProc)
+            scene.groundTruth().copyTo(previousTruth);
+    }
+
+    double seconds = preprocessStats.total() + modelStats.total();
+    double fps     = seconds > 0 ? modelStats.count() / seconds : 0;
+    size_t modelBytes = bg_model.modelBytes();
+    size_t peakBytes  = peakResidentBytes();
+
+    if (preProc)
+        preprocessStats.report(cout);
+    modelStats.report(cout);
+    printf("precision %.4f  recall %.4f  F-measure %.4f\n", score.precision(), score.recall(), score.fMeasure());
+    printf("shadow recall %.4f  shadow precision %.4f\n", score.shadowRecall(), score.shadowPrecision());
+    printf("%.1f fps  model %.1f MB  peak RSS %.1f MB\n", fps, modelBytes/1048576., peakBytes/1048576.);
+
+    if (!opt.output.empty()) {
+        ofstream out(opt.output.c_str(), ios::app);
+        if (!out) {
+            cerr << "cannot write " << opt.output << endl;
+            return 1;
+        }
+        out << "{ \"label\": \"" << opt.label << "\""
+            << ", \"width\": " << opt.scene.size.width
+            << ", \"height\": " << opt.scene.size.height
+            << ", \"channels\": " << opt.scene.channels
+            << ", \"frames\": " << opt.scene.frames
+            << ", \"warmup\": " << opt.warmup
+            << ", \"preprocess\": " << (opt.preprocess ? "true" : "false")
+            << ", \"fixed_point\": " << opt.fixedPoint
+            << ", \"compact\": " << (opt.compact ? "true" : "false")
+            << ", \"coarse_to_fine\": " << (opt.coarseToFine ? "true" : "false")
+            << ", \"update_every\": " << opt.updateEvery
+            << ", \"threads\": " << (opt.threads > 0 ? opt.threads : getNumThreads())
+            << ", \"precision\": " << score.precision()
+            << ", \"recall\": " << score.recall()
+            << ", \"f_measure\": " << score.fMeasure()
+            << ", \"shadow_recall\": " << score.shadowRecall()
+            << ", \"shadow_precision\": " << score.shadowPrecision()
+            << ", \"fps\": " << fps
+            << ", \"model_bytes\": " << modelBytes
+            << ", \"peak_rss_bytes\": " << peakBytes
+            << " }" << endl;
+    }
+
+    if (preProc)
+        mdgkt::deleteInstance();
+    return 0;
+}
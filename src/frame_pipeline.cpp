@@ -0,0 +1,219 @@
+//
+//  frame_pipeline.cpp
+//  sagmm
+//
+
+#include <thread>
+#include "frame_pipeline.h"
+
+
+FramePipeline::FramePipeline(FrameSource& _source, BackgroundSubtractorMOG3& _model,
+                             mdgkt* _preProc, size_t queueDepth)
+: source(_source), model(_model), preProc(_preProc), bufferPool(NULL), eventLog(NULL),
+  scheduler(NULL),
+  backgroundEvery(0), snapshotBackgrounds(false), foreground(false), realtimeFps(0), maxFrames(0), framesOut(0),
+  decoded(queueDepth), preprocessed(queueDepth), modelled(queueDepth),
+  decodeStats("decode"), preprocessStats("preprocess"), modelStats("model"),
+  backgroundStats("background"), outputStats("output"), latencyStats("latency")
+{
+}
+
+
+void FramePipeline::setBufferPool(BufferPool* pool)
+{
+    bufferPool = pool;
+    model.setBufferPool(pool);
+    if (preProc)
+        preProc->setBufferPool(pool);
+}
+
+
+void FramePipeline::setCounters(ModelCounters* counters)
+{
+    model.setCounters(counters);
+    if (preProc)
+        preProc->setCounters(counters);
+}
+
+
+void FramePipeline::setEventLog(PerfEventLog* events)
+{
+    eventLog = events;
+    model.setEventLog(events);
+    if (preProc)
+        preProc->setEventLog(events);
+}
+
+
+int FramePipeline::run()
+{
+    std::thread decodeThread(&FramePipeline::decodeStage, this);
+    std::thread preprocessThread(&FramePipeline::preprocessStage, this);
+    std::thread outputThread(&FramePipeline::outputStage, this);
+
+    // the model keeps the calling thread, parallel_for_ fans out from here
+    modelStage();
+
+    decodeThread.join();
+    preprocessThread.join();
+    outputThread.join();
+
+    return framesOut;
+}
+
+
+void FramePipeline::decodeStage()
+{
+    int64 startTick = getTickCount();
+
+    for (int frameNo = 0; maxFrames <= 0 || frameNo < maxFrames; frameNo++)
+    {
+        if (realtimeFps > 0) {
+            double due = frameNo / realtimeFps;
+            double now = (getTickCount() - startTick) / getTickFrequency();
+            if (due > now)
+                std::this_thread::sleep_for(std::chrono::microseconds((int64)((due - now)*1e6)));
+        }
+
+        // a fresh packet every frame: the source must not reuse its buffer
+        FramePacket packet;
+        packet.frameNo    = frameNo;
+        packet.decodeTick = getTickCount();
+        packet.frame.allocator = bufferPool;
+
+        decodeStats.start();
+        bool ok;
+        {
+            PerfScope event(eventLog, PERF_DECODE, frameNo);
+            ok = source.read(packet.frame);
+        }
+        decodeStats.stop();
+
+        if (!ok || !decoded.push(packet))
+            break;
+    }
+    decoded.close();
+}
+
+
+void FramePipeline::preprocessStage()
+{
+    FramePacket packet;
+    while (decoded.pop(packet))
+    {
+        if (preProc) {
+            preprocessStats.start();
+            if (packet.frameNo == 0)
+                preProc->initializeFirstImage(packet.frame);
+            preProc->SpatioTemporalPreprocessing(packet.frame, packet.image);
+            preprocessStats.stop();
+        }
+        else
+            packet.image = packet.frame;
+
+        if (!preprocessed.push(packet))
+            break;
+    }
+    preprocessed.close();
+}
+
+
+void runModel(BackgroundSubtractorMOG3& model, DeadlineScheduler::Decision decision, FramePacket& packet,
+              bool foreground)
+{
+    switch (decision) {
+    case DeadlineScheduler::UPDATE:
+        if (foreground)
+            model(packet.image, packet.fgmask, packet.foreground);
+        else
+            model(packet.image, packet.fgmask);
+        break;
+    case DeadlineScheduler::CLASSIFY:
+        if (foreground)
+            model.classify(packet.image, packet.fgmask, packet.foreground);
+        else
+            model.classify(packet.image, packet.fgmask);
+        break;
+    case DeadlineScheduler::DROP:
+        model.skipFrames(1);
+        packet.fgmask.release();
+        packet.foreground.release();
+        break;
+    }
+
+    ZoneOccupancy* zones = model.getZoneOccupancy();
+    if (zones && decision != DeadlineScheduler::DROP)
+        zones->latest(packet.zones);
+    else
+        packet.zones.clear();
+}
+
+
+void FramePipeline::modelStage()
+{
+    FramePacket packet;
+    while (preprocessed.pop(packet))
+    {
+        DeadlineScheduler::Decision decision = scheduler ? scheduler->decide(packet.decodeTick)
+                                                         : DeadlineScheduler::UPDATE;
+        modelStats.start();
+        runModel(model, decision, packet, foreground);
+        modelStats.stop();
+        if (scheduler)
+            scheduler->finished(decision, modelStats.last(), packet.decodeTick);
+
+        if (backgroundEvery > 0 && packet.frameNo % backgroundEvery == 0 &&
+            decision != DeadlineScheduler::DROP) {
+            if (snapshotBackgrounds)
+                packet.snapshot = model.snapshot();     // the output stage computes it
+            else {
+                backgroundStats.start();
+                model.getBackgroundImage(packet.background);
+                backgroundStats.stop();
+            }
+        }
+
+        if (!modelled.push(packet))
+            break;
+    }
+    modelled.close();
+}
+
+
+void FramePipeline::outputStage()
+{
+    FramePacket packet;
+    while (modelled.pop(packet))
+    {
+        if (packet.snapshot) {
+            backgroundStats.start();
+            packet.background.allocator = bufferPool;
+            packet.snapshot->getBackgroundImage(packet.background);
+            packet.snapshot.reset();
+            backgroundStats.stop();
+        }
+
+        if (outputFunc) {
+            outputStats.start();
+            PerfScope event(eventLog, PERF_OUTPUT, packet.frameNo);
+            outputFunc(packet);
+            outputStats.stop();
+        }
+        latencyStats.add((getTickCount() - packet.decodeTick) / getTickFrequency());
+        framesOut++;
+    }
+}
+
+
+void FramePipeline::report(ostream& out) const
+{
+    decodeStats.report(out);
+    if (preProc)
+        preprocessStats.report(out);
+    modelStats.report(out);
+    if (backgroundStats.count())
+        backgroundStats.report(out);
+    if (outputStats.count())
+        outputStats.report(out);
+    latencyStats.report(out);
+}
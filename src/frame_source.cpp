@@ -0,0 +1,20 @@
+//
+//  frame_source.cpp
+//  sagmm
+//
+
+#include "frame_source.h"
+
+
+VideoFileSource::VideoFileSource(const string& fileName)
+: video(fileName), rate(0)
+{
+    if (video.isOpened())
+        rate = video.get(CV_CAP_PROP_FPS);
+}
+
+
+bool VideoFileSource::read(Mat& frame)
+{
+    return video.read(frame) && !frame.empty();
+}
@@ -0,0 +1,150 @@
+//
+//  image_sequence.cpp
+//  sagmm
+//
+
+#include <dirent.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+#include "image_sequence.h"
+
+
+static bool isImageFile(const string& name)
+{
+    static const char* extensions[] = { ".jpg", ".jpeg", ".png", ".bmp", ".ppm", ".pgm", ".tif", ".tiff" };
+
+    size_t dot = name.rfind('.');
+    if (dot == string::npos)
+        return false;
+    string ext = name.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    for (size_t i=0; i<sizeof(extensions)/sizeof(extensions[0]); i++)
+        if (ext == extensions[i])
+            return true;
+    return false;
+}
+
+
+// value of the last group of digits in a file name, -1 if there is none
+static long frameNumber(const string& name)
+{
+    size_t end = name.find_last_of("0123456789");
+    if (end == string::npos)
+        return -1;
+    size_t begin = end;
+    while (begin > 0 && isdigit((unsigned char)name[begin-1]))
+        begin--;
+    return atol(name.substr(begin, end - begin + 1).c_str());
+}
+
+
+static bool byFrameNumber(const string& a, const string& b)
+{
+    long na = frameNumber(a), nb = frameNumber(b);
+    return na != nb ? na < nb : a < b;
+}
+
+
+ImageSequenceSource::ImageSequenceSource(const string& directory, int nworkers, int _window,
+                                         double fps, BufferPool* _pool, int _flags)
+: rate(fps), pool(_pool), flags(_flags), window(std::max(_window, 1)),
+  nextToDecode(0), nextToRead(0), stopping(false)
+{
+    DIR* dir = opendir(directory.c_str());
+    if (!dir)
+        return;
+    for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir))
+        if (isImageFile(entry->d_name))
+            files.push_back(entry->d_name);
+    closedir(dir);
+
+    std::sort(files.begin(), files.end(), byFrameNumber);
+    for (size_t i=0; i<files.size(); i++)
+        files[i] = directory + "/" + files[i];
+
+    slots.resize(window);
+    for (int i=0; i<window; i++)
+        slots[i].frameNo = -1;
+
+    for (int i=0; i<std::max(nworkers, 1) && !files.empty(); i++)
+        workers.push_back(std::thread(&ImageSequenceSource::worker, this));
+}
+
+
+ImageSequenceSource::~ImageSequenceSource()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    consumed.notify_all();
+    for (size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+}
+
+
+void ImageSequenceSource::worker()
+{
+    // encoded file contents, reused for every frame this worker decodes
+    vector<uchar> bytes;
+
+    std::unique_lock<std::mutex> guard(lock);
+    for(;;)
+    {
+        // wait for a frame inside the window
+        while (!stopping && nextToDecode < (int)files.size() && nextToDecode >= nextToRead + window)
+            consumed.wait(guard);
+        if (stopping || nextToDecode >= (int)files.size())
+            break;
+
+        int frameNo = nextToDecode++;
+        guard.unlock();
+
+        Mat image;
+        image.allocator = pool;
+        std::ifstream file(files[frameNo].c_str(), std::ios::binary);
+        if (file) {
+            file.seekg(0, std::ios::end);
+            bytes.resize((size_t)file.tellg());
+            file.seekg(0, std::ios::beg);
+            if (!bytes.empty() && file.read((char*)&bytes[0], bytes.size()))
+                imdecode(bytes, flags, &image);
+        }
+        if (image.empty())
+            LOG4CPLUS_WARN(log4cplus::Logger::getInstance(LOG4CPLUS_TEXT("sagmm.input")),
+                           "cannot decode " << files[frameNo]);
+
+        guard.lock();
+        Slot& slot   = slots[frameNo % window];
+        slot.frameNo = frameNo;
+        slot.image   = image;
+        decoded.notify_all();
+    }
+}
+
+
+bool ImageSequenceSource::read(Mat& frame)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (nextToRead >= (int)files.size())
+        return false;
+
+    Slot& slot = slots[nextToRead % window];
+    while (slot.frameNo != nextToRead)
+        decoded.wait(guard);
+
+    frame = slot.image;
+    slot.image.release();
+    slot.frameNo = -1;
+    nextToRead++;
+    consumed.notify_all();
+
+    // an undecodable frame ends the sequence
+    return !frame.empty();
+}
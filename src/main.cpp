@@ -58,7 +58,7 @@ int main( int argc, char** argv )
         return 1;
     
     BackgroundSubtractorMOG3 bg_model;
-    Mat img, fgmask, fgimg;
+    Mat img, fgmask, fgimg, bgimg;
     bool update_bg_model = true;
 
     
@@ -89,17 +89,9 @@ int main( int argc, char** argv )
         if( img.empty() )
             break;
         
-        if( fgimg.empty() )
-            fgimg.create(img.size(), img.type());
-       
+        // mask and foreground image in one pass over the frame
+        bg_model(img, fgmask, fgimg, update_bg_model ? -1 : 0);
         
-        bg_model(img, fgmask, update_bg_model ? -1 : 0);
-        
-        fgimg = Scalar::all(0);
-        
-        img.copyTo(fgimg, fgmask);
-        
-        Mat bgimg;
         bg_model.getBackgroundImage(bgimg);
         
         imshow("image", img);
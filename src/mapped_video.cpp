@@ -0,0 +1,225 @@
+//
+//  mapped_video.cpp
+//  sagmm
+//
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+#include "mapped_video.h"
+
+// frames the reader asks the kernel to fetch ahead of its position
+static const int readAheadFrames = 4;
+
+
+MappedVideoFile::MappedVideoFile(const string& fileName)
+: base(NULL), length(0), format(Y4M_420), type(CV_8UC3), rate(0),
+  firstFrame(0), frameHeader(0), frameBytes(0), count(0)
+{
+    if (map(fileName) && !parseY4MHeader()) {
+        LOG4CPLUS_WARN(log4cplus::Logger::getInstance(LOG4CPLUS_TEXT("sagmm.input")),
+                       "not a supported YUV4MPEG2 file: " << fileName);
+        unmap();
+    }
+}
+
+
+MappedVideoFile::MappedVideoFile(const string& fileName, Size _size, int _type, double fps)
+: base(NULL), length(0), format(RAW), size(_size), type(_type), rate(fps),
+  firstFrame(0), frameHeader(0), frameBytes(0), count(0)
+{
+    CV_Assert( type == CV_8UC3 || type == CV_8UC1 );
+    CV_Assert( size.width > 0 && size.height > 0 );
+
+    if (map(fileName)) {
+        frameBytes = (size_t)size.width*size.height*CV_MAT_CN(type);
+        count = (int)(length / frameBytes);
+    }
+}
+
+
+MappedVideoFile::~MappedVideoFile()
+{
+    unmap();
+}
+
+
+bool MappedVideoFile::map(const string& fileName)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        length = (size_t)st.st_size;
+        // private and writable: stray writes into a frame copy the page
+        // instead of faulting, the file itself is never modified
+        void* p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            base = (uchar*)p;
+            madvise(base, length, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd);
+
+    return base != NULL;
+}
+
+
+void MappedVideoFile::unmap()
+{
+    if (base)
+        munmap(base, length);
+    base   = NULL;
+    length = 0;
+    count  = 0;
+}
+
+
+// YUV4MPEG2 W<w> H<h> F<n>:<d> I<i> A<a> C<c> X<x>\n
+bool MappedVideoFile::parseY4MHeader()
+{
+    static const char magic[] = "YUV4MPEG2 ";
+    if (length < sizeof(magic) || memcmp(base, magic, sizeof(magic)-1) != 0)
+        return false;
+
+    const uchar* eol = (const uchar*)memchr(base, '\n', length);
+    if (!eol)
+        return false;
+
+    string colorspace = "420jpeg";
+    istringstream header(string((const char*)base + sizeof(magic)-1, (const char*)eol));
+    string token;
+    while (header >> token) {
+        const char* v = token.c_str() + 1;
+        switch (token[0]) {
+            case 'W': size.width  = atoi(v); break;
+            case 'H': size.height = atoi(v); break;
+            case 'F': {
+                int num = 0, den = 0;
+                if (sscanf(v, "%d:%d", &num, &den) == 2 && den > 0)
+                    rate = (double)num / den;
+                break;
+            }
+            case 'C': colorspace = v; break;
+            default: break;
+        }
+    }
+    if (size.width <= 0 || size.height <= 0)
+        return false;
+
+    size_t area = (size_t)size.width*size.height;
+    size_t chroma = (size_t)((size.width+1)/2)*((size.height+1)/2);
+    if (colorspace == "mono") {
+        format = Y4M_MONO; type = CV_8UC1; frameBytes = area;
+    }
+    else if (colorspace.compare(0, 3, "420") == 0 &&
+             !(colorspace.compare(0, 4, "420p") == 0 && colorspace.size() > 4 && isdigit((uchar)colorspace[4]))) {
+        // 420, 420jpeg, 420paldv, 420mpeg2; 420p10, 420p12 etc. are not 8 bit
+        format = Y4M_420; type = CV_8UC3; frameBytes = area + 2*chroma;
+        // the 4:2:0 converter wants even dimensions
+        if (size.width % 2 || size.height % 2)
+            return false;
+    }
+    else if (colorspace == "444") {
+        format = Y4M_444; type = CV_8UC3; frameBytes = 3*area;
+    }
+    else
+        return false;
+
+    // Frame headers are "FRAME" plus optional parameters. Files written
+    // with bare "FRAME\n" headers (the usual case) get a fixed stride;
+    // every frame() call checks the header it lands on.
+    firstFrame = eol + 1 - base;
+    static const char frameTag[] = "FRAME\n";
+    if (firstFrame + sizeof(frameTag)-1 > length || memcmp(base + firstFrame, frameTag, sizeof(frameTag)-1) != 0)
+        return false;
+    frameHeader = sizeof(frameTag)-1;
+    count = (int)((length - firstFrame) / (frameHeader + frameBytes));
+
+    return true;
+}
+
+
+bool MappedVideoFile::frame(int index, Mat& dst) const
+{
+    if (!base || index < 0 || index >= count)
+        return false;
+
+    uchar* p = base + firstFrame + (size_t)index*(frameHeader + frameBytes);
+    if (frameHeader && memcmp(p, "FRAME\n", frameHeader) != 0) {
+        LOG4CPLUS_WARN(log4cplus::Logger::getInstance(LOG4CPLUS_TEXT("sagmm.input")),
+                       "unexpected Y4M frame header at frame " << index);
+        return false;
+    }
+    p += frameHeader;
+
+    switch (format) {
+        case RAW:
+        case Y4M_MONO:
+            dst = Mat(size, type, p);
+            break;
+
+        case Y4M_420:
+            cvtColor(Mat(size.height*3/2, size.width, CV_8UC1, p), dst, CV_YUV2BGR_I420);
+            break;
+
+        case Y4M_444: {
+            // planes are Y, Cb, Cr
+            size_t area = (size_t)size.width*size.height;
+            vector<Mat> planes(3);
+            planes[0] = Mat(size, CV_8UC1, p);
+            planes[1] = Mat(size, CV_8UC1, p + 2*area);
+            planes[2] = Mat(size, CV_8UC1, p + area);
+            Mat ycrcb;
+            merge(planes, ycrcb);
+            cvtColor(ycrcb, dst, CV_YCrCb2BGR);
+            break;
+        }
+    }
+    return true;
+}
+
+
+void MappedVideoFile::prefetch(int first, int n) const
+{
+    if (!base || first >= count)
+        return;
+    n = std::min(n, count - first);
+
+    // madvise wants a page aligned start
+    size_t page  = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = firstFrame + (size_t)first*(frameHeader + frameBytes);
+    size_t end   = begin + (size_t)n*(frameHeader + frameBytes);
+    begin -= begin % page;
+    madvise(base + begin, end - begin, MADV_WILLNEED);
+}
+
+
+MappedVideoSource::MappedVideoSource(const Ptr<MappedVideoFile>& _file, int firstFrame)
+: file(_file), position(firstFrame)
+{
+}
+
+
+bool MappedVideoSource::read(Mat& frame)
+{
+    if (!file->frame(position, frame))
+        return false;
+    position++;
+    file->prefetch(position, readAheadFrames);
+    return true;
+}
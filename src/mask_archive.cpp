@@ -0,0 +1,459 @@
+//
+//  mask_archive.cpp
+//  sagmm
+//
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include <opencv2/highgui/highgui.hpp>
+#include "mask_archive.h"
+
+static const char   fileMagic[]   = "SGMASK01";
+static const char   chunkMagic[]  = "CHNK";
+static const char   footerMagic[] = "SGMAIDX1";
+static const size_t chunkHeaderBytes  = 4 + 4 + 8;
+static const size_t recordHeaderBytes = 4 + 1 + 1 + 4 + 4 + 4 + 4;
+static const size_t footerBytes       = 8 + 8;
+
+
+//////
+// little endian serialization helpers
+
+static void putBytes(vector<uchar>& out, const void* p, size_t n)
+{
+    out.insert(out.end(), (const uchar*)p, (const uchar*)p + n);
+}
+
+static void putU32(vector<uchar>& out, unsigned v)
+{
+    for (int i=0; i<4; i++)
+        out.push_back((uchar)(v >> 8*i));
+}
+
+static void putU64(vector<uchar>& out, uint64 v)
+{
+    for (int i=0; i<8; i++)
+        out.push_back((uchar)(v >> 8*i));
+}
+
+static unsigned getU32(const uchar* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static uint64 getU64(const uchar* p)
+{
+    return (uint64)getU32(p) | ((uint64)getU32(p + 4) << 32);
+}
+
+
+//////
+// mask run-length coding: value byte followed by a varint run length
+
+static void putVarint(vector<uchar>& out, size_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((uchar)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uchar)v);
+}
+
+static void encodeRLE(const Mat& mask, vector<uchar>& out)
+{
+    out.clear();
+    uchar value = mask.ptr<uchar>(0)[0];
+    size_t run = 0;
+    for (int y=0; y<mask.rows; y++) {
+        const uchar* m = mask.ptr<uchar>(y);
+        for (int x=0; x<mask.cols; x++) {
+            if (m[x] == value)
+                run++;
+            else {
+                out.push_back(value);
+                putVarint(out, run);
+                value = m[x];
+                run = 1;
+            }
+        }
+    }
+    out.push_back(value);
+    putVarint(out, run);
+}
+
+static bool decodeRLE(const uchar* p, size_t n, Mat& mask)
+{
+    uchar* dst = mask.ptr<uchar>(0);
+    size_t total = mask.total(), filled = 0;
+    const uchar* end = p + n;
+
+    while (p < end && filled < total) {
+        uchar value = *p++;
+        size_t run = 0;
+        for (int shift = 0; p < end; shift += 7) {
+            uchar b = *p++;
+            run |= (size_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                break;
+        }
+        if (run > total - filled)
+            return false;
+        memset(dst + filled, value, run);
+        filled += run;
+    }
+    return filled == total;
+}
+
+
+MaskArchiveWriter::MaskArchiveWriter(const string& fileName, size_t queueDepth,
+                                     DropPolicy _policy, int _chunkRecords)
+: file(NULL), policy(_policy), chunkRecords(std::max(_chunkRecords, 1)),
+  queue(queueDepth), chunkCount(0), chunkMasks(0), chunkBytesIn(0), offset(0),
+  masksWritten(0), backgroundsWritten(0), masksDropped(0), backgroundsDropped(0),
+  failures(0), failed(false), bytesIn(0), bytesOut(0)
+{
+    file = fopen(fileName.c_str(), "wb");
+    if (!file)
+        return;
+
+    if (fwrite(fileMagic, 1, 8, file) != 8) {
+        fclose(file);
+        file = NULL;
+        return;
+    }
+    offset = 8;
+    chunk.reserve(1 << 20);
+    thread = std::thread(&MaskArchiveWriter::writer, this);
+}
+
+
+MaskArchiveWriter::~MaskArchiveWriter()
+{
+    close();
+}
+
+
+bool MaskArchiveWriter::writeMask(int frameNo, const Mat& mask)
+{
+    CV_Assert( mask.type() == CV_8UC1 );
+    if (enqueue(frameNo, ARCHIVE_MASK, mask))
+        return true;
+    masksDropped++;
+    return false;
+}
+
+
+bool MaskArchiveWriter::writeBackground(int frameNo, const Mat& background)
+{
+    if (enqueue(frameNo, ARCHIVE_BACKGROUND, background))
+        return true;
+    backgroundsDropped++;
+    return false;
+}
+
+
+bool MaskArchiveWriter::enqueue(int frameNo, int kind, const Mat& image)
+{
+    if (!file || image.empty() || failed)
+        return false;
+
+    // leave the second half of the queue to masks
+    if (policy == DROP_BACKGROUNDS_FIRST && kind == ARCHIVE_BACKGROUND &&
+        queue.size() >= queue.capacity()/2)
+        return false;
+
+    Item item;
+    item.frameNo = frameNo;
+    item.kind    = kind;
+    item.image   = image;
+    return queue.tryPush(item);
+}
+
+
+void MaskArchiveWriter::writer()
+{
+    Item item;
+    vector<int> pngParams;
+    pngParams.push_back(CV_IMWRITE_PNG_COMPRESSION);
+    pngParams.push_back(3);
+
+    while (queue.pop(item))
+    {
+        // the archive stopped at a failed chunk, what is still queued is lost
+        if (failed) {
+            if (item.kind == ARCHIVE_MASK)
+                masksDropped++;
+            else
+                backgroundsDropped++;
+            item.image.release();
+            continue;
+        }
+
+        int codec;
+        if (item.kind == ARCHIVE_MASK) {
+            codec = ARCHIVE_RLE;
+            encodeRLE(item.image, payload);
+        }
+        else {
+            codec = ARCHIVE_PNG;
+            imencode(".png", item.image, payload, pngParams);
+        }
+
+        if (chunkCount == 0) {
+            chunk.clear();
+            chunk.resize(chunkHeaderBytes);
+        }
+
+        // offset of the record inside the file
+        index.push_back(make_pair(make_pair(item.frameNo, item.kind), offset + chunk.size()));
+
+        putU32(chunk, (unsigned)item.frameNo);
+        chunk.push_back((uchar)item.kind);
+        chunk.push_back((uchar)codec);
+        putU32(chunk, (unsigned)item.image.rows);
+        putU32(chunk, (unsigned)item.image.cols);
+        putU32(chunk, (unsigned)item.image.type());
+        putU32(chunk, (unsigned)payload.size());
+        if (!payload.empty())
+            putBytes(chunk, &payload[0], payload.size());
+
+        chunkBytesIn += item.image.total()*item.image.elemSize();
+        if (item.kind == ARCHIVE_MASK)
+            chunkMasks++;
+
+        item.image.release();
+        if (++chunkCount == chunkRecords)
+            flushChunk();
+    }
+    flushChunk();
+}
+
+
+void MaskArchiveWriter::flushChunk()
+{
+    if (chunkCount == 0)
+        return;
+
+    uchar* h = &chunk[0];
+    memcpy(h, chunkMagic, 4);
+    uint64 bytes = chunk.size() - chunkHeaderBytes;
+    for (int i=0; i<4; i++)
+        h[4+i] = (uchar)(chunkCount >> 8*i);
+    for (int i=0; i<8; i++)
+        h[8+i] = (uchar)(bytes >> 8*i);
+
+    // flushed with the chunk, so a full disk shows here and not at close()
+    bool ok = fwrite(&chunk[0], 1, chunk.size(), file) == chunk.size() && fflush(file) == 0;
+    size_t backgrounds = chunkCount - chunkMasks;
+    if (ok) {
+        offset   += chunk.size();
+        bytesOut += chunk.size();
+        bytesIn  += chunkBytesIn;
+        masksWritten       += chunkMasks;
+        backgroundsWritten += backgrounds;
+    }
+    else {
+        // the chunk's records never made it, nor will anything after them
+        index.resize(index.size() - chunkCount);
+        masksDropped       += chunkMasks;
+        backgroundsDropped += backgrounds;
+        failures++;
+        failed = true;
+    }
+    chunkCount   = 0;
+    chunkMasks   = 0;
+    chunkBytesIn = 0;
+}
+
+
+void MaskArchiveWriter::close()
+{
+    if (!file)
+        return;
+
+    queue.close();
+    if (thread.joinable())
+        thread.join();
+
+    // without an index the reader scans the chunks, up to the failed one
+    if (failed) {
+        fclose(file);
+        file = NULL;
+        return;
+    }
+
+    vector<uchar> tail;
+    putU32(tail, (unsigned)index.size());
+    for (size_t i=0; i<index.size(); i++) {
+        putU32(tail, (unsigned)index[i].first.first);
+        tail.push_back((uchar)index[i].first.second);
+        putU64(tail, index[i].second);
+    }
+    putU64(tail, offset);
+    putBytes(tail, footerMagic, 8);
+    bool ok = fwrite(&tail[0], 1, tail.size(), file) == tail.size();
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+    if (ok)
+        bytesOut += tail.size();
+    else {
+        failures++;
+        failed = true;
+    }
+}
+
+
+MaskArchiveWriter::Statistics MaskArchiveWriter::statistics() const
+{
+    Statistics s;
+    s.masksWritten       = masksWritten;
+    s.backgroundsWritten = backgroundsWritten;
+    s.masksDropped       = masksDropped;
+    s.backgroundsDropped = backgroundsDropped;
+    s.failures           = failures;
+    s.bytesIn            = bytesIn;
+    s.bytesOut           = bytesOut;
+    return s;
+}
+
+
+MaskArchiveReader::MaskArchiveReader(const string& fileName)
+: file(NULL)
+{
+    file = fopen(fileName.c_str(), "rb");
+    if (!file)
+        return;
+
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, fileMagic, 8) != 0) {
+        fclose(file);
+        file = NULL;
+        return;
+    }
+
+    if (!loadIndex())
+        scanChunks();
+}
+
+
+MaskArchiveReader::~MaskArchiveReader()
+{
+    if (file)
+        fclose(file);
+}
+
+
+bool MaskArchiveReader::loadIndex()
+{
+    uchar footer[footerBytes];
+    if (fseeko(file, -(off_t)footerBytes, SEEK_END) != 0 ||
+        fread(footer, 1, footerBytes, file) != footerBytes ||
+        memcmp(footer + 8, footerMagic, 8) != 0)
+        return false;
+
+    uint64 indexOffset = getU64(footer);
+    uchar count[4];
+    if (fseeko(file, (off_t)indexOffset, SEEK_SET) != 0 || fread(count, 1, 4, file) != 4)
+        return false;
+
+    unsigned n = getU32(count);
+    vector<uchar> entries((size_t)n*13);
+    if (n && fread(&entries[0], 1, entries.size(), file) != entries.size())
+        return false;
+
+    for (unsigned i=0; i<n; i++) {
+        const uchar* e = &entries[(size_t)i*13];
+        index[make_pair((int)getU32(e), (int)e[4])] = getU64(e + 5);
+    }
+    return true;
+}
+
+
+// archive without footer: walk the chunks that made it to disk
+void MaskArchiveReader::scanChunks()
+{
+    uint64 pos = 8;
+    uchar header[chunkHeaderBytes];
+    uchar record[recordHeaderBytes];
+
+    if (fseeko(file, 0, SEEK_END) != 0)
+        return;
+    uint64 fileBytes = (uint64)ftello(file);
+
+    while (fseeko(file, (off_t)pos, SEEK_SET) == 0 &&
+           fread(header, 1, chunkHeaderBytes, file) == chunkHeaderBytes &&
+           memcmp(header, chunkMagic, 4) == 0)
+    {
+        unsigned records = getU32(header + 4);
+        uint64 bytes     = getU64(header + 8);
+        uint64 r         = pos + chunkHeaderBytes;
+        // a chunk cut short (writer killed, failed write) is left out whole
+        if (bytes > fileBytes - r)
+            return;
+
+        for (unsigned i=0; i<records; i++) {
+            if (fseeko(file, (off_t)r, SEEK_SET) != 0 ||
+                fread(record, 1, recordHeaderBytes, file) != recordHeaderBytes)
+                return;
+            index[make_pair((int)getU32(record), (int)record[4])] = r;
+            r += recordHeaderBytes + getU32(record + 18);
+        }
+        pos += chunkHeaderBytes + bytes;
+    }
+}
+
+
+vector<int> MaskArchiveReader::frames(int kind) const
+{
+    vector<int> result;
+    for (map<pair<int,int>, uint64>::const_iterator it = index.begin(); it != index.end(); ++it)
+        if (it->first.second == kind)
+            result.push_back(it->first.first);
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+
+bool MaskArchiveReader::readMask(int frameNo, Mat& mask)
+{
+    return read(frameNo, ARCHIVE_MASK, mask);
+}
+
+
+bool MaskArchiveReader::readBackground(int frameNo, Mat& background)
+{
+    return read(frameNo, ARCHIVE_BACKGROUND, background);
+}
+
+
+bool MaskArchiveReader::read(int frameNo, int kind, Mat& image)
+{
+    map<pair<int,int>, uint64>::const_iterator it = index.find(make_pair(frameNo, kind));
+    if (!file || it == index.end())
+        return false;
+
+    uchar record[recordHeaderBytes];
+    if (fseeko(file, (off_t)it->second, SEEK_SET) != 0 ||
+        fread(record, 1, recordHeaderBytes, file) != recordHeaderBytes)
+        return false;
+
+    int codec = record[5];
+    int rows  = (int)getU32(record + 6);
+    int cols  = (int)getU32(record + 10);
+    int type  = (int)getU32(record + 14);
+    payload.resize(getU32(record + 18));
+    if (!payload.empty() && fread(&payload[0], 1, payload.size(), file) != payload.size())
+        return false;
+
+    if (codec == ARCHIVE_RLE) {
+        image.create(rows, cols, type);
+        return decodeRLE(payload.empty() ? NULL : &payload[0], payload.size(), image);
+    }
+    if (codec == ARCHIVE_PNG) {
+        imdecode(payload, CV_LOAD_IMAGE_UNCHANGED, &image);
+        return !image.empty();
+    }
+    return false;
+}
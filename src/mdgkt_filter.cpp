@@ -7,32 +7,70 @@
 //
 
 #include <iostream>
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
 #include "mdgkt_filter.h"
 
 const float mdgkt::SIGMA = 0.5;
 const int mdgkt::SPATIO_WINDOW = 3;
 const int mdgkt::TIME_WINDOW = 3;
+const int mdgkt::FIXED_POINT_BITS = 8;
 
 mdgkt* mdgkt::ptrInstance = NULL;
 int mdgkt::numInstances = 0;
 
 
+// Quantizes a normalized kernel to Q8 taps. The centre tap absorbs the
+// rounding so the taps always sum to exactly 1 << FIXED_POINT_BITS.
+static vector<int> quantizeKernel(const Mat& kernel, int bits)
+{
+    vector<int> taps(kernel.rows);
+    const float* k = kernel.ptr<float>(0);
+    int one = 1 << bits, sum = 0;
+    for (int i=0; i<kernel.rows; i++) {
+        taps[i] = cvRound(k[i]*one);
+        sum += taps[i];
+    }
+    taps[kernel.rows/2] += one - sum;
+    return taps;
+}
+
+
 // Internal method to initialize to zero all vectors
 void mdgkt::initialize() 
 {
     // Matrix with gaussian values for processing temporal frames.
     temporalGaussFilter = getGaussianKernel(TIME_WINDOW,SIGMA,CV_32F);
+    spatialGaussFilter  = getGaussianKernel(SPATIO_WINDOW,SIGMA,CV_32F);
+
+    // Same kernels in fixed point. With SIGMA=0.5 both are {27,202,27}/256.
+    spatialTapsQ  = quantizeKernel(getGaussianKernel(3,SIGMA,CV_32F), FIXED_POINT_BITS);
+    temporalTapsQ = quantizeKernel(temporalGaussFilter, FIXED_POINT_BITS);
+}
+
+
+void mdgkt::setFixedPoint(bool enable, int depth)
+{
+    CV_Assert( depth == CV_8U || depth == CV_16U );
+    fixedPoint      = enable;
+    fixedPointDepth = depth;
 }
 
 
 void mdgkt::initializeFirstImage(const Mat& img)
 {
     this->initialize();
-    //Initialize vectors
+    //Initialize vectors, dropping the history of a previous sequence
+    kernelImageR.clear();
+    kernelImageG.clear();
+    kernelImageB.clear();
+    kernelImageQ.clear();
+    framesFiltered = 0;
     for (int i=0; i<SPATIO_WINDOW; i++) {
         kernelImageR.push_back(Mat::zeros(img.size(), CV_32FC1));
         kernelImageG.push_back(Mat::zeros(img.size(), CV_32FC1));
         kernelImageB.push_back(Mat::zeros(img.size(), CV_32FC1));
+        kernelImageQ.push_back(Mat::zeros(img.size(), CV_16UC3));
     }
     
     has_been_initialized = true;
@@ -48,58 +86,230 @@ void mdgkt::initializeFirstImage(const vector<Mat> & sequences)
     
 }
 
-void mdgkt::SpatioTemporalPreprocessing(const Mat& src, Mat& dst)
+// GaussianBlur(src, dst, Size(3,3), SIGMA) of a CV_32F plane with the
+// taps k, BORDER_REFLECT_101 as there, without the filter engine
+// GaussianBlur builds (and allocates) on every call.
+static void gaussianBlur3x3(const Mat& src, Mat& dst, const float* k, Mat& horizontal)
 {
-    vector<Mat> nchannels;
-    vector<Mat> brg;
-    vector<Mat> temporal_average;
+    const int rows = src.rows;
+    const int cols = src.cols;
+    horizontal.create(src.size(), CV_32F);
+    dst.create(src.size(), CV_32F);
 
-    for (int i=0; i<TIME_WINDOW; i++) {
-        temporal_average.push_back(Mat::zeros(src.size(), CV_32FC1));        
+    for (int y=0; y<rows; y++) {
+        const float* s = src.ptr<float>(y);
+        float* h = horizontal.ptr<float>(y);
+        for (int x=0; x<cols; x++) {
+            int xl = x > 0 ? x-1 : (cols > 1 ? 1 : 0);
+            int xr = x < cols-1 ? x+1 : (cols > 1 ? cols-2 : 0);
+            h[x] = k[0]*s[xl] + k[1]*s[x] + k[2]*s[xr];
+        }
     }
 
-    
-    Mat E;
-    src.convertTo(E, CV_32FC3);
-    split(E,nchannels);
-    
-    
-    brg.push_back( Mat(src.size(), CV_32FC1));
-    brg.push_back( Mat(src.size(), CV_32FC1));
-    brg.push_back( Mat(src.size(), CV_32FC1));
-    
+    for (int y=0; y<rows; y++) {
+        const float* hu = horizontal.ptr<float>(y > 0 ? y-1 : (rows > 1 ? 1 : 0));
+        const float* hc = horizontal.ptr<float>(y);
+        const float* hd = horizontal.ptr<float>(y < rows-1 ? y+1 : (rows > 1 ? rows-2 : 0));
+        float* d = dst.ptr<float>(y);
+        for (int x=0; x<cols; x++)
+            d[x] = k[0]*hu[x] + k[1]*hc[x] + k[2]*hd[x];
+    }
+}
+
+
+// split() and merge() of a CV_32FC3 image into and out of reused planes;
+// cv::split/merge (re)create their outputs through the array wrappers,
+// these only ever create() Mats of the same size.
+static void splitPlanes(const Mat& src, vector<Mat>& planes)
+{
+    planes.resize(3);
+    for (int c=0; c<3; c++)
+        planes[c].create(src.size(), CV_32F);
+
+    for (int y=0; y<src.rows; y++) {
+        const float* s = src.ptr<float>(y);
+        float* p0 = planes[0].ptr<float>(y);
+        float* p1 = planes[1].ptr<float>(y);
+        float* p2 = planes[2].ptr<float>(y);
+        for (int x=0; x<src.cols; x++, s+=3) {
+            p0[x] = s[0];
+            p1[x] = s[1];
+            p2[x] = s[2];
+        }
+    }
+}
+
+static void mergePlanes(const vector<Mat>& planes, Mat& dst)
+{
+    dst.create(planes[0].size(), CV_32FC3);
+
+    for (int y=0; y<dst.rows; y++) {
+        const float* p0 = planes[0].ptr<float>(y);
+        const float* p1 = planes[1].ptr<float>(y);
+        const float* p2 = planes[2].ptr<float>(y);
+        float* d = dst.ptr<float>(y);
+        for (int x=0; x<dst.cols; x++, d+=3) {
+            d[0] = p0[x];
+            d[1] = p1[x];
+            d[2] = p2[x];
+        }
+    }
+}
+
+
+// Detaches the oldest plane of a history so its buffer can take the
+// next frame. Returns an empty Mat while the history is still short.
+static Mat recycleOldest(vector<Mat>& history, size_t length)
+{
+    Mat plane;
+    if (history.size() >= length) {
+        plane = history.front();
+        history.erase(history.begin());
+    }
+    return plane;
+}
+
+
+void mdgkt::SpatioTemporalPreprocessing(const Mat& src, Mat& dst)
+{
+    if (outputAllocator && dst.empty())
+        dst.allocator = outputAllocator;
+
+    int64 start = counters ? getTickCount() : 0;
+    PerfScope event(eventLog, PERF_PREPROCESS, framesFiltered++);
+    if (fixedPoint)
+        FixedPointPreprocessing(src, dst);
+    else
+        SpatioTemporalFiltering(src, dst);
+
+    if (counters)
+        counters->addStageTime(ModelCounters::PREPROCESS, (getTickCount() - start) / getTickFrequency());
+}
+
+
+// float reference implementation
+void mdgkt::SpatioTemporalFiltering(const Mat& src, Mat& dst)
+{
+    // splitPlanes() reads three floats per pixel
+    CV_Assert( src.type() == CV_8UC3 );
+    src.convertTo(floatImage, CV_32FC3);
+    splitPlanes(floatImage, floatChannels);
+
+    Mat planeR = recycleOldest(kernelImageR, SPATIO_WINDOW);
+    Mat planeG = recycleOldest(kernelImageG, SPATIO_WINDOW);
+    Mat planeB = recycleOldest(kernelImageB, SPATIO_WINDOW);
+
     //Spatial pre-processing
-    GaussianBlur(nchannels.at(2), brg.at(2), Size(3,3), 0.5);
-    GaussianBlur(nchannels.at(1), brg.at(1), Size(3,3), 0.5);
-    GaussianBlur(nchannels.at(0), brg.at(0), Size(3,3), 0.5);
+    const float* kptr = spatialGaussFilter.ptr<float>(0);
+    gaussianBlur3x3(floatChannels.at(2), planeR, kptr, horizontalF);
+    gaussianBlur3x3(floatChannels.at(1), planeG, kptr, horizontalF);
+    gaussianBlur3x3(floatChannels.at(0), planeB, kptr, horizontalF);
 
-    
-    kernelImageR.push_back(brg.at(2));
-    kernelImageG.push_back(brg.at(1));
-    kernelImageB.push_back(brg.at(0));
-    
-    if (kernelImageB.size() > SPATIO_WINDOW )
-        kernelImageB.erase(kernelImageB.begin());
-    if (kernelImageR.size() > SPATIO_WINDOW )
-        kernelImageR.erase(kernelImageR.begin());
-    if (kernelImageG.size() > SPATIO_WINDOW )
-        kernelImageG.erase(kernelImageG.begin());
+    kernelImageR.push_back(planeR);
+    kernelImageG.push_back(planeG);
+    kernelImageB.push_back(planeB);
     
     //Temporal pre-processing
     const float* fptr=temporalGaussFilter.ptr<float>(0);
 
-    
-    for (int i=0; i<TIME_WINDOW; i++) {
-        temporal_average.at(0)+= kernelImageR.at(i)*fptr[i];
-        temporal_average.at(1)+= kernelImageG.at(i)*fptr[i];
-        temporal_average.at(2)+= kernelImageB.at(i)*fptr[i];
+    // keep the channel order of the input frame (BGR)
+    temporalAverage.resize(3);
+    kernelImageB.at(0).convertTo(temporalAverage[0], CV_32F, fptr[0]);
+    kernelImageG.at(0).convertTo(temporalAverage[1], CV_32F, fptr[0]);
+    kernelImageR.at(0).convertTo(temporalAverage[2], CV_32F, fptr[0]);
+    for (int i=1; i<TIME_WINDOW; i++) {
+        scaleAdd(kernelImageB.at(i), fptr[i], temporalAverage[0], temporalAverage[0]);
+        scaleAdd(kernelImageG.at(i), fptr[i], temporalAverage[1], temporalAverage[1]);
+        scaleAdd(kernelImageR.at(i), fptr[i], temporalAverage[2], temporalAverage[2]);
     }
   
-    merge(temporal_average,dst);
+    mergePlanes(temporalAverage, dst);
     
 
 }
 
+
+/*
+ * 16-bit fixed-point version of SpatioTemporalPreprocessing.
+ *
+ * Every value in the history is Q8.8 (grey level * 256), so one plane fits
+ * in a CV_16UC3 and the horizontal pass is pure 16-bit arithmetic:
+ * 255 * (27+202+27) = 65280. Vertical and temporal passes accumulate in
+ * 32 bits and round back to Q8.8 (or to 8 bits for CV_8U output).
+ *
+ * Error against the float path: both kernels sum to one, so the tap
+ * quantization error is sum(dw*x) with sum(dw)=0, bounded by
+ * 255*sum(max(dw,0)) over the full 3x3x3 kernel = 0.99 grey levels. Each
+ * of the two roundings adds at most 0.5/256. The CV_16U output is thus
+ * within 1.0 grey level of the reference and CV_8U within 1.5; on smooth
+ * image regions the error is proportional to local contrast and near zero.
+ */
+void mdgkt::FixedPointPreprocessing(const Mat& src, Mat& dst)
+{
+    CV_Assert( src.type() == CV_8UC3 );
+    CV_Assert( (int)kernelImageQ.size() == TIME_WINDOW );
+
+    const int rows  = src.rows;
+    const int cols  = src.cols;
+    const int cn    = 3;
+    const int half  = 1 << (FIXED_POINT_BITS - 1);
+    const int k0    = spatialTapsQ[0], k1 = spatialTapsQ[1], k2 = spatialTapsQ[2];
+
+    // Recycle the oldest plane for the incoming frame.
+    Mat plane = recycleOldest(kernelImageQ, TIME_WINDOW);
+    plane.create(src.size(), CV_16UC3);
+    horizontalQ.create(src.size(), CV_16UC3);
+
+    //Spatial pre-processing, horizontal pass (BORDER_REFLECT_101 like GaussianBlur)
+    const int left  = cols > 1 ? cn : 0;
+    for (int y=0; y<rows; y++) {
+        const uchar* s = src.ptr<uchar>(y);
+        ushort* h = horizontalQ.ptr<ushort>(y);
+        for (int x=0; x<cols; x++) {
+            int xl = x > 0 ? (x-1)*cn : left;
+            int xr = x < cols-1 ? (x+1)*cn : (cols-1)*cn - left;
+            for (int c=0; c<cn; c++)
+                h[x*cn+c] = (ushort)(k0*s[xl+c] + k1*s[x*cn+c] + k2*s[xr+c]);
+        }
+    }
+
+    //Spatial pre-processing, vertical pass, rounded back to Q8.8
+    for (int y=0; y<rows; y++) {
+        int yu = y > 0 ? y-1 : (rows > 1 ? 1 : 0);
+        int yd = y < rows-1 ? y+1 : (rows > 1 ? rows-2 : 0);
+        const ushort* hu = horizontalQ.ptr<ushort>(yu);
+        const ushort* hc = horizontalQ.ptr<ushort>(y);
+        const ushort* hd = horizontalQ.ptr<ushort>(yd);
+        ushort* q = plane.ptr<ushort>(y);
+        for (int x=0; x<cols*cn; x++)
+            q[x] = (ushort)((k0*hu[x] + k1*hc[x] + k2*hd[x] + half) >> FIXED_POINT_BITS);
+    }
+
+    kernelImageQ.push_back(plane);
+
+    //Temporal pre-processing
+    dst.create(src.size(), CV_MAKETYPE(fixedPointDepth, cn));
+    const int* t = &temporalTapsQ[0];
+    const int shift = fixedPointDepth == CV_8U ? 2*FIXED_POINT_BITS : FIXED_POINT_BITS;
+    const unsigned round = 1u << (shift - 1);
+
+    for (int y=0; y<rows; y++) {
+        const ushort* q0 = kernelImageQ[0].ptr<ushort>(y);
+        const ushort* q1 = kernelImageQ[1].ptr<ushort>(y);
+        const ushort* q2 = kernelImageQ[2].ptr<ushort>(y);
+        if (fixedPointDepth == CV_8U) {
+            uchar* d = dst.ptr<uchar>(y);
+            for (int x=0; x<cols*cn; x++)
+                d[x] = (uchar)((t[0]*q0[x] + t[1]*q1[x] + t[2]*q2[x] + round) >> shift);
+        }
+        else {
+            ushort* d = dst.ptr<ushort>(y);
+            for (int x=0; x<cols*cn; x++)
+                d[x] = (ushort)((t[0]*q0[x] + t[1]*q1[x] + t[2]*q2[x] + round) >> shift);
+        }
+    }
+}
+
 void mdgkt::deleteInstance () {
     
     if (ptrInstance) {
@@ -115,7 +325,8 @@ mdgkt* mdgkt::Instance() {
         ptrInstance = new mdgkt();
     }
     else
-        cout << "INSTANCE ALREADY CREATED" << endl;
+        LOG4CPLUS_DEBUG(log4cplus::Logger::getInstance(LOG4CPLUS_TEXT("sagmm.mdgkt")),
+                        "instance already created");
     
     //numInstances++;
     return ptrInstance;
@@ -0,0 +1,172 @@
+//
+//  mixture_store.cpp
+//  sagmm
+//
+
+#include "mixture_store.h"
+
+
+// record layout: weight, variance, counter, mean[nchannels]
+static inline void readMode(const float* record, int nchannels, GMM& gmm, float* mean, float& counter)
+{
+    gmm.weight   = record[0];
+    gmm.variance = record[1];
+    counter      = record[2];
+    for (int c=0; c<nchannels; c++)
+        mean[c] = record[3 + c];
+}
+
+
+static inline void writeMode(float* record, int nchannels, const GMM& gmm, const float* mean, float counter)
+{
+    record[0] = gmm.weight;
+    record[1] = gmm.variance;
+    record[2] = counter;
+    for (int c=0; c<nchannels; c++)
+        record[3 + c] = mean[c];
+}
+
+
+CompactMixtureStore::CompactMixtureStore()
+: size(0,0), nchannels(0), nmixtures(0), tileRows(DEFAULT_TILE_ROWS), stride(0), blockFloats(0)
+{
+}
+
+
+void CompactMixtureStore::create(Size _size, int _nchannels, int _nmixtures, int _tileRows)
+{
+    CV_Assert( _nmixtures >= 1 && _nchannels >= 1 && _tileRows >= 1 );
+
+    size        = _size;
+    nchannels   = _nchannels;
+    nmixtures   = _nmixtures;
+    tileRows    = _tileRows;
+    stride      = 3 + nchannels;
+    blockFloats = (nmixtures - 1)*stride;
+
+    int pixels = size.width*size.height;
+    primary.assign((size_t)pixels*stride, 0.f);
+    overflow.assign(pixels, -1);
+    arenas.clear();
+    arenas.resize((size.height + tileRows - 1) / tileRows);
+}
+
+
+void CompactMixtureStore::release()
+{
+    primary.clear();
+    overflow.clear();
+    arenas.clear();
+}
+
+
+Range CompactMixtureStore::tileRange(int tile) const
+{
+    return Range(tile*tileRows, std::min((tile + 1)*tileRows, size.height));
+}
+
+
+int CompactMixtureStore::allocateBlock(Arena& arena)
+{
+    if (!arena.freeBlocks.empty()) {
+        int block = arena.freeBlocks.back();
+        arena.freeBlocks.pop_back();
+        return block;
+    }
+    int block = (int)(arena.blocks.size() / blockFloats);
+    arena.blocks.resize(arena.blocks.size() + blockFloats);
+    return block;
+}
+
+
+void CompactMixtureStore::load(int idx, int nmodes, GMM* gmm, float* mean, float* counter) const
+{
+    if (nmodes <= 0)
+        return;
+
+    readMode(&primary[(size_t)idx*stride], nchannels, gmm[0], mean, counter[0]);
+    if (nmodes == 1)
+        return;
+
+    const Arena& arena = arenas[idx / size.width / tileRows];
+    const float* record = &arena.blocks[(size_t)overflow[idx]*blockFloats];
+    for (int m=1; m<nmodes; m++, record += stride)
+        readMode(record, nchannels, gmm[m], mean + m*nchannels, counter[m]);
+}
+
+
+void CompactMixtureStore::store(int idx, int nmodes, const GMM* gmm, const float* mean, const float* counter,
+                                const uchar* order)
+{
+    int& block = overflow[idx];
+    if (nmodes > 0) {
+        int m = order ? order[0] : 0;
+        writeMode(&primary[(size_t)idx*stride], nchannels, gmm[m], mean + m*nchannels, counter[m]);
+    }
+
+    if (nmodes <= 1) {
+        // pruned down to one mode, the block goes back to the free list
+        if (block >= 0) {
+            arenas[idx / size.width / tileRows].freeBlocks.push_back(block);
+            block = -1;
+        }
+        return;
+    }
+
+    Arena& arena = arenas[idx / size.width / tileRows];
+    if (block < 0)
+        block = allocateBlock(arena);
+    float* record = &arena.blocks[(size_t)block*blockFloats];
+    for (int r=1; r<nmodes; r++, record += stride) {
+        int m = order ? order[r] : r;
+        writeMode(record, nchannels, gmm[m], mean + m*nchannels, counter[m]);
+    }
+}
+
+
+void CompactMixtureStore::copyTile(int tile, TileCopy& copy) const
+{
+    Range rows = tileRange(tile);
+    size_t first = (size_t)rows.start*size.width;
+    size_t count = (size_t)rows.size()*size.width;
+
+    copy.nchannels = nchannels;
+    copy.nmixtures = nmixtures;
+    copy.primary.assign(primary.begin() + first*stride, primary.begin() + (first + count)*stride);
+    copy.overflow.assign(overflow.begin() + first, overflow.begin() + first + count);
+    copy.blocks = arenas[tile].blocks;
+}
+
+
+void CompactMixtureStore::load(const TileCopy& copy, int idx, int nmodes, GMM* gmm, float* mean, float* counter)
+{
+    if (nmodes <= 0)
+        return;
+
+    int stride = 3 + copy.nchannels;
+    readMode(&copy.primary[(size_t)idx*stride], copy.nchannels, gmm[0], mean, counter[0]);
+    if (nmodes == 1)
+        return;
+
+    const float* record = &copy.blocks[(size_t)copy.overflow[idx]*(copy.nmixtures - 1)*stride];
+    for (int m=1; m<nmodes; m++, record += stride)
+        readMode(record, copy.nchannels, gmm[m], mean + m*copy.nchannels, counter[m]);
+}
+
+
+size_t CompactMixtureStore::bytes() const
+{
+    size_t total = primary.capacity()*sizeof(float) + overflow.capacity()*sizeof(int);
+    for (size_t i=0; i<arenas.size(); i++)
+        total += arenas[i].blocks.capacity()*sizeof(float) + arenas[i].freeBlocks.capacity()*sizeof(int);
+    return total;
+}
+
+
+size_t CompactMixtureStore::overflowBlocks() const
+{
+    size_t used = 0;
+    for (size_t i=0; i<arenas.size(); i++)
+        used += arenas[i].blocks.size()/std::max(blockFloats, 1) - arenas[i].freeBlocks.size();
+    return used;
+}
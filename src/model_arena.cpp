@@ -0,0 +1,144 @@
+//
+//  model_arena.cpp
+//  sagmm
+//
+
+#include <cstddef>
+#include <sys/mman.h>
+#include "model_arena.h"
+
+
+ModelArena::ModelArena(bool _hugePages)
+: hugePages(_hugePages)
+{
+    stats.mappings        = 0;
+    stats.reuses          = 0;
+    stats.outstanding     = 0;
+    stats.cached          = 0;
+    stats.bytesMapped     = 0;
+    stats.explicitHuge    = 0;
+    stats.transparentHuge = 0;
+}
+
+
+ModelArena::~ModelArena()
+{
+    trim();
+}
+
+
+// called with the lock held
+ModelArena::Block* ModelArena::mapBlock(size_t bytes)
+{
+    size_t mapped = alignSize(sizeof(Block) + ALIGNMENT + bytes, (int)HUGE_PAGE);
+    uchar* base = NULL;
+
+#ifdef MAP_HUGETLB
+    // explicit huge pages, only if the administrator reserved enough
+    if (hugePages) {
+        void* p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            base = (uchar*)p;
+            stats.explicitHuge++;
+        }
+    }
+#endif
+
+    if (!base) {
+        // over-map by one huge page and trim both ends to a 2 MB aligned range
+        size_t extra = hugePages ? HUGE_PAGE : 0;
+        void* p = mmap(NULL, mapped + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            CV_Error(CV_StsNoMem, "cannot map model buffer");
+        base = (uchar*)p;
+        if (extra) {
+            uchar* aligned = alignPtr(base, (int)HUGE_PAGE);
+            if (aligned > base)
+                munmap(base, aligned - base);
+            if (aligned + mapped < base + mapped + extra)
+                munmap(aligned + mapped, base + extra - aligned);
+            base = aligned;
+        }
+#ifdef MADV_HUGEPAGE
+        if (hugePages && madvise(base, mapped, MADV_HUGEPAGE) == 0)
+            stats.transparentHuge++;
+#endif
+    }
+
+    Block* block  = (Block*)base;
+    block->bytes  = bytes;
+    block->mapped = mapped;
+    block->data   = alignPtr(base + sizeof(Block), ALIGNMENT);
+    stats.mappings++;
+    stats.bytesMapped += mapped;
+    return block;
+}
+
+
+// called with the lock held
+void ModelArena::unmapBlock(Block* block)
+{
+    stats.bytesMapped -= block->mapped;
+    munmap(block, block->mapped);
+}
+
+
+void ModelArena::allocate(int dims, const int* sizes, int type, int*& refcount,
+                          uchar*& datastart, uchar*& data, size_t* step)
+{
+    // dense steps, same as the default allocator
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims-1; i >= 0; i--) {
+        step[i] = total;
+        total *= sizes[i];
+    }
+
+    Block* block = NULL;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<size_t, vector<Block*> >::iterator it = freeBlocks.find(total);
+        if (it != freeBlocks.end() && !it->second.empty()) {
+            block = it->second.back();
+            it->second.pop_back();
+            stats.reuses++;
+            stats.cached--;
+        }
+        else
+            block = mapBlock(total);
+        stats.outstanding++;
+    }
+
+    block->refcount = 1;
+    refcount  = &block->refcount;
+    datastart = data = block->data;
+}
+
+
+void ModelArena::deallocate(int* refcount, uchar* /*datastart*/, uchar* /*data*/)
+{
+    Block* block = (Block*)((uchar*)refcount - offsetof(Block, refcount));
+
+    std::lock_guard<std::mutex> guard(lock);
+    freeBlocks[block->bytes].push_back(block);
+    stats.outstanding--;
+    stats.cached++;
+}
+
+
+void ModelArena::trim()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::map<size_t, vector<Block*> >::iterator it = freeBlocks.begin(); it != freeBlocks.end(); ++it) {
+        for (size_t i=0; i<it->second.size(); i++)
+            unmapBlock(it->second[i]);
+        stats.cached -= it->second.size();
+        it->second.clear();
+    }
+}
+
+
+ModelArena::Statistics ModelArena::statistics() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
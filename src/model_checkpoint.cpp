@@ -0,0 +1,485 @@
+//
+//  model_checkpoint.cpp
+//  sagmm
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "model_checkpoint.h"
+#include "background_subtraction.h"
+
+static const char   fileMagic[]       = "SGMCKPT1";
+static const size_t recordHeaderBytes = 4 + 4 + 4;
+static const size_t basePayloadBytes  = 5*4;
+static const size_t commitBytes       = 2*4;
+
+
+//////
+// little endian serialization helpers
+
+static void putU32(vector<uchar>& out, unsigned v)
+{
+    for (int i=0; i<4; i++)
+        out.push_back((uchar)(v >> 8*i));
+}
+
+static unsigned getU32(const uchar* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static unsigned fnv1a(const uchar* p, size_t n)
+{
+    unsigned h = 2166136261u;
+    for (size_t i=0; i<n; i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+// payload bytes of the TILE record of a tile of rows x cols pixels
+static size_t tilePayloadBytes(int rows, int cols, int mixtures, int channels)
+{
+    return 8 + (size_t)rows*cols*(1 + (size_t)mixtures*(3 + channels)*4);
+}
+
+// a rename is only durable once the directory holding the name is
+static void syncDirectory(const string& fileName)
+{
+    size_t slash = fileName.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : fileName.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    ::close(fd);
+}
+
+
+ModelCheckpointWriter::ModelCheckpointWriter(BackgroundSubtractorMOG3& _model, const string& _fileName,
+                                             double _interval)
+: model(_model), fileName(_fileName), interval(_interval), opened(false),
+  requested(false), stopping(false), threshold(0.5), maxAge(32), compactionRatio(4),
+  file(NULL), generation(0), frameType(0), nmixtures(0), checkpointNo(0),
+  checkpoints(0), tilesWritten(0), tilesSkipped(0), compactions(0), failures(0),
+  bytesWritten(0), logBytes(0)
+{
+    // the log itself is only replaced once a full checkpoint is on disk
+    string tmp = fileName + ".tmp";
+    FILE* probe = fopen(tmp.c_str(), "wb");
+    if (!probe)
+        return;
+    fclose(probe);
+    remove(tmp.c_str());
+
+    opened = true;
+    model.setTileActivity(true);
+    thread = std::thread(&ModelCheckpointWriter::writer, this);
+}
+
+
+ModelCheckpointWriter::~ModelCheckpointWriter()
+{
+    close();
+}
+
+
+void ModelCheckpointWriter::setDirtyThreshold(double fraction)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    threshold = std::max(fraction, 0.);
+}
+
+
+void ModelCheckpointWriter::setMaxAge(int checkpoints)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    maxAge = std::max(checkpoints, 0);
+}
+
+
+void ModelCheckpointWriter::setCompactionRatio(double ratio)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    compactionRatio = std::max(ratio, 1.);
+}
+
+
+void ModelCheckpointWriter::checkpoint()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        requested = true;
+    }
+    wake.notify_one();
+}
+
+
+void ModelCheckpointWriter::close()
+{
+    if (!thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+
+    if (file)
+        fclose(file);
+    file = NULL;
+}
+
+
+void ModelCheckpointWriter::writer()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        if (interval > 0)
+            wake.wait_for(guard, std::chrono::duration<double>(interval),
+                          [this] { return requested || stopping; });
+        else
+            wake.wait(guard, [this] { return requested || stopping; });
+        bool last = stopping;
+        requested = false;
+        guard.unlock();
+
+        // waits for the end of a frame running, at most
+        std::shared_ptr<const ModelSnapshot> snapshot = model.snapshot();
+        if (snapshot)
+            write(*snapshot);
+
+        guard.lock();
+        if (last)
+            return;
+    }
+}
+
+
+void ModelCheckpointWriter::write(const ModelSnapshot& snapshot)
+{
+    double minActivity;
+    int age;
+    double ratio;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        minActivity = threshold;
+        age         = maxAge;
+        ratio       = compactionRatio;
+    }
+
+    // a new model generation has nothing to build on in the log
+    bool rebase = writtenActivity.empty() || snapshot.generation() != generation ||
+                  snapshot.size() != frameSize || snapshot.type() != frameType ||
+                  snapshot.mixtures() != nmixtures;
+    if (rebase) {
+        if (compact(snapshot))
+            checkpoints++;
+        else
+            failures++;
+        modesUsed.release();
+        records.release();
+        return;
+    }
+
+    bool ok = true;
+    unsigned written = 0;
+    for (int t = 0; t < snapshot.tiles() && ok; t++) {
+        double pixels = (double)snapshot.tileRange(t).size()*frameSize.width;
+        bool dirty = snapshot.activity(t) - writtenActivity[t] >= minActivity*pixels ||
+                     (age > 0 && (checkpointNo + t) % age == 0);
+        if (!dirty) {
+            tilesSkipped++;
+            continue;
+        }
+        ok = writeTile(file, snapshot, t);
+        writtenActivity[t] = snapshot.activity(t);
+        written++;
+    }
+    modesUsed.release();
+    records.release();
+
+    payload.clear();
+    putU32(payload, (unsigned)snapshot.frame());
+    putU32(payload, written);
+    ok = ok && writeRecord(file, "CMIT") && fflush(file) == 0 && fdatasync(fileno(file)) == 0;
+    if (!ok) {
+        // a torn tail is ignored by the replay, the next checkpoint starts a new log
+        failures++;
+        writtenActivity.clear();
+        return;
+    }
+    checkpoints++;
+    checkpointNo++;
+
+    if (logBytes > ratio*fullBytes(snapshot) && !compact(snapshot))
+        failures++;
+    modesUsed.release();
+    records.release();
+}
+
+
+// full checkpoint of the snapshot into a new file replacing the log
+bool ModelCheckpointWriter::compact(const ModelSnapshot& snapshot)
+{
+    string tmp = fileName + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    if (!out)
+        return false;
+
+    bool ok = fwrite(fileMagic, 1, 8, out) == 8;
+    bytesWritten += 8;
+
+    payload.clear();
+    putU32(payload, (unsigned)snapshot.size().width);
+    putU32(payload, (unsigned)snapshot.size().height);
+    putU32(payload, (unsigned)snapshot.type());
+    putU32(payload, (unsigned)snapshot.mixtures());
+    putU32(payload, (unsigned)ModelSnapshot::TILE_ROWS);
+    ok = ok && writeRecord(out, "BASE");
+
+    for (int t = 0; t < snapshot.tiles() && ok; t++)
+        ok = writeTile(out, snapshot, t);
+
+    payload.clear();
+    putU32(payload, (unsigned)snapshot.frame());
+    putU32(payload, (unsigned)snapshot.tiles());
+    ok = ok && writeRecord(out, "CMIT");
+    ok = ok && fflush(out) == 0 && fdatasync(fileno(out)) == 0;
+    off_t size = ftello(out);
+    ok = fclose(out) == 0 && ok;
+
+    if (!ok || rename(tmp.c_str(), fileName.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    syncDirectory(fileName);
+
+    if (file)
+        fclose(file);
+    file = fopen(fileName.c_str(), "ab");
+    if (!file) {
+        writtenActivity.clear();
+        return false;
+    }
+
+    generation = snapshot.generation();
+    frameSize  = snapshot.size();
+    frameType  = snapshot.type();
+    nmixtures  = snapshot.mixtures();
+    writtenActivity.resize(snapshot.tiles());
+    for (int t = 0; t < snapshot.tiles(); t++)
+        writtenActivity[t] = snapshot.activity(t);
+    logBytes = (uint64)size;
+    compactions++;
+    return true;
+}
+
+
+bool ModelCheckpointWriter::writeTile(FILE* out, const ModelSnapshot& snapshot, int t)
+{
+    snapshot.readTile(t, modesUsed, records);
+
+    payload.clear();
+    putU32(payload, (unsigned)t);
+    putU32(payload, (unsigned)snapshot.frame());
+    for (int y = 0; y < modesUsed.rows; y++)
+        payload.insert(payload.end(), modesUsed.ptr(y), modesUsed.ptr(y) + modesUsed.cols);
+    for (int i = 0; i < records.rows; i++) {
+        const float* record = records.ptr<float>(i);
+        for (int j = 0; j < records.cols; j++) {
+            unsigned bits;
+            memcpy(&bits, &record[j], 4);
+            putU32(payload, bits);
+        }
+    }
+
+    if (!writeRecord(out, "TILE"))
+        return false;
+    tilesWritten++;
+    return true;
+}
+
+
+bool ModelCheckpointWriter::writeRecord(FILE* out, const char* kind)
+{
+    vector<uchar> header(kind, kind + 4);
+    putU32(header, (unsigned)payload.size());
+    putU32(header, fnv1a(payload.empty() ? NULL : &payload[0], payload.size()));
+
+    bool ok = fwrite(&header[0], 1, header.size(), out) == header.size() &&
+              (payload.empty() || fwrite(&payload[0], 1, payload.size(), out) == payload.size());
+    bytesWritten += header.size() + payload.size();
+    if (out == file)
+        logBytes += header.size() + payload.size();
+    return ok;
+}
+
+
+uint64 ModelCheckpointWriter::fullBytes(const ModelSnapshot& snapshot) const
+{
+    uint64 bytes = 8 + recordHeaderBytes + basePayloadBytes + recordHeaderBytes + commitBytes;
+    for (int t = 0; t < snapshot.tiles(); t++)
+        bytes += recordHeaderBytes + tilePayloadBytes(snapshot.tileRange(t).size(), snapshot.size().width,
+                                                      snapshot.mixtures(), snapshot.channels());
+    return bytes;
+}
+
+
+ModelCheckpointWriter::Statistics ModelCheckpointWriter::statistics() const
+{
+    Statistics s;
+    s.checkpoints  = checkpoints;
+    s.tilesWritten = tilesWritten;
+    s.tilesSkipped = tilesSkipped;
+    s.compactions  = compactions;
+    s.failures     = failures;
+    s.bytesWritten = bytesWritten;
+    s.logBytes     = logBytes;
+    return s;
+}
+
+
+ModelCheckpointReader::ModelCheckpointReader(const string& fileName)
+: file(NULL), complete(false), frameType(0), nmixtures(0), tileRows(0), frameNo(0)
+{
+    file = fopen(fileName.c_str(), "rb");
+    if (!file)
+        return;
+
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, fileMagic, 8) != 0) {
+        fclose(file);
+        file = NULL;
+        return;
+    }
+    scan();
+}
+
+
+ModelCheckpointReader::~ModelCheckpointReader()
+{
+    if (file)
+        fclose(file);
+}
+
+
+bool ModelCheckpointReader::readPayload(uint64 offset, unsigned bytes)
+{
+    payload.resize(bytes);
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0 &&
+           (bytes == 0 || fread(&payload[0], 1, bytes, file) == bytes);
+}
+
+
+// walks the records up to the end of the log or the first damaged one
+void ModelCheckpointReader::scan()
+{
+    if (fseeko(file, 0, SEEK_END) != 0)
+        return;
+    uint64 end = (uint64)ftello(file);
+
+    bool based = false;
+    int nchannels = 0;
+    vector<pair<int, pair<uint64, unsigned> > > pending;
+    uchar header[recordHeaderBytes];
+
+    for (uint64 pos = 8; pos + recordHeaderBytes <= end; ) {
+        if (fseeko(file, (off_t)pos, SEEK_SET) != 0 ||
+            fread(header, 1, recordHeaderBytes, file) != recordHeaderBytes)
+            return;
+        unsigned bytes = getU32(header + 4);
+        uint64 offset  = pos + recordHeaderBytes;
+        if (offset + bytes > end || !readPayload(offset, bytes) ||
+            fnv1a(payload.empty() ? NULL : &payload[0], bytes) != getU32(header + 8))
+            return;
+        const uchar* p = payload.empty() ? NULL : &payload[0];
+
+        if (memcmp(header, "BASE", 4) == 0) {
+            if (based || bytes != basePayloadBytes)
+                return;
+            frameSize = Size((int)getU32(p), (int)getU32(p + 4));
+            frameType = (int)getU32(p + 8);
+            nmixtures = (int)getU32(p + 12);
+            tileRows  = (int)getU32(p + 16);
+            nchannels = CV_MAT_CN(frameType);
+            if (frameSize.width <= 0 || frameSize.height <= 0 || tileRows <= 0 ||
+                nmixtures < 1 || nmixtures > 255)
+                return;
+            tiles.assign((frameSize.height + tileRows - 1) / tileRows, make_pair((uint64)0, 0u));
+            based = true;
+        }
+        else if (memcmp(header, "TILE", 4) == 0) {
+            if (!based)
+                return;
+            int t = (int)getU32(p);
+            if (t < 0 || t >= (int)tiles.size())
+                return;
+            int rows = std::min(tileRows, frameSize.height - t*tileRows);
+            if (bytes != tilePayloadBytes(rows, frameSize.width, nmixtures, nchannels))
+                return;
+            pending.push_back(make_pair(t, make_pair(offset, bytes)));
+        }
+        else if (memcmp(header, "CMIT", 4) == 0) {
+            if (!based || bytes != commitBytes)
+                return;
+            for (size_t i = 0; i < pending.size(); i++)
+                tiles[pending[i].first] = pending[i].second;
+            pending.clear();
+            frameNo = (int)getU32(p);
+
+            complete = true;
+            for (size_t t = 0; t < tiles.size(); t++)
+                complete = complete && tiles[t].first != 0;
+        }
+        else
+            return;
+        pos = offset + bytes;
+    }
+}
+
+
+bool ModelCheckpointReader::restore(BackgroundSubtractorMOG3& model)
+{
+    if (!isOpened())
+        return false;
+
+    // readers of the model wait for the restore as for a frame
+    ModelSnapshots::Update update(model.snapshots, model.nframes);
+    model.nmixtures = nmixtures;
+    model.initialize(frameSize, frameType);
+
+    int nchannels = CV_MAT_CN(frameType);
+    int stride    = nmixtures*(3 + nchannels);
+    Mat modesUsed, records;
+    for (size_t t = 0; t < tiles.size(); t++) {
+        Range rows((int)t*tileRows, std::min(((int)t + 1)*tileRows, frameSize.height));
+        size_t pixels = (size_t)rows.size()*frameSize.width;
+        const uchar* p = readPayload(tiles[t].first, tiles[t].second) ? &payload[8] : NULL;
+        if (p && *std::max_element(p, p + pixels) > nmixtures)
+            p = NULL;
+        if (!p) {
+            model.nframes = 0;
+            return false;
+        }
+
+        modesUsed.create(rows.size(), frameSize.width, CV_8U);
+        memcpy(modesUsed.data, p, pixels);
+        p += pixels;
+        records.create((int)pixels, stride, CV_32F);
+        float* record = (float*)records.data;
+        for (size_t i = 0; i < pixels*stride; i++, p += 4) {
+            unsigned bits = getU32(p);
+            memcpy(&record[i], &bits, 4);
+        }
+        model.importRows(rows, modesUsed, records);
+    }
+
+    // nframes 0 would have the next frame initialize the model again
+    model.nframes = std::max(frameNo, 1);
+    return true;
+}
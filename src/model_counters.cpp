@@ -0,0 +1,125 @@
+//
+//  model_counters.cpp
+//  sagmm
+//
+
+#include <cstring>
+
+#include "model_counters.h"
+
+
+ModelCounters::Partial::Partial()
+: pixels(0), foreground(0), shadow(0), newModes(0), prunedModes(0), skipped(0),
+  updateSeconds(0), shadowSeconds(0)
+{
+    memset(modes, 0, sizeof(modes));
+}
+
+
+ModelCounters::Counts::Counts()
+: pixels(0), foreground(0), shadow(0), newModes(0), prunedModes(0), skipped(0)
+{
+    for (int i=0; i<STAGE_COUNT; i++)
+        stageSeconds[i] = 0;
+}
+
+
+ModelCounters::ModelCounters()
+: frames(0)
+{
+}
+
+
+void ModelCounters::beginFrame()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    current = Partial();
+}
+
+
+void ModelCounters::addPartial(const Partial& p)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    current.pixels        += p.pixels;
+    current.foreground    += p.foreground;
+    current.shadow        += p.shadow;
+    current.newModes      += p.newModes;
+    current.prunedModes   += p.prunedModes;
+    current.skipped       += p.skipped;
+    current.updateSeconds += p.updateSeconds;
+    current.shadowSeconds += p.shadowSeconds;
+    for (int i=0; i<MAX_MODES; i++)
+        current.modes[i] += p.modes[i];
+}
+
+
+void ModelCounters::endFrame(double wallSeconds)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    // update and shadow test run interleaved on the same workers
+    double workerSeconds = current.updateSeconds + current.shadowSeconds;
+    double shadowShare   = workerSeconds > 0 ? current.shadowSeconds / workerSeconds : 0;
+
+    last.pixels      = current.pixels;
+    last.foreground  = current.foreground;
+    last.shadow      = current.shadow;
+    last.newModes    = current.newModes;
+    last.prunedModes = current.prunedModes;
+    last.skipped     = current.skipped;
+    last.stageSeconds[UPDATE] = wallSeconds * (1 - shadowShare);
+    last.stageSeconds[SHADOW] = wallSeconds * shadowShare;
+
+    total.pixels      += last.pixels;
+    total.foreground  += last.foreground;
+    total.shadow      += last.shadow;
+    total.newModes    += last.newModes;
+    total.prunedModes += last.prunedModes;
+    total.skipped     += last.skipped;
+    total.stageSeconds[UPDATE] += last.stageSeconds[UPDATE];
+    total.stageSeconds[SHADOW] += last.stageSeconds[SHADOW];
+
+    int used = MAX_MODES;
+    while (used > 1 && current.modes[used-1] == 0)
+        used--;
+    histogram.assign(current.modes, current.modes + used);
+    frames++;
+}
+
+
+void ModelCounters::addStageTime(Stage stage, double seconds)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    last.stageSeconds[stage]   = seconds;
+    total.stageSeconds[stage] += seconds;
+}
+
+
+ModelCounters::Snapshot ModelCounters::snapshot() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Snapshot s;
+    s.frames         = frames;
+    s.total          = total;
+    s.last           = last;
+    s.modesHistogram = histogram;
+    return s;
+}
+
+
+void ModelCounters::reset()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    frames  = 0;
+    total   = Counts();
+    last    = Counts();
+    current = Partial();
+    histogram.clear();
+}
+
+
+const char* ModelCounters::stageName(Stage stage)
+{
+    static const char* names[STAGE_COUNT] = { "preprocess", "update", "shadow", "background" };
+    return names[stage];
+}
@@ -0,0 +1,314 @@
+//
+//  model_snapshot.cpp
+//  sagmm
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "model_snapshot.h"
+#include "background_subtraction.h"
+
+
+ModelSnapshot::ModelSnapshot(const BackgroundSubtractorMOG3& _model, int frame)
+: model(_model), frameNo(frame), frameSize(_model.frameSize), frameType(_model.frameType),
+  nchannels(CV_MAT_CN(_model.frameType)), nmixtures(_model.nmixtures), backgroundRatio(_model.backgroundRatio),
+  compact(!_model.compactStore.empty()), modelGeneration(_model.generation), tileActivity((_model.frameSize.height + TILE_ROWS - 1) / TILE_ROWS, 0),
+  tileData((_model.frameSize.height + TILE_ROWS - 1) / TILE_ROWS), copiedTiles(0)
+{
+    // made between frames, the row counts hold still
+    const vector<uint64>& rows = _model.rowActivity;
+    for (int y = 0; y < (int)rows.size() && y < frameSize.height; y++)
+        tileActivity[y / TILE_ROWS] += rows[y];
+    // tiles are copied straight out of the store's arenas
+    CV_Assert( !compact || _model.compactStore.tiles() == tiles() );
+}
+
+
+Range ModelSnapshot::tileRange(int tile) const
+{
+    return Range(tile*TILE_ROWS, std::min((tile + 1)*TILE_ROWS, frameSize.height));
+}
+
+
+static void copyBytes(Mat& dst, const void* src, size_t bytes)
+{
+    dst.create(1, (int)bytes, CV_8U);
+    memcpy(dst.data, src, bytes);
+}
+
+
+// The tile's slice of the live model buffers, no per-pixel work: the
+// tile's worker (or a reader, under the tile's lock) does it in the time
+// of a memcpy.
+void ModelSnapshot::copyTile(int t, Tile& copy) const
+{
+    Range rows = tileRange(t);
+    model.CurrentGaussianModel.rowRange(rows.start, rows.end).copyTo(copy.modesUsed);
+    if (compact) {
+        model.compactStore.copyTile(t, copy.store);
+        return;
+    }
+
+    size_t first = (size_t)rows.start*frameSize.width*nmixtures;
+    size_t count = (size_t)rows.size()*frameSize.width*nmixtures;
+    const GMM*   gmm0  = (const GMM*)model.GaussianModel.data;
+    const float* mean0 = (const float*)(gmm0 + nmixtures*frameSize.area());
+    copyBytes(copy.gmm, gmm0 + first, count*sizeof(GMM));
+    copyBytes(copy.mean, mean0 + first*nchannels, count*nchannels*sizeof(float));
+    copyBytes(copy.counter, (const float*)model.BackgroundNumberCounter.data + first, count*sizeof(float));
+    copyBytes(copy.order, model.ModeOrder.data + first, count);
+}
+
+
+// Records of a copied tile, by descending weight.
+void ModelSnapshot::decodeTile(int t, const Tile& copy, Mat& modesUsed, Mat& records) const
+{
+    int stride = recordFloats();
+    int pixels = tileRange(t).size()*frameSize.width;
+    copy.modesUsed.copyTo(modesUsed);
+    records.create(pixels, nmixtures*stride, CV_32F);
+
+    const GMM*   gmm0   = (const GMM*)copy.gmm.data;
+    const float* mean0  = (const float*)copy.mean.data;
+    const float* cnt0   = (const float*)copy.counter.data;
+    const uchar* order0 = copy.order.data;
+
+    vector<GMM>   gmm(nmixtures);
+    vector<float> mean(nmixtures*nchannels), cnt(nmixtures);
+
+    for (int i = 0; i < pixels; i++) {
+        float* record = records.ptr<float>(i);
+        std::fill(record, record + nmixtures*stride, 0.f);
+
+        int nmodes = copy.modesUsed.data[i];
+        if (compact)
+            CompactMixtureStore::load(copy.store, i, nmodes, &gmm[0], &mean[0], &cnt[0]);
+        for (int r = 0; r < nmodes; r++, record += stride) {
+            int m = compact ? r : order0[(size_t)i*nmixtures + r];
+            const GMM& g      = compact ? gmm[r] : gmm0[(size_t)i*nmixtures + m];
+            const float* mode = compact ? &mean[r*nchannels] : mean0 + ((size_t)i*nmixtures + m)*nchannels;
+            record[0] = g.weight;
+            record[1] = g.variance;
+            record[2] = compact ? cnt[r] : cnt0[(size_t)i*nmixtures + m];
+            for (int c = 0; c < nchannels; c++)
+                record[3 + c] = mode[c];
+        }
+    }
+}
+
+
+void ModelSnapshot::preserveTile(int t)
+{
+    Tile& tile = tileData[t];
+    if (tile.copied.load(std::memory_order_acquire))
+        return;
+
+    std::lock_guard<std::mutex> guard(tile.lock);
+    if (tile.copied.load(std::memory_order_relaxed))
+        return;
+    copyTile(t, tile);
+    tile.copied.store(true, std::memory_order_release);
+    copiedTiles++;
+}
+
+
+void ModelSnapshot::preserve(int y0, int y1)
+{
+    for (int t = y0 / TILE_ROWS; t < tiles() && t*TILE_ROWS < y1; t++)
+        preserveTile(t);
+}
+
+
+void ModelSnapshot::preserveAll()
+{
+    for (int t = 0; t < tiles(); t++)
+        preserveTile(t);
+}
+
+
+void ModelSnapshot::readTile(int t, Mat& modesUsed, Mat& records) const
+{
+    Tile& tile = tileData[t];
+    if (!tile.copied.load(std::memory_order_acquire)) {
+        // still shared: copy the model while its workers cannot copy, and
+        // so write, the tile, and decode the copy once they can again
+        Tile live;
+        {
+            std::lock_guard<std::mutex> guard(tile.lock);
+            if (!tile.copied.load(std::memory_order_relaxed))
+                copyTile(t, live);
+        }
+        if (!live.modesUsed.empty()) {
+            decodeTile(t, live, modesUsed, records);
+            return;
+        }
+    }
+    decodeTile(t, tile, modesUsed, records);
+}
+
+
+void ModelSnapshot::getBackgroundImage(OutputArray backgroundImage) const
+{
+    CV_Assert( nchannels == 1 || nchannels == 3 );
+    backgroundImage.create(frameSize, CV_8UC(nchannels));
+    Mat dst = backgroundImage.getMat();
+
+    int stride = recordFloats();
+    Mat modesUsed, records;
+    for (int t = 0; t < tiles(); t++) {
+        readTile(t, modesUsed, records);
+        Range rows = tileRange(t);
+        for (int y = rows.start; y < rows.end; y++) {
+            const uchar* used = modesUsed.ptr(y - rows.start);
+            uchar* out = dst.ptr(y);
+            for (int x = 0; x < frameSize.width; x++, out += nchannels) {
+                const float* record = records.ptr<float>((y - rows.start)*frameSize.width + x);
+                float meanVal[3] = { 0.f, 0.f, 0.f };
+                float totalWeight = 0.f;
+                for (int r = 0; r < used[x]; r++, record += stride) {
+                    for (int c = 0; c < nchannels; c++)
+                        meanVal[c] += record[0]*record[3 + c];
+                    totalWeight += record[0];
+                    if (totalWeight > backgroundRatio)
+                        break;
+                }
+
+                float scale = totalWeight > 0.f ? 1.f/totalWeight : 0.f;
+                for (int c = 0; c < nchannels; c++)
+                    out[c] = saturate_cast<uchar>(meanVal[c]*scale);
+            }
+        }
+    }
+}
+
+
+ModelSnapshots::ModelSnapshots(const BackgroundSubtractorMOG3& _model)
+: model(_model), updates(0), waiting(0), lastFrame(0), readOnly(false)
+{
+}
+
+
+std::shared_ptr<const ModelSnapshot> ModelSnapshots::acquire()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        if (updates == 0) {
+            if (model.CurrentGaussianModel.empty())
+                return std::shared_ptr<const ModelSnapshot>();
+            std::shared_ptr<ModelSnapshot> snapshot = current.lock();
+            if (!snapshot) {
+                snapshot.reset(new ModelSnapshot(model, lastFrame));
+                current = snapshot;
+            }
+            return snapshot;
+        }
+
+        // the frame running preserves the boundary it started from
+        if (active)
+            return active;
+        waiting++;
+        boundary.wait(guard);
+        waiting--;
+    }
+}
+
+
+ModelSnapshot* ModelSnapshots::preserving() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return active && !active->complete() ? active.get() : NULL;
+}
+
+
+void ModelSnapshots::detach()
+{
+    std::shared_ptr<ModelSnapshot> snapshot;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        snapshot = current.lock();
+        current.reset();
+        // the rest of the frame writes the new buffers
+        readOnly = false;
+    }
+    // copied without the lock; only the model thread gets here, which is
+    // the only one that could write the tiles
+    if (snapshot)
+        snapshot->preserveAll();
+}
+
+
+void ModelSnapshots::beginUpdate()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (updates++ > 0)
+        return;
+    active = current.lock();
+    readOnly = false;
+}
+
+
+void ModelSnapshots::endUpdate(int frame)
+{
+    std::shared_ptr<ModelSnapshot> leftover;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (--updates > 0)
+            return;
+
+        if (readOnly) {
+            // the model is as the open snapshot (if any) has it, it stays current
+            active.reset();
+        }
+        else {
+            // rows the frame did not write are still shared, the next frame would
+            if (active && !active->complete())
+                leftover = active;
+            active.reset();
+            current.reset();
+        }
+        lastFrame = frame;
+
+        // readers that waited get a snapshot of this boundary, held until the
+        // next frame has preserved it
+        if (waiting > 0 && !model.CurrentGaussianModel.empty()) {
+            active = current.lock();
+            if (!active) {
+                active.reset(new ModelSnapshot(model, frame));
+                current = active;
+            }
+        }
+        boundary.notify_all();
+    }
+
+    // readers of the old snapshot wait at most for the tile they read, and
+    // the model thread does not write before this returns
+    if (leftover)
+        leftover->preserveAll();
+}
+
+
+void ModelSnapshots::setReadOnly(bool enable)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    readOnly = enable;
+}
+
+
+ModelSnapshots::Update::Update(ModelSnapshots& _snapshots, const int& _frame)
+: snapshots(_snapshots), frame(_frame)
+{
+    snapshots.beginUpdate();
+}
+
+
+ModelSnapshots::Update::~Update()
+{
+    snapshots.endUpdate(frame);
+}
+
+
+void ModelSnapshots::Update::setReadOnly(bool readOnly)
+{
+    snapshots.setReadOnly(readOnly);
+}
@@ -0,0 +1,129 @@
+//
+//  numa_topology.cpp
+//  sagmm
+//
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "numa_topology.h"
+
+
+static bool byId(const NumaNode& a, const NumaNode& b)
+{
+    return a.id < b.id;
+}
+
+
+// "0-3,8-11" -> 0 1 2 3 8 9 10 11
+static vector<int> parseCpuList(const string& list)
+{
+    vector<int> cpus;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ',')) {
+        int first, last;
+        int n = sscanf(item.c_str(), "%d-%d", &first, &last);
+        if (n < 1)
+            continue;
+        if (n == 1)
+            last = first;
+        for (int cpu=first; cpu<=last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+
+NumaTopology::NumaTopology()
+{
+    const string root = "/sys/devices/system/node";
+    DIR* dir = opendir(root.c_str());
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            int id;
+            char tail;
+            if (sscanf(entry->d_name, "node%d%c", &id, &tail) != 1)
+                continue;
+
+            ifstream in((root + "/" + entry->d_name + "/cpulist").c_str());
+            string list;
+            NumaNode node;
+            node.id = id;
+            if (getline(in, list))
+                node.cpus = parseCpuList(list);
+            // memory-only nodes get no workers
+            if (!node.cpus.empty())
+                nodeList.push_back(node);
+        }
+        closedir(dir);
+        std::sort(nodeList.begin(), nodeList.end(), byId);
+    }
+
+    if (nodeList.empty()) {
+        NumaNode node;
+        node.id = 0;
+        for (int cpu=0; cpu<getNumberOfCPUs(); cpu++)
+            node.cpus.push_back(cpu);
+        nodeList.push_back(node);
+    }
+}
+
+
+int NumaTopology::cpus() const
+{
+    int n = 0;
+    for (size_t i=0; i<nodeList.size(); i++)
+        n += (int)nodeList[i].cpus.size();
+    return n;
+}
+
+
+vector<size_t> NumaTopology::pagesByNode(const void* data, size_t bytes)
+{
+    vector<size_t> pages;
+#if defined(__linux__) && defined(SYS_move_pages)
+    if (!data || !bytes)
+        return pages;
+
+    // move_pages() without target nodes only reports where each page is
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)data & ~(uintptr_t)(pageSize - 1);
+    uintptr_t end   = (uintptr_t)data + bytes;
+    size_t count = (end - first + pageSize - 1) / pageSize;
+
+    const size_t chunk = 4096;
+    vector<void*> addresses(std::min(count, chunk));
+    vector<int> status(addresses.size());
+    for (size_t done = 0; done < count; done += chunk) {
+        size_t n = std::min(chunk, count - done);
+        for (size_t i=0; i<n; i++)
+            addresses[i] = (void*)(first + (done + i)*pageSize);
+        if (syscall(SYS_move_pages, 0, n, &addresses[0], NULL, &status[0], 0) != 0)
+            return vector<size_t>();
+        for (size_t i=0; i<n; i++) {
+            int node = status[i];
+            if (node < 0)
+                continue;   // not yet touched
+            if ((size_t)node >= pages.size())
+                pages.resize(node + 1);
+            pages[node]++;
+        }
+    }
+#else
+    (void)data;
+    (void)bytes;
+#endif
+    return pages;
+}
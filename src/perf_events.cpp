@@ -0,0 +1,201 @@
+//
+//  perf_events.cpp
+//  sagmm
+//
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+#include "perf_events.h"
+
+
+static std::atomic<uint64> nextLogId(1);
+
+
+static bool byStart(const PerfEvent& a, const PerfEvent& b)
+{
+    return a.start < b.start;
+}
+
+
+PerfEventLog::PerfEventLog(size_t _ringCapacity, int drainIntervalMs)
+: id(nextLogId++), ringCapacity(_ringCapacity), drainInterval(std::max(drainIntervalMs, 1)),
+  sinks(0), running(false), trace(NULL), firstTraceEvent(true),
+  tickOrigin(now()), wallOrigin(getTickCount()), ticksPerMicrosecond(0),
+  recordedEvents(0), droppedEvents(0)
+{
+}
+
+
+PerfEventLog::~PerfEventLog()
+{
+    stop();
+    for (size_t i=0; i<rings.size(); i++)
+        delete rings[i];
+}
+
+
+bool PerfEventLog::openTrace(const string& fileName)
+{
+    trace = fopen(fileName.c_str(), "w");
+    if (!trace)
+        return false;
+    fputs("{\"traceEvents\":[\n", trace);
+    sinks |= SINK_TRACE;
+    return true;
+}
+
+
+void PerfEventLog::start()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (running)
+        return;
+    running = true;
+    thread = std::thread(&PerfEventLog::drainer, this);
+}
+
+
+void PerfEventLog::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+    }
+    wake.notify_all();
+    if (thread.joinable())
+        thread.join();
+
+    drain();
+    if (trace) {
+        fputs("\n]}\n", trace);
+        fclose(trace);
+        trace = NULL;
+    }
+}
+
+
+PerfEventLog::Ring* PerfEventLog::threadRing()
+{
+    // one ring per thread and log, found by the log's id (ids are never
+    // reused, so entries of logs gone never match); registration is the
+    // only locked step. The last log used is checked first
+    static thread_local std::map<uint64, Ring*> threadRings;
+    static thread_local uint64 cachedId = 0;
+    static thread_local Ring* cachedRing = NULL;
+
+    if (cachedId != id) {
+        Ring*& ring = threadRings[id];
+        if (!ring) {
+            std::lock_guard<std::mutex> guard(lock);
+            ring = new Ring(ringCapacity, (int)rings.size());
+            rings.push_back(ring);
+        }
+        cachedRing = ring;
+        cachedId = id;
+    }
+    return cachedRing;
+}
+
+
+void PerfEventLog::record(PerfStage stage, int frameNo, uint64 start, uint64 end,
+                          uint64 counter0, uint64 counter1)
+{
+    Ring* ring = threadRing();
+
+    PerfEvent e;
+    e.start       = start;
+    e.end         = end;
+    e.frameNo     = frameNo;
+    e.stage       = (short)stage;
+    e.thread      = (short)ring->thread;
+    e.counters[0] = counter0;
+    e.counters[1] = counter1;
+
+    if (ring->events.tryPush(e))
+        recordedEvents++;
+    else
+        droppedEvents++;
+}
+
+
+void PerfEventLog::drainer()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (running) {
+        wake.wait_for(guard, std::chrono::milliseconds(drainInterval));
+        guard.unlock();
+        drain();
+        guard.lock();
+    }
+}
+
+
+void PerfEventLog::drain()
+{
+    vector<Ring*> current;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        current = rings;
+    }
+
+    batch.clear();
+    PerfEvent e;
+    for (size_t i=0; i<current.size(); i++)
+        while (current[i]->events.tryPop(e))
+            batch.push_back(e);
+    if (batch.empty())
+        return;
+
+    // tick rate from the time elapsed since construction, refined every batch
+    double wall = (getTickCount() - wallOrigin) / getTickFrequency();
+    if (wall > 0)
+        ticksPerMicrosecond = (now() - tickOrigin) / (wall * 1e6);
+
+    std::sort(batch.begin(), batch.end(), byStart);
+    for (size_t i=0; i<batch.size(); i++)
+        write(batch[i]);
+    if (trace)
+        fflush(trace);
+}
+
+
+double PerfEventLog::microseconds(uint64 ticks) const
+{
+    return ticksPerMicrosecond > 0 ? ticks / ticksPerMicrosecond : 0.0;
+}
+
+
+void PerfEventLog::write(const PerfEvent& e)
+{
+    const char* name = stageName((PerfStage)e.stage);
+    double ts  = microseconds(e.start - std::min(e.start, tickOrigin));
+    double dur = microseconds(e.end - std::min(e.end, e.start));
+
+    if (sinks & SINK_LOG) {
+        static log4cplus::Logger logger = log4cplus::Logger::getInstance(LOG4CPLUS_TEXT("sagmm.perf"));
+        LOG4CPLUS_INFO(logger, "frame " << e.frameNo << " " << name << " thread " << e.thread
+                       << " " << dur/1000 << " ms [" << e.counters[0] << " " << e.counters[1] << "]");
+    }
+
+    if (trace) {
+        fprintf(trace, "%s{\"name\":\"%s\",\"cat\":\"sagmm\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":1,\"tid\":%d,\"args\":{\"frame\":%d,\"c0\":%llu,\"c1\":%llu}}",
+                firstTraceEvent ? "" : ",\n", name, ts, dur, e.thread, e.frameNo,
+                (unsigned long long)e.counters[0], (unsigned long long)e.counters[1]);
+        firstTraceEvent = false;
+    }
+}
+
+
+const char* PerfEventLog::stageName(PerfStage stage)
+{
+    static const char* names[PERF_STAGE_COUNT] = {
+        "decode", "preprocess", "model", "stripe", "background", "output"
+    };
+    return stage >= 0 && stage < PERF_STAGE_COUNT ? names[stage] : "unknown";
+}
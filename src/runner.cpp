@@ -0,0 +1,790 @@
+/*******************************************************************************
+ * <Self-Adaptive Gaussian Mixture Model.>
+ * Copyright (C) <2013>  <name of author>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+//
+// Headless batch runner: no windows, no waitKey. Reads a video, runs the
+// (optionally pre-processed) background model as fast as possible or at the
+// input frame rate, optionally writes masks and backgrounds, and prints
+// per-stage throughput and latency percentiles at exit.
+//
+// By default the stages run pipelined on separate threads (FramePipeline);
+// --serial keeps everything on one thread.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <opencv2/opencv.hpp>
+#include <log4cplus/logger.h>
+#include <log4cplus/configurator.h>
+
+#include <climits>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "mdgkt_filter.h"
+#include "background_subtraction.h"
+#include "buffer_pool.h"
+#include "frame_pipeline.h"
+#include "frame_source.h"
+#include "image_sequence.h"
+#include "mapped_video.h"
+#include "mask_archive.h"
+#include "model_checkpoint.h"
+#include "perf_events.h"
+#include "stage_stats.h"
+#include "zone_occupancy.h"
+
+
+using namespace cv;
+using namespace std;
+
+
+struct RunnerOptions
+{
+    string input;
+    string maskDir;
+    string backgroundDir;
+    string foregroundDir;  // frame where masked, black elsewhere
+    string archive;        // asynchronous mask/background archive
+    int    archiveQueue;
+    int    backgroundEvery;
+    bool   snapshots;      // background images from model snapshots on the output thread
+    bool   realtime;
+    double fps;
+    int    maxFrames;
+    int    threads;
+    bool   preprocess;
+    int    fixedPoint;     // 0 float, 8 or 16 bit fixed-point output
+    int    history;
+    float  varThreshold;
+    bool   shadows;
+    bool   compact;        // compact mixture storage
+    bool   coarseToFine;   // 8x8 block classification
+    int    updateEvery;    // model update subsampling
+    bool   pinned;         // model on NUMA-pinned workers
+    bool   hugePages;      // model buffers from a huge-page arena
+    bool   serial;
+    int    queueDepth;
+    Size   rawSize;        // input is a raw frame dump of this size
+    int    rawChannels;
+    int    decodeThreads;  // image sequence decoder pool
+    int    prefetch;       // image sequence frames decoded ahead
+    bool   stats;          // model health counters
+    string perfTrace;      // Chrome trace of performance events
+    bool   perfLog;        // performance events through log4cplus
+    string logConfig;      // log4cplus properties file
+    string params;         // model parameters, reloaded when the file changes
+    int    paramsEvery;
+    double deadline;       // per-frame deadline in ms, 0 updates every frame
+    int    maxSkip;        // frames without update the scheduler may allow
+    string writeParams;    // parameter template
+    Size   zoneGrid;       // zones as a grid of cells
+    string zoneMap;        // zones as a label image
+    string zonesOut;       // per-frame zone counts, CSV
+    string checkpoint;     // incremental model checkpoint log
+    double checkpointEvery;
+    string restore;        // checkpoint log to start the model from
+
+    RunnerOptions()
+    : archiveQueue(32), backgroundEvery(1), snapshots(false), realtime(false), fps(0), maxFrames(0), threads(-1),
+      preprocess(false), fixedPoint(0), history(0), varThreshold(0), shadows(true), compact(false), coarseToFine(false),
+      updateEvery(1), pinned(false), hugePages(false), serial(false), queueDepth(4), rawSize(0,0), rawChannels(3),
+      decodeThreads(2), prefetch(8), stats(false), perfLog(false), paramsEvery(25),
+      deadline(0), maxSkip(25), zoneGrid(0,0), checkpointEvery(60) { }
+};
+
+
+static void usage(const char* prog)
+{
+    cerr << "usage: " << prog << " -i <video> [options]" << endl
+         << "  -i, --input <file|dir>        input video; .y4m files are memory-mapped," << endl
+         << "                                a directory is read as numbered images" << endl
+         << "      --raw <w>x<h>             input is a raw frame dump, memory-mapped" << endl
+         << "      --raw-channels <1|3>      raw dump is grey or BGR (3)" << endl
+         << "      --decode-threads <n>      image sequence decoder threads (2)" << endl
+         << "      --prefetch <n>            image sequence frames decoded ahead (8)" << endl
+         << "  -m, --mask-dir <dir>          write foreground masks as PNG" << endl
+         << "  -b, --background-dir <dir>    write background images as PNG" << endl
+         << "      --foreground-dir <dir>    write the frame on black outside the mask as PNG" << endl
+         << "  -a, --archive <file>          append masks and backgrounds to an indexed archive" << endl
+         << "      --archive-queue <n>       frames the archive writer may fall behind (32)" << endl
+         << "      --background-every <n>    background image every n frames (1)" << endl
+         << "      --snapshots               background images from model snapshots off the model thread" << endl
+         << "      --realtime                pace processing at the input frame rate" << endl
+         << "      --fps <rate>              override the input frame rate" << endl
+         << "      --deadline <ms>           mask deadline from decode; classify only or drop frames when behind" << endl
+         << "      --max-skip <n>            update the model at least every n frames under --deadline (25)" << endl
+         << "  -n, --max-frames <n>          stop after n frames" << endl
+         << "  -t, --threads <n>             worker threads for the model" << endl
+         << "      --pinned                  model workers pinned per CPU, NUMA-local row bands" << endl
+         << "      --huge-pages              model buffers on 2 MB pages (explicit or transparent)" << endl
+         << "  -p, --preprocess              spatio-temporal pre-processing (mdgkt)" << endl
+         << "      --fixed-point <8|16>      fixed-point pre-processing with 8 or 16 bit output" << endl
+         << "      --history <n>             model history, learning rate 1/n" << endl
+         << "      --var-threshold <t>       squared Mahalanobis threshold" << endl
+         << "      --no-shadows              disable shadow detection" << endl
+         << "      --compact                 compact mixture storage (dense first mode, overflow arenas)" << endl
+         << "      --coarse-to-fine          skip the update of 8x8 blocks bound to be background" << endl
+         << "      --update-every <k>        update one pixel in k per frame, classify all (1)" << endl
+         << "      --zones <c>x<r>           zones: a grid of c x r cells" << endl
+         << "      --zone-map <image>        zones: label image, grey level = zone, 0 none (scaled to the frames)" << endl
+         << "      --zones-out <file>        CSV of foreground, shadow and changed pixels per zone and frame" << endl
+         << "      --checkpoint <file>       checkpoint the model to a log, only tiles that changed" << endl
+         << "      --checkpoint-every <s>    seconds between checkpoints (60)" << endl
+         << "      --restore <file>          start the model from the last checkpoint of a log" << endl
+         << "      --serial                  run all stages on one thread" << endl
+         << "      --queue-depth <n>         frames buffered between pipeline stages (4)" << endl
+         << "      --stats                   print model health counters at exit" << endl
+         << "      --perf-trace <file>       write performance events as a Chrome trace" << endl
+         << "      --perf-log                log performance events (logger sagmm.perf)" << endl
+         << "      --log-config <file>       log4cplus configuration, default console at INFO" << endl
+         << "      --params <file>           model parameters (YAML/XML), reloaded when changed" << endl
+         << "      --params-every <n>        frames between checks of the parameter file (25)" << endl
+         << "      --write-params <file>     write the default parameters and exit" << endl;
+}
+
+
+static bool parseOptions(int argc, char** argv, RunnerOptions& opt)
+{
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i+1 < argc;
+
+        if ((arg == "-i" || arg == "--input") && hasValue)
+            opt.input = argv[++i];
+        else if (arg == "--raw" && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &opt.rawSize.width, &opt.rawSize.height) != 2)
+                return false;
+        }
+        else if (arg == "--raw-channels" && hasValue)
+            opt.rawChannels = atoi(argv[++i]);
+        else if (arg == "--decode-threads" && hasValue)
+            opt.decodeThreads = atoi(argv[++i]);
+        else if (arg == "--prefetch" && hasValue)
+            opt.prefetch = atoi(argv[++i]);
+        else if ((arg == "-m" || arg == "--mask-dir") && hasValue)
+            opt.maskDir = argv[++i];
+        else if ((arg == "-b" || arg == "--background-dir") && hasValue)
+            opt.backgroundDir = argv[++i];
+        else if ((arg == "-a" || arg == "--archive") && hasValue)
+            opt.archive = argv[++i];
+        else if (arg == "--archive-queue" && hasValue)
+            opt.archiveQueue = atoi(argv[++i]);
+        else if (arg == "--background-every" && hasValue)
+            opt.backgroundEvery = atoi(argv[++i]);
+        else if (arg == "--realtime")
+            opt.realtime = true;
+        else if (arg == "--fps" && hasValue)
+            opt.fps = atof(argv[++i]);
+        else if (arg == "--deadline" && hasValue)
+            opt.deadline = atof(argv[++i]);
+        else if (arg == "--max-skip" && hasValue)
+            opt.maxSkip = atoi(argv[++i]);
+        else if ((arg == "-n" || arg == "--max-frames") && hasValue)
+            opt.maxFrames = atoi(argv[++i]);
+        else if ((arg == "-t" || arg == "--threads") && hasValue)
+            opt.threads = atoi(argv[++i]);
+        else if (arg == "-p" || arg == "--preprocess")
+            opt.preprocess = true;
+        else if (arg == "--fixed-point" && hasValue)
+            opt.fixedPoint = atoi(argv[++i]);
+        else if (arg == "--history" && hasValue)
+            opt.history = atoi(argv[++i]);
+        else if (arg == "--var-threshold" && hasValue)
+            opt.varThreshold = (float)atof(argv[++i]);
+        else if (arg == "--no-shadows")
+            opt.shadows = false;
+        else if (arg == "--compact")
+            opt.compact = true;
+        else if (arg == "--foreground-dir" && hasValue)
+            opt.foregroundDir = argv[++i];
+        else if (arg == "--coarse-to-fine")
+            opt.coarseToFine = true;
+        else if (arg == "--update-every" && hasValue)
+            opt.updateEvery = atoi(argv[++i]);
+        else if (arg == "--pinned")
+            opt.pinned = true;
+        else if (arg == "--huge-pages")
+            opt.hugePages = true;
+        else if (arg == "--serial")
+            opt.serial = true;
+        else if (arg == "--snapshots")
+            opt.snapshots = true;
+        else if (arg == "--zones" && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &opt.zoneGrid.width, &opt.zoneGrid.height) != 2)
+                return false;
+        }
+        else if (arg == "--zone-map" && hasValue)
+            opt.zoneMap = argv[++i];
+        else if (arg == "--zones-out" && hasValue)
+            opt.zonesOut = argv[++i];
+        else if (arg == "--checkpoint" && hasValue)
+            opt.checkpoint = argv[++i];
+        else if (arg == "--checkpoint-every" && hasValue)
+            opt.checkpointEvery = atof(argv[++i]);
+        else if (arg == "--restore" && hasValue)
+            opt.restore = argv[++i];
+        else if (arg == "--queue-depth" && hasValue)
+            opt.queueDepth = atoi(argv[++i]);
+        else if (arg == "--stats")
+            opt.stats = true;
+        else if (arg == "--perf-trace" && hasValue)
+            opt.perfTrace = argv[++i];
+        else if (arg == "--perf-log")
+            opt.perfLog = true;
+        else if (arg == "--log-config" && hasValue)
+            opt.logConfig = argv[++i];
+        else if (arg == "--params" && hasValue)
+            opt.params = argv[++i];
+        else if (arg == "--params-every" && hasValue)
+            opt.paramsEvery = atoi(argv[++i]);
+        else if (arg == "--write-params" && hasValue)
+            opt.writeParams = argv[++i];
+        else {
+            cerr << "unknown or incomplete option: " << arg << endl;
+            return false;
+        }
+    }
+
+    if (opt.fixedPoint != 0 && opt.fixedPoint != 8 && opt.fixedPoint != 16) {
+        cerr << "--fixed-point takes 8 or 16" << endl;
+        return false;
+    }
+    if (opt.fixedPoint)
+        opt.preprocess = true;
+    if (opt.backgroundEvery < 1)
+        opt.backgroundEvery = 1;
+    if (opt.queueDepth < 1)
+        opt.queueDepth = 1;
+    if (opt.updateEvery < 1 || opt.updateEvery > 255) {
+        cerr << "--update-every takes 1 to 255" << endl;
+        return false;
+    }
+    if (opt.rawChannels != 1 && opt.rawChannels != 3) {
+        cerr << "--raw-channels takes 1 or 3" << endl;
+        return false;
+    }
+    if (!opt.foregroundDir.empty() && opt.preprocess && opt.fixedPoint != 8) {
+        cerr << "--foreground-dir needs 8-bit model input, use --fixed-point 8 with -p" << endl;
+        return false;
+    }
+    bool zones = opt.zoneGrid.area() > 0 || !opt.zoneMap.empty();
+    if (zones != !opt.zonesOut.empty() || (opt.zoneGrid.area() > 0 && !opt.zoneMap.empty())) {
+        cerr << "--zones-out needs one of --zones and --zone-map, and they need it" << endl;
+        return false;
+    }
+    if (opt.zoneGrid.width < 0 || opt.zoneGrid.height < 0 || opt.zoneGrid.area() > USHRT_MAX) {
+        cerr << "--zones takes up to " << USHRT_MAX << " cells" << endl;
+        return false;
+    }
+    if (opt.checkpointEvery <= 0) {
+        cerr << "--checkpoint-every takes a positive number of seconds" << endl;
+        return false;
+    }
+    return !opt.input.empty() || !opt.writeParams.empty();
+}
+
+
+static bool hasSuffix(const string& s, const string& suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+
+static bool isDirectory(const string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+// memory-mapped reader for raw dumps and Y4M, prefetching decoder pool for
+// image directories, VideoCapture for anything else
+// channels is set to the channels of the frames the source reads
+static Ptr<FrameSource> openSource(const RunnerOptions& opt, BufferPool& pool, int& channels)
+{
+    // decoded images and videos are BGR
+    channels = 3;
+    if (isDirectory(opt.input)) {
+        ImageSequenceSource* images = new ImageSequenceSource(opt.input, opt.decodeThreads,
+                                                              opt.prefetch, opt.fps, &pool);
+        if (!images->isOpened()) {
+            delete images;
+            return Ptr<FrameSource>();
+        }
+        return Ptr<FrameSource>(images);
+    }
+
+    Ptr<MappedVideoFile> mapped;
+    if (opt.rawSize.area() > 0)
+        mapped = new MappedVideoFile(opt.input, opt.rawSize, CV_8UC(opt.rawChannels), opt.fps);
+    else if (hasSuffix(opt.input, ".y4m"))
+        mapped = new MappedVideoFile(opt.input);
+    else {
+        VideoFileSource* video = new VideoFileSource(opt.input);
+        if (!video->isOpened()) {
+            delete video;
+            return Ptr<FrameSource>();
+        }
+        return Ptr<FrameSource>(video);
+    }
+
+    if (!mapped->isOpened())
+        return Ptr<FrameSource>();
+    // raw dumps and Y4M (Cmono) may be grey
+    channels = CV_MAT_CN(mapped->frameType());
+    return Ptr<FrameSource>(new MappedVideoSource(mapped));
+}
+
+
+static string framePath(const string& dir, const char* prefix, int frameNo)
+{
+    char name[64];
+    sprintf(name, "/%s%06d.png", prefix, frameNo);
+    return dir + name;
+}
+
+
+static bool wantBackgrounds(const RunnerOptions& opt)
+{
+    return !opt.backgroundDir.empty() || !opt.archive.empty();
+}
+
+
+// one CSV line per frame: the frame, then foreground, shadow and changed pixels of every zone
+static void writeZones(ostream& out, const FramePacket& packet)
+{
+    out << packet.frameNo;
+    for (size_t z = 0; z < packet.zones.size(); z++)
+        out << "," << packet.zones[z].foreground << "," << packet.zones[z].shadow << "," << packet.zones[z].changed;
+    out << "\n";
+}
+
+
+// writes the requested outputs of one frame; the archive only queues them
+static void writeOutputs(const RunnerOptions& opt, MaskArchiveWriter* archive, ostream* zonesOut,
+                         const FramePacket& packet)
+{
+    // dropped by the scheduler
+    if (packet.fgmask.empty())
+        return;
+    if (zonesOut)
+        writeZones(*zonesOut, packet);
+    if (archive) {
+        archive->writeMask(packet.frameNo, packet.fgmask);
+        if (!packet.background.empty())
+            archive->writeBackground(packet.frameNo, packet.background);
+    }
+    if (!opt.maskDir.empty())
+        imwrite(framePath(opt.maskDir, "mask_", packet.frameNo), packet.fgmask);
+    if (!opt.backgroundDir.empty() && !packet.background.empty())
+        imwrite(framePath(opt.backgroundDir, "background_", packet.frameNo), packet.background);
+    if (!opt.foregroundDir.empty())
+        imwrite(framePath(opt.foregroundDir, "foreground_", packet.frameNo), packet.foreground);
+}
+
+
+static bool wantOutputs(const RunnerOptions& opt)
+{
+    return !opt.maskDir.empty() || !opt.foregroundDir.empty() || wantBackgrounds(opt) || !opt.zonesOut.empty();
+}
+
+
+// all stages one after the other on the calling thread
+static int runSerial(const RunnerOptions& opt, FrameSource& source, double rate,
+                     mdgkt* preProc, BackgroundSubtractorMOG3& bg_model, BufferPool& pool,
+                     MaskArchiveWriter* archive, ostream* zonesOut, PerfEventLog* events,
+                     DeadlineScheduler* scheduler)
+{
+    bg_model.setBufferPool(&pool);
+    if (preProc)
+        preProc->setBufferPool(&pool);
+
+    StageStats decodeStats("decode");
+    StageStats preprocessStats("preprocess");
+    StageStats modelStats("model");
+    StageStats backgroundStats("background");
+    StageStats outputStats("output");
+    StageStats frameStats("frame");
+
+    bool wantOutput = wantOutputs(opt);
+    FramePacket packet;
+    int frameNo = 0;
+    int64 startTick = getTickCount();
+
+    for(;;)
+    {
+        if (opt.maxFrames > 0 && frameNo >= opt.maxFrames)
+            break;
+
+        // real-time pacing: wait until frame is due
+        if (opt.realtime) {
+            double due = frameNo / rate;
+            double now = (getTickCount() - startTick) / getTickFrequency();
+            if (due > now)
+                usleep((useconds_t)((due - now) * 1e6));
+        }
+
+        packet.frameNo    = frameNo;
+        packet.decodeTick = getTickCount();
+        if (packet.frame.empty())
+            packet.frame.allocator = &pool;
+
+        decodeStats.start();
+        bool ok;
+        {
+            PerfScope event(events, PERF_DECODE, frameNo);
+            ok = source.read(packet.frame);
+        }
+        decodeStats.stop();
+        if (!ok)
+            break;
+
+        if (preProc) {
+            preprocessStats.start();
+            if (frameNo == 0)
+                preProc->initializeFirstImage(packet.frame);
+            preProc->SpatioTemporalPreprocessing(packet.frame, packet.image);
+            preprocessStats.stop();
+        }
+        else
+            packet.image = packet.frame;
+
+        // the archive may still hold last frame's mask, take a new buffer
+        if (archive)
+            packet.fgmask.release();
+
+        DeadlineScheduler::Decision decision = scheduler ? scheduler->decide(packet.decodeTick)
+                                                         : DeadlineScheduler::UPDATE;
+        modelStats.start();
+        runModel(bg_model, decision, packet, !opt.foregroundDir.empty());
+        modelStats.stop();
+        if (scheduler)
+            scheduler->finished(decision, modelStats.last(), packet.decodeTick);
+
+        packet.background.release();
+        if (wantBackgrounds(opt) && frameNo % opt.backgroundEvery == 0 &&
+            decision != DeadlineScheduler::DROP) {
+            backgroundStats.start();
+            bg_model.getBackgroundImage(packet.background);
+            backgroundStats.stop();
+        }
+
+        if (wantOutput) {
+            outputStats.start();
+            PerfScope event(events, PERF_OUTPUT, frameNo);
+            writeOutputs(opt, archive, zonesOut, packet);
+            outputStats.stop();
+        }
+
+        frameStats.add((getTickCount() - packet.decodeTick) / getTickFrequency());
+        frameNo++;
+    }
+
+    decodeStats.report(cout);
+    if (preProc)
+        preprocessStats.report(cout);
+    modelStats.report(cout);
+    if (backgroundStats.count())
+        backgroundStats.report(cout);
+    if (outputStats.count())
+        outputStats.report(cout);
+    frameStats.report(cout);
+
+    return frameNo;
+}
+
+
+// decode, preprocess, model and output overlapped on their own threads
+static int runPipelined(const RunnerOptions& opt, FrameSource& source, double rate,
+                        mdgkt* preProc, BackgroundSubtractorMOG3& bg_model, BufferPool& pool,
+                        MaskArchiveWriter* archive, ostream* zonesOut, PerfEventLog* events,
+                        DeadlineScheduler* scheduler)
+{
+    FramePipeline pipeline(source, bg_model, preProc, opt.queueDepth);
+    pipeline.setBufferPool(&pool);
+    pipeline.setEventLog(events);
+    pipeline.setScheduler(scheduler);
+
+    pipeline.setMaxFrames(opt.maxFrames);
+    if (opt.realtime)
+        pipeline.setRealtime(rate);
+    if (wantBackgrounds(opt))
+        pipeline.setBackgroundEvery(opt.backgroundEvery);
+    pipeline.setSnapshotBackgrounds(opt.snapshots);
+    pipeline.setForeground(!opt.foregroundDir.empty());
+    if (wantOutputs(opt))
+        pipeline.setOutput([&opt, archive, zonesOut](const FramePacket& packet) {
+            writeOutputs(opt, archive, zonesOut, packet);
+        });
+
+    int frames = pipeline.run();
+    pipeline.report(cout);
+
+    return frames;
+}
+
+
+static void printCounters(ostream& out, const ModelCounters::Snapshot& s)
+{
+    out << "model: " << s.frames << " frames, foreground " << 100*s.total.foregroundRatio()
+        << "%, shadow " << 100*s.total.shadowRatio() << "%, "
+        << s.total.newModes << " new modes, " << s.total.prunedModes << " pruned";
+    if (s.total.skipped)
+        out << ", " << 100*s.total.skippedRatio() << "% in skipped blocks";
+    out << endl;
+    out << "last frame: foreground " << 100*s.last.foregroundRatio()
+        << "%, shadow " << 100*s.last.shadowRatio() << "%, "
+        << s.last.newModes << " new modes, " << s.last.prunedModes << " pruned" << endl;
+
+    out << "modes per pixel:";
+    for (size_t i=0; i<s.modesHistogram.size(); i++)
+        out << " " << i << ":" << s.modesHistogram[i];
+    out << endl;
+
+    out << "stage time:";
+    for (int i=0; i<ModelCounters::STAGE_COUNT; i++)
+        out << " " << ModelCounters::stageName((ModelCounters::Stage)i) << " "
+            << s.total.stageSeconds[i] << " s";
+    out << endl;
+}
+
+
+int main( int argc, char** argv )
+{
+    RunnerOptions opt;
+    if (!parseOptions(argc, argv, opt)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!opt.writeParams.empty()) {
+        FileStorage fs(opt.writeParams, FileStorage::WRITE);
+        if (!fs.isOpened()) {
+            cerr << "cannot create " << opt.writeParams << endl;
+            return 1;
+        }
+        BackgroundSubtractorMOG3::Parameters().write(fs);
+        return 0;
+    }
+
+    if (opt.threads > 0)
+        setNumThreads(opt.threads);
+
+    log4cplus::initialize();
+    if (!opt.logConfig.empty())
+        log4cplus::PropertyConfigurator::doConfigure(LOG4CPLUS_STRING_TO_TSTRING(opt.logConfig));
+    else {
+        log4cplus::BasicConfigurator::doConfigure();
+        log4cplus::Logger::getRoot().setLogLevel(log4cplus::INFO_LOG_LEVEL);
+    }
+
+    // frames, masks and backgrounds are recycled, steady state does not allocate
+    BufferPool pool;
+
+    int channels;
+    Ptr<FrameSource> source = openSource(opt, pool, channels);
+    if (source.empty()) {
+        cerr << "cannot open " << opt.input << endl;
+        return 1;
+    }
+    if (opt.preprocess && channels != 3) {
+        cerr << "pre-processing needs colour frames, " << opt.input << " is grey" << endl;
+        return 2;
+    }
+
+    double rate = opt.fps > 0 ? opt.fps : source->fps();
+    if (opt.realtime && rate <= 0) {
+        cerr << "--realtime needs a frame rate, use --fps" << endl;
+        return 2;
+    }
+
+    mdgkt* preProc = opt.preprocess ? mdgkt::Instance() : NULL;
+    if (preProc && opt.fixedPoint)
+        preProc->setFixedPoint(true, opt.fixedPoint == 8 ? CV_8U : CV_16U);
+
+    // declared before the model, whose buffers it holds
+    Ptr<ModelArena> arena;
+    if (opt.hugePages)
+        arena = new ModelArena();
+
+    BackgroundSubtractorMOG3 bg_model(opt.history, opt.varThreshold, opt.shadows);
+    bg_model.setCompactModel(opt.compact);
+    bg_model.setCoarseToFine(opt.coarseToFine);
+    bg_model.setUpdateSubsampling(opt.updateEvery);
+    bg_model.setModelArena(arena);
+    // 16-bit pre-processed frames are Q8.8
+    if (preProc && opt.fixedPoint == 16)
+        bg_model.setFixedPointInput(mdgkt::FIXED_POINT_BITS);
+
+    Ptr<PinnedWorkerPool> workers;
+    if (opt.pinned) {
+        workers = new PinnedWorkerPool(opt.threads);
+        bg_model.setWorkerPool(workers);
+    }
+    if (!opt.params.empty() && !bg_model.loadParameters(opt.params, opt.paramsEvery)) {
+        cerr << "cannot load parameters from " << opt.params << endl;
+        return 1;
+    }
+
+    if (!opt.restore.empty()) {
+        ModelCheckpointReader reader(opt.restore);
+        if (!reader.restore(bg_model)) {
+            cerr << "no complete checkpoint in " << opt.restore << endl;
+            return 1;
+        }
+        cout << "restored model of " << reader.size().width << "x" << reader.size().height
+             << " at frame " << reader.frame() << endl;
+    }
+    // after the restore, whose model it continues
+    Ptr<ModelCheckpointWriter> checkpoints;
+    if (!opt.checkpoint.empty()) {
+        checkpoints = new ModelCheckpointWriter(bg_model, opt.checkpoint, opt.checkpointEvery);
+        if (!checkpoints->isOpened()) {
+            cerr << "cannot create " << opt.checkpoint << endl;
+            return 1;
+        }
+    }
+
+    ModelCounters counters;
+    if (opt.stats) {
+        bg_model.setCounters(&counters);
+        if (preProc)
+            preProc->setCounters(&counters);
+    }
+
+    // performance events, drained on their own thread
+    Ptr<PerfEventLog> events;
+    if (!opt.perfTrace.empty() || opt.perfLog) {
+        events = new PerfEventLog();
+        if (opt.perfLog)
+            events->enableLog();
+        if (!opt.perfTrace.empty() && !events->openTrace(opt.perfTrace)) {
+            cerr << "cannot create " << opt.perfTrace << endl;
+            return 1;
+        }
+        bg_model.setEventLog(events);
+        if (preProc)
+            preProc->setEventLog(events);
+        events->start();
+    }
+
+    Ptr<MaskArchiveWriter> archive;
+    if (!opt.archive.empty()) {
+        archive = new MaskArchiveWriter(opt.archive, opt.archiveQueue);
+        if (!archive->isOpened()) {
+            cerr << "cannot create " << opt.archive << endl;
+            return 1;
+        }
+    }
+
+    ZoneOccupancy zones;
+    ofstream zonesOut;
+    if (!opt.zonesOut.empty()) {
+        Mat labels = opt.zoneMap.empty() ? ZoneOccupancy::grid(opt.zoneGrid, opt.zoneGrid.width, opt.zoneGrid.height)
+                                         : imread(opt.zoneMap, CV_LOAD_IMAGE_UNCHANGED);
+        if (labels.empty() || labels.channels() != 1) {
+            cerr << "cannot read a grey label image from " << opt.zoneMap << endl;
+            return 1;
+        }
+        zonesOut.open(opt.zonesOut.c_str());
+        if (!zonesOut) {
+            cerr << "cannot create " << opt.zonesOut << endl;
+            return 1;
+        }
+        zones.setZones(labels);
+        bg_model.setZoneOccupancy(&zones);
+
+        zonesOut << "frame";
+        for (int z = 1; z <= zones.zones(); z++)
+            zonesOut << ",zone" << z << "_foreground,zone" << z << "_shadow,zone" << z << "_changed";
+        zonesOut << "\n";
+    }
+
+    int64 startTick = getTickCount();
+    Ptr<DeadlineScheduler> scheduler;
+    if (opt.deadline > 0)
+        scheduler = new DeadlineScheduler(opt.deadline / 1000, opt.maxSkip);
+
+    ostream* zonesStream = zonesOut.is_open() ? &zonesOut : NULL;
+    int frames = opt.serial ? runSerial(opt, *source, rate, preProc, bg_model, pool, archive, zonesStream,
+                                        events, scheduler)
+                            : runPipelined(opt, *source, rate, preProc, bg_model, pool, archive, zonesStream,
+                                           events, scheduler);
+    double elapsed = (getTickCount() - startTick) / getTickFrequency();
+
+    if (!archive.empty()) {
+        archive->close();
+        MaskArchiveWriter::Statistics archiveStats = archive->statistics();
+        cout << "archive: " << archiveStats.masksWritten << " masks, "
+             << archiveStats.backgroundsWritten << " backgrounds, dropped "
+             << archiveStats.masksDropped << " masks, "
+             << archiveStats.backgroundsDropped << " backgrounds, "
+             << archiveStats.failures << " write failures, "
+             << archiveStats.bytesOut / 1024 << " KB (ratio "
+             << (archiveStats.bytesOut ? (double)archiveStats.bytesIn / archiveStats.bytesOut : 0.) << ")" << endl;
+    }
+
+    cout << "frames " << frames << " in " << elapsed << " s, "
+         << (elapsed > 0 ? frames / elapsed : 0.) << " fps"
+         << (opt.serial ? " (serial)" : " (pipelined)") << endl;
+    if (!scheduler.empty())
+        scheduler->report(cout);
+
+    BufferPool::Statistics poolStats = pool.statistics();
+    cout << "buffer pool: " << poolStats.allocations << " allocations, "
+         << poolStats.reuses << " reuses, "
+         << poolStats.bytesReserved / (1 << 20) << " MB reserved" << endl;
+
+    if (!checkpoints.empty()) {
+        checkpoints->close();
+        ModelCheckpointWriter::Statistics checkpointStats = checkpoints->statistics();
+        cout << "checkpoints: " << checkpointStats.checkpoints << " ("
+             << checkpointStats.compactions << " full, "
+             << checkpointStats.failures << " failed), "
+             << checkpointStats.tilesWritten << " tiles written, "
+             << checkpointStats.tilesSkipped << " skipped, "
+             << checkpointStats.bytesWritten / 1024 << " KB, log "
+             << checkpointStats.logBytes / 1024 << " KB" << endl;
+    }
+
+    if (!arena.empty()) {
+        ModelArena::Statistics arenaStats = arena->statistics();
+        cout << "model arena: " << arenaStats.mappings << " mappings ("
+             << arenaStats.explicitHuge << " explicit, "
+             << arenaStats.transparentHuge << " transparent huge), "
+             << arenaStats.reuses << " reuses, "
+             << arenaStats.bytesMapped / (1 << 20) << " MB mapped" << endl;
+    }
+
+    if (opt.stats)
+        printCounters(cout, counters.snapshot());
+
+    if (!events.empty()) {
+        events->stop();
+        cout << "perf events: " << events->recorded() << " recorded, "
+             << events->dropped() << " dropped" << endl;
+    }
+
+    if (preProc)
+        mdgkt::deleteInstance();
+
+    return 0;
+}
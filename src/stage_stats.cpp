@@ -0,0 +1,65 @@
+//
+//  stage_stats.cpp
+//  sagmm
+//
+
+#include <algorithm>
+#include <iomanip>
+#include "stage_stats.h"
+
+
+StageStats::StageStats(const string& name, size_t expectedSamples)
+: stageName(name), capacity(std::max(expectedSamples, (size_t)1)), seen(0),
+  sum(0), lastSample(0), maxSample(0), random(0x9e3779b97f4a7c15ULL), tick(0)
+{
+    samples.reserve(capacity);
+}
+
+
+void StageStats::add(double seconds)
+{
+    seen++;
+    sum       += seconds;
+    lastSample = seconds;
+    maxSample  = seen == 1 ? seconds : std::max(maxSample, seconds);
+
+    if (samples.size() < capacity) {
+        samples.push_back(seconds);
+        return;
+    }
+    // reservoir sampling: the new sample replaces a kept one with probability capacity/seen
+    random = random*6364136223846793005ULL + 1442695040888963407ULL;
+    size_t k = (size_t)((random >> 16) % seen);
+    if (k < capacity)
+        samples[k] = seconds;
+}
+
+
+double StageStats::percentile(double q) const
+{
+    if (samples.empty())
+        return 0;
+    if (q >= 1)
+        return maxSample;
+
+    vector<double> sorted(samples);
+    size_t k = std::min(sorted.size()-1, (size_t)(q*(sorted.size()-1) + 0.5));
+    std::nth_element(sorted.begin(), sorted.begin()+k, sorted.end());
+    return sorted[k];
+}
+
+
+void StageStats::report(ostream& out) const
+{
+    double n = (double)seen;
+
+    out << setw(12) << left << stageName << right << fixed << setprecision(3)
+        << " calls "  << setw(7) << seen
+        << "  fps "   << setw(9) << (sum > 0 ? n/sum : 0.)
+        << "  mean "  << setw(8) << (n > 0 ? 1e3*sum/n : 0.)
+        << "  p50 "   << setw(8) << 1e3*percentile(0.50)
+        << "  p90 "   << setw(8) << 1e3*percentile(0.90)
+        << "  p99 "   << setw(8) << 1e3*percentile(0.99)
+        << "  max "   << setw(8) << 1e3*percentile(1.00)
+        << " ms" << endl;
+}
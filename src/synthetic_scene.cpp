@@ -0,0 +1,117 @@
+//
+//  synthetic_scene.cpp
+//  sagmm
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include "synthetic_scene.h"
+
+
+SyntheticScene::SyntheticScene(const SceneConfig& config)
+: cfg(config), rng(config.seed), frameNo(0), gain(1.0)
+{
+    CV_Assert( cfg.channels == 1 || cfg.channels == 3 );
+    CV_Assert( cfg.size.area() > 0 );
+
+    const Size size = cfg.size;
+    const int  type = CV_32FC(cfg.channels);
+
+    // smooth large-scale structure plus fine grain
+    Mat coarse(size.height/16 + 2, size.width/16 + 2, type);
+    rng.fill(coarse, RNG::UNIFORM, Scalar::all(40), Scalar::all(215));
+    resize(coarse, texture, size, 0, 0, INTER_LINEAR);
+
+    Mat grain(size, type);
+    rng.fill(grain, RNG::NORMAL, Scalar::all(0), Scalar::all(12));
+    GaussianBlur(grain, grain, Size(0,0), 1.0);
+    texture += grain;
+
+    for (int i=0; i<cfg.shapes; i++) {
+        Shape s;
+        s.ellipse  = i % 2 == 1;
+        s.size     = Size(rng.uniform(size.width/12, size.width/5 + 1),
+                          rng.uniform(size.height/12, size.height/5 + 1));
+        s.position = Point2f((float)rng.uniform(0, std::max(size.width  - s.size.width,  1)),
+                             (float)rng.uniform(0, std::max(size.height - s.size.height, 1)));
+
+        float vx = rng.uniform(1.f, 4.f), vy = rng.uniform(0.5f, 2.f);
+        s.velocity = Point2f(rng.uniform(0, 2) ? vx : -vx, rng.uniform(0, 2) ? vy : -vy);
+        s.colour   = Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+
+        // light from the top left
+        s.shadowOffset = Point(s.size.width/3, s.size.height/4);
+        objects.push_back(s);
+    }
+}
+
+
+void SyntheticScene::draw(const Shape& shape, Point offset, Mat& image, const Scalar& colour) const
+{
+    Point corner(cvRound(shape.position.x) + offset.x, cvRound(shape.position.y) + offset.y);
+    if (shape.ellipse) {
+        Point center(corner.x + shape.size.width/2, corner.y + shape.size.height/2);
+        ellipse(image, center, Size(shape.size.width/2, shape.size.height/2), 0, 0, 360, colour, -1);
+    }
+    else
+        rectangle(image, Rect(corner, shape.size), colour, -1);
+}
+
+
+bool SyntheticScene::read(Mat& frame)
+{
+    if (cfg.frames > 0 && frameNo >= cfg.frames)
+        return false;
+
+    // illumination alternates between the initial and a brighter level
+    if (cfg.illuminationPeriod > 0 && frameNo > 0 && frameNo % cfg.illuminationPeriod == 0)
+        gain = (frameNo / cfg.illuminationPeriod) % 2 ? 1.0 + cfg.illuminationStep : 1.0;
+
+    shapeMask.create(cfg.size, CV_8U);
+    shapeMask = Scalar::all(0);
+    shadowMask.create(cfg.size, CV_8U);
+    shadowMask = Scalar::all(0);
+
+    for (size_t i=0; i<objects.size(); i++) {
+        draw(objects[i], Point(0,0), shapeMask, Scalar::all(FOREGROUND));
+        if (cfg.shadows)
+            draw(objects[i], objects[i].shadowOffset, shadowMask, Scalar::all(FOREGROUND));
+    }
+    // objects occlude shadows
+    shadowMask.setTo(Scalar::all(0), shapeMask);
+
+    texture.convertTo(lit, -1, gain);
+    if (cfg.shadows) {
+        lit.convertTo(shaded, -1, cfg.shadowGain);
+        shaded.copyTo(lit, shadowMask);
+    }
+    for (size_t i=0; i<objects.size(); i++)
+        draw(objects[i], Point(0,0), lit, objects[i].colour * gain);
+
+    if (cfg.noiseSigma > 0) {
+        noise.create(cfg.size, lit.type());
+        rng.fill(noise, RNG::NORMAL, Scalar::all(0), Scalar::all(cfg.noiseSigma));
+        lit += noise;
+    }
+    lit.convertTo(frame, CV_8UC(cfg.channels));
+
+    truth.create(cfg.size, CV_8U);
+    truth = Scalar::all(BACKGROUND);
+    truth.setTo(Scalar::all(SHADOW), shadowMask);
+    truth.setTo(Scalar::all(FOREGROUND), shapeMask);
+
+    // constant velocity, bouncing once half an object has left the frame
+    for (size_t i=0; i<objects.size(); i++) {
+        Shape& s = objects[i];
+        s.position += s.velocity;
+        if (s.position.x < -s.size.width/2 || s.position.x > cfg.size.width - s.size.width/2)
+            s.velocity.x = -s.velocity.x;
+        if (s.position.y < -s.size.height/2 || s.position.y > cfg.size.height - s.size.height/2)
+            s.velocity.y = -s.velocity.y;
+    }
+
+    frameNo++;
+    return true;
+}
@@ -0,0 +1,192 @@
+//
+//  test_allocations.cpp
+//  sagmm
+//
+//  Counts heap allocations over steady-state frames of the pipeline with
+//  the buffer pool on; any allocation there is a regression.
+//
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "background_subtraction.h"
+#include "buffer_pool.h"
+#include "frame_pipeline.h"
+#include "mdgkt_filter.h"
+#include "synthetic_scene.h"
+
+
+using namespace std;
+using namespace cv;
+
+static std::atomic<bool>   counting(false);
+static std::atomic<size_t> allocations(0);
+
+#if defined(__GLIBC__)
+
+// Interposes the allocator entry points: operator new, OpenCV's fastMalloc
+// and the containers all end in one of these.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void  __libc_free(void* p);
+
+static inline void countAllocation()
+{
+    if (counting.load(std::memory_order_relaxed))
+        allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* malloc(size_t size)
+{
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    countAllocation();
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    countAllocation();
+    return __libc_realloc(p, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size)
+{
+    countAllocation();
+    *p = __libc_memalign(alignment, size);
+    return *p ? 0 : ENOMEM;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void free(void* p)
+{
+    __libc_free(p);
+}
+}
+
+#endif
+
+
+/**
+ * Replays frames rendered up front, so the source itself (drawing the
+ * scene) does not allocate; read() copies into the pool buffer the
+ * pipeline hands it.
+ */
+class ReplaySource : public FrameSource
+{
+public:
+    ReplaySource(const SceneConfig& config, int rendered)
+    {
+        SyntheticScene scene(config);
+        Mat frame;
+        while ((int)frames.size() < rendered && scene.read(frame))
+            frames.push_back(frame.clone());
+        next = 0;
+    }
+
+    bool read(Mat& frame)
+    {
+        if (frames.empty())
+            return false;
+        frames[next++ % frames.size()].copyTo(frame);
+        return true;
+    }
+    double fps() const { return 25; }
+
+private:
+    vector<Mat> frames;
+    size_t next;
+};
+
+
+// Frames before counting starts (pool, history and model filled) and frames counted.
+static const int WARMUP_FRAMES  = 40;
+static const int COUNTED_FRAMES = 100;
+
+// Runs the pipeline with the pool on and returns the allocations made while
+// the output stage saw the counted frames.
+static size_t steadyStateAllocations(bool preprocess, bool fixedPoint)
+{
+    SceneConfig config;
+    config.size = Size(160, 120);
+    ReplaySource source(config, 32);
+
+    BufferPool pool;
+    BackgroundSubtractorMOG3 model;
+
+    mdgkt* preProc = NULL;
+    if (preprocess) {
+        preProc = mdgkt::Instance();
+        if (fixedPoint)
+            preProc->setFixedPoint(true, CV_8U);
+    }
+
+    FramePipeline pipeline(source, model, preProc);
+    pipeline.setBufferPool(&pool);
+    pipeline.setBackgroundEvery(1);
+    pipeline.setForeground(true);
+    // the stages ahead of the output stop well after the counted window
+    pipeline.setMaxFrames(WARMUP_FRAMES + COUNTED_FRAMES + 64);
+
+    allocations = 0;
+    pipeline.setOutput([](const FramePacket& packet) {
+        if (packet.frameNo == WARMUP_FRAMES)
+            counting = true;
+        else if (packet.frameNo == WARMUP_FRAMES + COUNTED_FRAMES)
+            counting = false;
+    });
+    pipeline.run();
+    counting = false;
+
+    if (preProc)
+        mdgkt::deleteInstance();
+    return allocations;
+}
+
+
+int main()
+{
+#if !defined(__GLIBC__)
+    cout << "allocation counting needs glibc, skipped" << endl;
+    return 0;
+#endif
+
+    struct { const char* name; bool preprocess, fixedPoint; } configs[] = {
+        { "model",          false, false },
+        { "mdgkt float",    true,  false },
+        { "mdgkt fixed 8",  true,  true  },
+    };
+
+    int failed = 0;
+    for (size_t i=0; i<sizeof(configs)/sizeof(configs[0]); i++) {
+        size_t n = steadyStateAllocations(configs[i].preprocess, configs[i].fixedPoint);
+        cout << configs[i].name << ": " << n << " allocations in "
+             << COUNTED_FRAMES << " steady-state frames" << endl;
+        if (n > 0)
+            failed++;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+//
+//  test_checkpoint.cpp
+//  sagmm
+//
+//  Round trip of the checkpoint log: a model restored from a log, also one
+//  cut short mid-record, equals the model as of the last complete
+//  checkpoint.
+//
+
+#include <opencv2/core/core.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "background_subtraction.h"
+#include "model_checkpoint.h"
+#include "model_snapshot.h"
+#include "synthetic_scene.h"
+
+
+using namespace std;
+using namespace cv;
+
+// The model's tiles as ModelSnapshot::readTile() gives them.
+struct ModelTiles
+{
+    int frame;
+    vector<Mat> modesUsed;
+    vector<Mat> records;
+};
+
+
+static ModelTiles readModel(BackgroundSubtractorMOG3& model)
+{
+    ModelTiles tiles;
+    std::shared_ptr<const ModelSnapshot> snapshot = model.snapshot();
+    tiles.frame = snapshot->frame();
+    for (int t = 0; t < snapshot->tiles(); t++) {
+        Mat modesUsed, records;
+        snapshot->readTile(t, modesUsed, records);
+        tiles.modesUsed.push_back(modesUsed);
+        tiles.records.push_back(records);
+    }
+    return tiles;
+}
+
+
+static bool sameMat(const Mat& a, const Mat& b)
+{
+    return a.size() == b.size() && a.type() == b.type() && norm(a, b, NORM_INF) == 0;
+}
+
+
+static bool sameModel(const ModelTiles& a, const ModelTiles& b)
+{
+    if (a.frame != b.frame || a.modesUsed.size() != b.modesUsed.size())
+        return false;
+    for (size_t t = 0; t < a.modesUsed.size(); t++)
+        if (!sameMat(a.modesUsed[t], b.modesUsed[t]) || !sameMat(a.records[t], b.records[t]))
+            return false;
+    return true;
+}
+
+
+static bool readFile(const string& fileName, vector<uchar>& bytes)
+{
+    FILE* f = fopen(fileName.c_str(), "rb");
+    if (!f)
+        return false;
+    bytes.clear();
+    uchar buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        bytes.insert(bytes.end(), buf, buf + n);
+    fclose(f);
+    return true;
+}
+
+
+static bool writeFile(const string& fileName, const vector<uchar>& bytes, size_t length)
+{
+    FILE* f = fopen(fileName.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = length == 0 || fwrite(&bytes[0], 1, length, f) == length;
+    return fclose(f) == 0 && ok;
+}
+
+
+// waits for the writer thread to finish n checkpoints in all
+static bool waitForCheckpoints(const ModelCheckpointWriter& writer, size_t n)
+{
+    for (int i = 0; i < 1000 && writer.statistics().checkpoints < n; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return writer.statistics().checkpoints >= n;
+}
+
+
+static void runFrames(BackgroundSubtractorMOG3& model, SyntheticScene& scene, int n)
+{
+    Mat frame, fgmask;
+    for (int i = 0; i < n && scene.read(frame); i++)
+        model(frame, fgmask);
+}
+
+
+// A log and a torn copy of it under TMPDIR, removed however the test ends.
+struct TempLogs
+{
+    string log, torn;
+
+    TempLogs()
+    {
+        const char* dir = getenv("TMPDIR");
+        string name = string(dir && *dir ? dir : "/tmp") + "/test_checkpoint.XXXXXX";
+        vector<char> path(name.begin(), name.end());
+        path.push_back('\0');
+        int fd = mkstemp(&path[0]);
+        if (fd < 0)
+            return;
+        close(fd);
+        log  = &path[0];
+        torn = log + ".torn";
+    }
+
+    ~TempLogs()
+    {
+        if (log.empty())
+            return;
+        remove(log.c_str());
+        remove((log + ".tmp").c_str());
+        remove(torn.c_str());
+    }
+};
+
+
+// restores a fresh model from the log and compares it with expected
+static bool restoresTo(const string& fileName, const ModelTiles& expected, const char* what)
+{
+    ModelCheckpointReader reader(fileName);
+    BackgroundSubtractorMOG3 restored;
+    bool ok = reader.isOpened() && reader.restore(restored) &&
+              reader.frame() == expected.frame && sameModel(readModel(restored), expected);
+    cout << what << ": " << (ok ? "ok" : "FAILED") << endl;
+    return ok;
+}
+
+
+int main()
+{
+    TempLogs files;
+    if (files.log.empty()) {
+        cout << "cannot create a temporary file" << endl;
+        return 1;
+    }
+    const string& logName  = files.log;
+    const string& tornName = files.torn;
+
+    SceneConfig config;
+    config.size = Size(160, 120);
+    SyntheticScene scene(config);
+    BackgroundSubtractorMOG3 model;
+    runFrames(model, scene, 30);
+
+    ModelTiles committed, last;
+    {
+        // checkpoints only on request, every tile every time
+        ModelCheckpointWriter writer(model, logName, 0);
+        if (!writer.isOpened()) {
+            cout << "cannot write " << logName << endl;
+            return 1;
+        }
+        writer.setDirtyThreshold(0);
+
+        writer.checkpoint();        // the full one
+        bool ok = waitForCheckpoints(writer, 1);
+        runFrames(model, scene, 20);
+        writer.checkpoint();        // appended to the log
+        ok = ok && waitForCheckpoints(writer, 2);
+        committed = readModel(model);
+
+        runFrames(model, scene, 20);
+        writer.close();             // a last one
+        last = readModel(model);
+        if (!ok || writer.statistics().failures > 0 || writer.statistics().checkpoints != 3) {
+            cout << "checkpoints not written" << endl;
+            return 1;
+        }
+    }
+
+    vector<uchar> log;
+    if (!readFile(logName, log))
+        return 1;
+
+    int failed = 0;
+    failed += !restoresTo(logName, last, "complete log");
+
+    // a writer killed while appending the header of the next record
+    vector<uchar> torn(log);
+    const char tile[] = "TILE\x40\x00\x00\x00\x12\x34";
+    torn.insert(torn.end(), tile, tile + sizeof(tile) - 1);
+    failed += !(writeFile(tornName, torn, torn.size()) && restoresTo(tornName, last, "torn record header"));
+
+    // cut inside the last TILE of the last checkpoint: its commit (the
+    // 20-byte CMIT at the end) is gone and the one before is replayed
+    failed += !(writeFile(tornName, log, log.size() - 20 - 7) && restoresTo(tornName, committed, "torn checkpoint"));
+
+    // a log without a single commit restores nothing
+    {
+        writeFile(tornName, log, 8 + 12 + 20 + 5);
+        ModelCheckpointReader reader(tornName);
+        bool ok = !reader.isOpened();
+        cout << "no commit: " << (ok ? "ok" : "FAILED") << endl;
+        failed += !ok;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+//
+//  worker_pool.cpp
+//  sagmm
+//
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "worker_pool.h"
+
+
+PinnedWorkerPool::PinnedWorkerPool(int workers, const NumaTopology& topology)
+: job(NULL), jobRange(0, 0), generation(0), pending(0), stopping(false)
+{
+    if (workers <= 0)
+        workers = topology.cpus();
+
+    // worker i on node i*nodes/workers, CPUs of a node taken in order
+    int nnodes = topology.nodes();
+    vector<int> used(nnodes, 0);
+    for (int i=0; i<workers; i++) {
+        int n = (int)((int64)i*nnodes/workers);
+        const NumaNode& node = topology.node(n);
+        cpus.push_back(node.cpus[used[n]++ % node.cpus.size()]);
+        nodes.push_back(node.id);
+    }
+
+    for (int i=0; i<workers; i++)
+        threads.push_back(std::thread(&PinnedWorkerPool::worker, this, i));
+}
+
+
+PinnedWorkerPool::~PinnedWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i=0; i<threads.size(); i++)
+        threads[i].join();
+}
+
+
+Range PinnedWorkerPool::band(int i, const Range& range) const
+{
+    int n = workers();
+    int64 size = range.size();
+    return Range(range.start + (int)(size*i/n), range.start + (int)(size*(i + 1)/n));
+}
+
+
+void PinnedWorkerPool::run(const ParallelLoopBody& body, const Range& range)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    job      = &body;
+    jobRange = range;
+    pending  = workers();
+    generation++;
+    wake.notify_all();
+
+    while (pending > 0)
+        finished.wait(guard);
+    job = NULL;
+}
+
+
+void PinnedWorkerPool::worker(int i)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[i], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+
+    uint64 seen = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        while (!stopping && generation == seen)
+            wake.wait(guard);
+        if (stopping)
+            return;
+        seen = generation;
+
+        const ParallelLoopBody* body = job;
+        Range part = band(i, jobRange);
+        guard.unlock();
+
+        if (!part.empty())
+            (*body)(part);
+
+        guard.lock();
+        if (--pending == 0)
+            finished.notify_one();
+    }
+}
@@ -0,0 +1,113 @@
+//
+//  zone_occupancy.cpp
+//  sagmm
+//
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <climits>
+
+#include "zone_occupancy.h"
+
+
+ZoneOccupancy::ZoneOccupancy()
+: nzones(0), currentFrame(-1), lastFrame(-1)
+{
+}
+
+
+void ZoneOccupancy::setZones(const Mat& _labels)
+{
+    CV_Assert( _labels.channels() == 1 && _labels.depth() != CV_32F && _labels.depth() != CV_64F );
+
+    double maxLabel = 0;
+    minMaxLoc(_labels, NULL, &maxLabel);
+    CV_Assert( maxLabel <= USHRT_MAX );
+    _labels.convertTo(labels, CV_16U);
+    frameLabels.release();
+
+    std::lock_guard<std::mutex> guard(lock);
+    nzones = (int)maxLabel;
+    current.assign(nzones, Counts());
+    last.assign(nzones, Counts());
+    lastFrame = -1;
+}
+
+
+Mat ZoneOccupancy::grid(Size frame, int cols, int rows)
+{
+    CV_Assert( cols >= 1 && rows >= 1 && cols*rows <= USHRT_MAX );
+
+    Mat grid(frame, CV_16U);
+    for (int y = 0; y < frame.height; y++) {
+        ushort* label = grid.ptr<ushort>(y);
+        int row = y*rows / frame.height;
+        for (int x = 0; x < frame.width; x++)
+            label[x] = (ushort)(1 + row*cols + x*cols / frame.width);
+    }
+    return grid;
+}
+
+
+Mat ZoneOccupancy::polygons(Size frame, const vector<vector<Point> >& polygons)
+{
+    CV_Assert( polygons.size() <= USHRT_MAX );
+
+    Mat labels(frame, CV_16U, Scalar::all(0));
+    for (size_t i = 0; i < polygons.size(); i++) {
+        if (polygons[i].empty())
+            continue;
+        const Point* points = &polygons[i][0];
+        int npoints = (int)polygons[i].size();
+        fillPoly(labels, &points, &npoints, 1, Scalar::all((double)(i + 1)));
+    }
+    return labels;
+}
+
+
+void ZoneOccupancy::prepare(Size frame)
+{
+    if (frameLabels.size() == frame)
+        return;
+    CV_Assert( !labels.empty() );
+    if (labels.size() == frame)
+        frameLabels = labels;
+    else
+        resize(labels, frameLabels, frame, 0, 0, INTER_NEAREST);
+    previous.create(frame, CV_8U);
+    previous = Scalar::all(0);
+}
+
+
+void ZoneOccupancy::beginFrame(int frame)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    current.assign(nzones, Counts());
+    currentFrame = frame;
+}
+
+
+void ZoneOccupancy::addPartial(const vector<Counts>& partial)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (int z = 0; z < nzones; z++) {
+        current[z].foreground += partial[z].foreground;
+        current[z].shadow     += partial[z].shadow;
+        current[z].changed    += partial[z].changed;
+    }
+}
+
+
+void ZoneOccupancy::endFrame()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    last.swap(current);
+    lastFrame = currentFrame;
+}
+
+
+int ZoneOccupancy::latest(vector<Counts>& counts) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    counts = last;
+    return lastFrame;
+}